@@ -0,0 +1,128 @@
+package jmi;
+
+import java.lang.invoke.MethodHandle;
+import java.lang.invoke.MethodHandles;
+import java.lang.reflect.Method;
+import java.lang.reflect.Modifier;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+
+/**
+ * Replays method calls recorded by c++ jmi::CommandBuffer in 1 jni call.
+ * A command is int method, int target, int status, int argc, 8 bytes result, and argc 8 bytes arguments(jvalue) in native byte order.
+ * Object targets and arguments are indexes of refs, object results and exceptions are stored in out.
+ */
+public final class CommandBuffer {
+    private static final int HEADER_SIZE = 24;
+    private static final int SLOT_SIZE = 8;
+
+    private static final class Entry {
+        final MethodHandle handle; // (Object[])Object, the first element is the target object for instance methods
+        final char[] params;
+        final char ret;
+        final boolean isStatic;
+
+        Entry(MethodHandle handle, char[] params, char ret, boolean isStatic) {
+            this.handle = handle;
+            this.params = params;
+            this.ret = ret;
+            this.isStatic = isStatic;
+        }
+    }
+    private static volatile Entry[] entries = new Entry[0]; // copy on write, execute() reads without lock
+
+    private CommandBuffer() {}
+
+    // m is from jni ToReflectedMethod(). returns index of the method
+    static synchronized int add(Method m) throws IllegalAccessException {
+        try {
+            m.setAccessible(true);
+        } catch (RuntimeException e) { // inaccessible module, public methods still work
+        }
+        final boolean isStatic = Modifier.isStatic(m.getModifiers());
+        MethodHandle h = MethodHandles.lookup().unreflect(m);
+        h = h.asType(h.type().generic()).asSpreader(Object[].class, h.type().parameterCount());
+        final Class<?>[] types = m.getParameterTypes();
+        final char[] params = new char[types.length];
+        for (int i = 0; i < types.length; ++i)
+            params[i] = typeChar(types[i]);
+        final Entry[] es = java.util.Arrays.copyOf(entries, entries.length + 1);
+        es[es.length - 1] = new Entry(h, params, typeChar(m.getReturnType()), isStatic);
+        entries = es;
+        return es.length - 1;
+    }
+
+    // returns the number of failed commands
+    static int execute(ByteBuffer cmds, int count, Object[] refs, Object[] out) {
+        final Entry[] es = entries;
+        final ByteBuffer b = cmds.order(ByteOrder.nativeOrder());
+        int failed = 0;
+        for (int i = 0, pos = 0; i < count; ++i) {
+            final Entry e = es[b.getInt(pos)];
+            final int argc = b.getInt(pos + 12);
+            final Object[] args = new Object[e.isStatic ? argc : argc + 1];
+            int k = 0;
+            if (!e.isStatic)
+                args[k++] = refs[b.getInt(pos + 4)];
+            for (int j = 0; j < argc; ++j)
+                args[k++] = read(b, pos + HEADER_SIZE + j * SLOT_SIZE, e.params[j], refs);
+            out[i] = null;
+            try {
+                final Object r = (Object)e.handle.invokeExact(args);
+                write(b, pos + 16, e.ret, r, out, i);
+                b.putInt(pos + 8, 0);
+            } catch (Throwable t) {
+                out[i] = t;
+                b.putInt(pos + 8, 1);
+                ++failed;
+            }
+            pos += HEADER_SIZE + argc * SLOT_SIZE;
+        }
+        return failed;
+    }
+
+    private static char typeChar(Class<?> c) {
+        if (c == void.class) return 'V';
+        if (c == boolean.class) return 'Z';
+        if (c == byte.class) return 'B';
+        if (c == char.class) return 'C';
+        if (c == short.class) return 'S';
+        if (c == int.class) return 'I';
+        if (c == long.class) return 'J';
+        if (c == float.class) return 'F';
+        if (c == double.class) return 'D';
+        return 'L';
+    }
+
+    private static Object read(ByteBuffer b, int pos, char type, Object[] refs) {
+        switch (type) {
+        case 'Z': return b.get(pos) != 0;
+        case 'B': return b.get(pos);
+        case 'C': return b.getChar(pos);
+        case 'S': return b.getShort(pos);
+        case 'I': return b.getInt(pos);
+        case 'J': return b.getLong(pos);
+        case 'F': return b.getFloat(pos);
+        case 'D': return b.getDouble(pos);
+        default: {
+            final int i = b.getInt(pos);
+            return i < 0 ? null : refs[i];
+        }
+        }
+    }
+
+    private static void write(ByteBuffer b, int pos, char type, Object r, Object[] out, int i) {
+        switch (type) {
+        case 'V': break;
+        case 'Z': b.put(pos, (byte)((Boolean)r ? 1 : 0)); break;
+        case 'B': b.put(pos, (Byte)r); break;
+        case 'C': b.putChar(pos, (Character)r); break;
+        case 'S': b.putShort(pos, (Short)r); break;
+        case 'I': b.putInt(pos, (Integer)r); break;
+        case 'J': b.putLong(pos, (Long)r); break;
+        case 'F': b.putFloat(pos, (Float)r); break;
+        case 'D': b.putDouble(pos, (Double)r); break;
+        default: out[i] = r; break;
+        }
+    }
+}
@@ -0,0 +1,173 @@
+package jmi;
+
+import java.util.ArrayList;
+import java.util.Arrays;
+import java.util.Collection;
+import java.util.HashMap;
+import java.util.Iterator;
+import java.util.LinkedHashSet;
+import java.util.Map;
+
+/**
+ * Bulk conversions between java containers and c++ containers, a constant number of jni calls per chunk or container.
+ * type is the jni type of c++ elements, boxed elements are packed into a primitive array if it's a primitive type, otherwise Object[].
+ * Parameters and return values are Object, so c++ can call them for any element type.
+ */
+public final class Containers {
+    private Containers() {}
+
+    static Iterator<?> iterator(Object source) {
+        if (source instanceof Iterator)
+            return (Iterator<?>)source;
+        if (source instanceof Iterable)
+            return ((Iterable<?>)source).iterator();
+        throw new IllegalArgumentException("not an Iterator or Iterable: " + source.getClass().getName());
+    }
+
+    // returns at most max elements of it
+    static Object next(Iterator<?> it, int max, char type) {
+        final Object[] a = new Object[max];
+        int n = 0;
+        for (; n < max && it.hasNext(); ++n)
+            a[n] = it.next();
+        return pack(a, n, type);
+    }
+
+    static Object toArray(Object collection, char type) {
+        final Object[] a = ((Collection<?>)collection).toArray();
+        return pack(a, a.length, type);
+    }
+
+    // returns {keys, values}
+    static Object entries(Object map, char keyType, char valueType) {
+        final Map<?, ?> m = (Map<?, ?>)map;
+        final Object[] k = new Object[m.size()];
+        final Object[] v = new Object[k.length];
+        int n = 0;
+        for (Map.Entry<?, ?> e : m.entrySet()) {
+            k[n] = e.getKey();
+            v[n++] = e.getValue();
+        }
+        return new Object[]{pack(k, n, keyType), pack(v, n, valueType)};
+    }
+
+    static Object newList(Object array) {
+        return new ArrayList<>(Arrays.asList(box(array)));
+    }
+
+    static Object newSet(Object array) {
+        return new LinkedHashSet<>(Arrays.asList(box(array)));
+    }
+
+    static Object newMap(Object keys, Object values) {
+        final Object[] k = box(keys);
+        final Object[] v = box(values);
+        final HashMap<Object, Object> m = new HashMap<>(k.length * 4 / 3 + 1);
+        for (int i = 0; i < k.length; ++i)
+            m.put(k[i], v[i]);
+        return m;
+    }
+
+    private static Object pack(Object[] a, int n, char type) {
+        switch (type) {
+        case 'Z': {
+            final boolean[] p = new boolean[n];
+            for (int i = 0; i < n; ++i)
+                p[i] = (Boolean)a[i];
+            return p;
+        }
+        case 'B': {
+            final byte[] p = new byte[n];
+            for (int i = 0; i < n; ++i)
+                p[i] = ((Number)a[i]).byteValue();
+            return p;
+        }
+        case 'C': {
+            final char[] p = new char[n];
+            for (int i = 0; i < n; ++i)
+                p[i] = (Character)a[i];
+            return p;
+        }
+        case 'S': {
+            final short[] p = new short[n];
+            for (int i = 0; i < n; ++i)
+                p[i] = ((Number)a[i]).shortValue();
+            return p;
+        }
+        case 'I': {
+            final int[] p = new int[n];
+            for (int i = 0; i < n; ++i)
+                p[i] = ((Number)a[i]).intValue();
+            return p;
+        }
+        case 'J': {
+            final long[] p = new long[n];
+            for (int i = 0; i < n; ++i)
+                p[i] = ((Number)a[i]).longValue();
+            return p;
+        }
+        case 'F': {
+            final float[] p = new float[n];
+            for (int i = 0; i < n; ++i)
+                p[i] = ((Number)a[i]).floatValue();
+            return p;
+        }
+        case 'D': {
+            final double[] p = new double[n];
+            for (int i = 0; i < n; ++i)
+                p[i] = ((Number)a[i]).doubleValue();
+            return p;
+        }
+        default:
+            return n < a.length ? Arrays.copyOf(a, n) : a;
+        }
+    }
+
+    private static Object[] box(Object array) {
+        if (array instanceof Object[])
+            return (Object[])array;
+        final Object[] a;
+        if (array instanceof boolean[]) {
+            final boolean[] p = (boolean[])array;
+            a = new Object[p.length];
+            for (int i = 0; i < p.length; ++i)
+                a[i] = p[i];
+        } else if (array instanceof byte[]) {
+            final byte[] p = (byte[])array;
+            a = new Object[p.length];
+            for (int i = 0; i < p.length; ++i)
+                a[i] = p[i];
+        } else if (array instanceof char[]) {
+            final char[] p = (char[])array;
+            a = new Object[p.length];
+            for (int i = 0; i < p.length; ++i)
+                a[i] = p[i];
+        } else if (array instanceof short[]) {
+            final short[] p = (short[])array;
+            a = new Object[p.length];
+            for (int i = 0; i < p.length; ++i)
+                a[i] = p[i];
+        } else if (array instanceof int[]) {
+            final int[] p = (int[])array;
+            a = new Object[p.length];
+            for (int i = 0; i < p.length; ++i)
+                a[i] = p[i];
+        } else if (array instanceof long[]) {
+            final long[] p = (long[])array;
+            a = new Object[p.length];
+            for (int i = 0; i < p.length; ++i)
+                a[i] = p[i];
+        } else if (array instanceof float[]) {
+            final float[] p = (float[])array;
+            a = new Object[p.length];
+            for (int i = 0; i < p.length; ++i)
+                a[i] = p[i];
+        } else {
+            final double[] p = (double[])array;
+            a = new Object[p.length];
+            for (int i = 0; i < p.length; ++i)
+                a[i] = p[i];
+        }
+        return a;
+    }
+}
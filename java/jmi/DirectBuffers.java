@@ -0,0 +1,22 @@
+package jmi;
+
+import java.lang.ref.Cleaner;
+import java.nio.ByteBuffer;
+
+/**
+ * Ties the lifetime of native memory to direct ByteBuffers created by jni NewDirectByteBuffer(), e.g. jmi::MappedBuffer::window().
+ * The release callback is called once after the returned buffer is garbage collected. Keep the returned buffer reachable while its views
+ * (duplicate(), slice(), asReadOnlyBuffer()) are used.
+ */
+public final class DirectBuffers {
+    static final Cleaner CLEANER = Cleaner.create(); // shared by jmi classes, 1 thread per Cleaner
+
+    private DirectBuffers() {}
+
+    // returns buf, or a read-only view of buf if readOnly
+    public static ByteBuffer track(ByteBuffer buf, NativeCallback release, boolean readOnly) {
+        final ByteBuffer tracked = readOnly ? buf.asReadOnlyBuffer() : buf;
+        CLEANER.register(tracked, () -> release.call()); // must not capture the buffer
+        return tracked;
+    }
+}
@@ -0,0 +1,43 @@
+package jmi;
+
+import java.lang.reflect.InvocationHandler;
+import java.lang.reflect.Method;
+import java.lang.reflect.Proxy;
+
+/**
+ * Calls a c++ callable registered by jmi::Callback. The object is created by jmi::Callback::object().
+ * Primitive arguments are boxed, and converted to parameter types of the c++ callable.
+ */
+public final class NativeCallback {
+    private final long handle;
+
+    public NativeCallback(long handle) { this.handle = handle; }
+
+    public long handle() { return handle; }
+
+    // throws IllegalStateException if the c++ callback is released, IllegalArgumentException if an argument is null or can not be converted,
+    // RuntimeException if the c++ callable throws
+    public Object call(Object... args) {
+        return nativeCall(handle, args);
+    }
+
+    // implements a listener interface, every method of iface calls the c++ callable with the same arguments
+    @SuppressWarnings("unchecked")
+    public <T> T as(Class<T> iface) {
+        return (T)Proxy.newProxyInstance(iface.getClassLoader(), new Class<?>[]{iface}, new InvocationHandler() {
+            @Override
+            public Object invoke(Object proxy, Method method, Object[] args) {
+                if (method.getDeclaringClass() == Object.class) {
+                    switch (method.getName()) {
+                    case "equals": return proxy == args[0];
+                    case "hashCode": return System.identityHashCode(proxy);
+                    default: return "NativeCallback@" + Long.toHexString(handle);
+                    }
+                }
+                return nativeCall(handle, args == null ? new Object[0] : args);
+            }
+        });
+    }
+
+    private static native Object nativeCall(long handle, Object[] args);
+}
@@ -0,0 +1,87 @@
+package jmi;
+
+import java.io.IOException;
+import java.io.InputStream;
+import java.lang.ref.Cleaner;
+import java.nio.ByteBuffer;
+import java.nio.ReadOnlyBufferException;
+import java.nio.channels.ReadableByteChannel;
+
+/**
+ * InputStream reading data from a c++ source, created by jmi::makeInputStream().
+ * read(byte[]) copies at most 1 chunk(set by c++) by 1 jni call, read(ByteBuffer) of a direct buffer reads to the buffer memory directly.
+ * The c++ source is destroyed by close() or after the stream is garbage collected.
+ */
+public final class NativeInputStream extends InputStream implements ReadableByteChannel {
+    private static final class Source implements Runnable { // must not reference the stream
+        volatile long handle;
+
+        Source(long handle) { this.handle = handle; }
+
+        @Override
+        public void run() {
+            final long h = handle;
+            handle = 0;
+            nativeClose(h);
+        }
+    }
+
+    private final Source source;
+    private final Cleaner.Cleanable cleanable;
+    private final byte[] one = new byte[1];
+
+    NativeInputStream(long handle) {
+        source = new Source(handle);
+        cleanable = DirectBuffers.CLEANER.register(this, source);
+    }
+
+    @Override
+    public synchronized int read() throws IOException {
+        return read(one, 0, 1) < 0 ? -1 : one[0] & 0xff;
+    }
+
+    @Override
+    public synchronized int read(byte[] b, int off, int len) throws IOException {
+        if (off < 0 || len < 0 || len > b.length - off)
+            throw new IndexOutOfBoundsException();
+        if (len == 0)
+            return 0;
+        return nativeRead(handle(), b, off, len);
+    }
+
+    @Override
+    public synchronized int read(ByteBuffer dst) throws IOException {
+        if (dst.isReadOnly())
+            throw new ReadOnlyBufferException();
+        if (!dst.hasRemaining())
+            return 0;
+        final int pos = dst.position();
+        int n;
+        if (dst.isDirect())
+            n = nativeReadDirect(handle(), dst, pos, dst.remaining());
+        else if (dst.hasArray())
+            n = nativeRead(handle(), dst.array(), dst.arrayOffset() + pos, dst.remaining());
+        else
+            throw new IllegalArgumentException("unsupported ByteBuffer");
+        if (n > 0)
+            dst.position(pos + n);
+        return n;
+    }
+
+    @Override
+    public boolean isOpen() { return source.handle != 0; }
+
+    @Override
+    public synchronized void close() { cleanable.clean(); }
+
+    private long handle() throws IOException {
+        final long h = source.handle;
+        if (h == 0)
+            throw new IOException("Stream closed");
+        return h;
+    }
+
+    private static native int nativeRead(long handle, byte[] b, int off, int len);
+    private static native int nativeReadDirect(long handle, ByteBuffer dst, int off, int len);
+    private static native void nativeClose(long handle);
+}
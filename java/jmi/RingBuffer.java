@@ -0,0 +1,159 @@
+package jmi;
+
+import java.lang.invoke.MethodHandles;
+import java.lang.invoke.VarHandle;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+
+/**
+ * Single consumer ring buffer in memory shared with c++ jmi::RingBuffer, created by jmi::RingBuffer::object().
+ * Records are exchanged without jni calls, a jni call is made only to wake up a waiting consumer.
+ * Layout: long head at 0, long tail at 64, int waiting at 128, data at 192. A record is int header(0: not committed, -1: padding, otherwise size + 1)
+ * and payload, aligned to 8 bytes. Consumed bytes are zeroed.
+ */
+public final class RingBuffer {
+    private static final int HEAD = 0;
+    private static final int TAIL = 64;
+    private static final int WAITING = 128;
+    private static final int DATA = 192;
+    private static final int PADDING = -1;
+    private static final int JAVA_WAITING = 1;
+    private static final int NATIVE_WAITING = 2;
+    private static final VarHandle LONG = MethodHandles.byteBufferViewVarHandle(long[].class, ByteOrder.nativeOrder());
+    private static final VarHandle INT = MethodHandles.byteBufferViewVarHandle(int[].class, ByteOrder.nativeOrder());
+
+    private final ByteBuffer buf;
+    private final int capacity;
+    private final boolean multiProducer;
+    private final NativeCallback waker; // wakes up c++ consumer
+    private final ByteBuffer readView;
+    private final ThreadLocal<ByteBuffer> writeView;
+
+    public RingBuffer(ByteBuffer shared, boolean multiProducer, NativeCallback waker) {
+        this.buf = shared;
+        this.capacity = shared.capacity() - DATA;
+        this.multiProducer = multiProducer;
+        this.waker = waker;
+        this.readView = shared.duplicate();
+        this.writeView = ThreadLocal.withInitial(shared::duplicate);
+    }
+
+    public int capacity() { return capacity; }
+
+    public boolean write(byte[] src) { return write(src, 0, src.length); }
+
+    // returns false if no enough space or len is 0
+    public boolean write(byte[] src, int off, int len) {
+        final int n = recordSize(len);
+        if (len <= 0 || n > capacity)
+            return false;
+        long head;
+        int i;
+        int pad;
+        for (;;) {
+            head = (long)LONG.getVolatile(buf, HEAD);
+            final long tail = (long)LONG.getAcquire(buf, TAIL);
+            i = (int)(head & (capacity - 1));
+            pad = i + n > capacity ? capacity - i : 0;
+            if (head + pad + n - tail > capacity)
+                return false;
+            if (!multiProducer) {
+                LONG.setRelease(buf, HEAD, head + pad + n);
+                break;
+            }
+            if (LONG.compareAndSet(buf, HEAD, head, head + pad + n))
+                break;
+        }
+        if (pad > 0) {
+            INT.setRelease(buf, DATA + i, PADDING);
+            i = 0;
+        }
+        final ByteBuffer w = writeView.get();
+        w.position(DATA + i + 4);
+        w.put(src, off, len);
+        INT.setRelease(buf, DATA + i, len + 1);
+        notifyConsumer();
+        return true;
+    }
+
+    // copies the next record and returns its size, -1 if empty. if the record is larger than dst, it's not consumed
+    public int read(byte[] dst) {
+        for (;;) {
+            final long tail = (long)LONG.getOpaque(buf, TAIL); // only consumer changes tail
+            final int i = (int)(tail & (capacity - 1));
+            final int h = (int)INT.getAcquire(buf, DATA + i);
+            if (h == 0)
+                return -1;
+            if (h == PADDING) {
+                INT.set(buf, DATA + i, 0);
+                LONG.setRelease(buf, TAIL, tail + capacity - i);
+                continue;
+            }
+            final int len = h - 1;
+            if (len > dst.length)
+                return len;
+            readView.position(DATA + i + 4);
+            readView.get(dst, 0, len);
+            final int n = recordSize(len);
+            for (int k = 0; k < n; k += 8)
+                buf.putLong(DATA + i + k, 0);
+            LONG.setRelease(buf, TAIL, tail + n);
+            return len;
+        }
+    }
+
+    // blocks until a record is available, or timeout if timeoutMs >= 0. returns true if available
+    public boolean await(long timeoutMs) throws InterruptedException {
+        if (readable())
+            return true;
+        final long deadline = System.nanoTime() + timeoutMs * 1000000L;
+        synchronized (this) {
+            try {
+                for (;;) {
+                    INT.setVolatile(buf, WAITING, JAVA_WAITING);
+                    VarHandle.fullFence(); // either producer sees waiting or consumer sees the record
+                    if (readable())
+                        return true;
+                    if (timeoutMs < 0) {
+                        wait();
+                        continue;
+                    }
+                    final long ms = (deadline - System.nanoTime()) / 1000000L;
+                    if (ms <= 0)
+                        return readable();
+                    wait(ms);
+                }
+            } finally {
+                INT.setVolatile(buf, WAITING, 0);
+            }
+        }
+    }
+
+    // called by c++ producers
+    synchronized void wakeup() {
+        notifyAll();
+    }
+
+    private boolean readable() {
+        final long tail = (long)LONG.getOpaque(buf, TAIL);
+        final int h = (int)INT.getAcquire(buf, DATA + (int)(tail & (capacity - 1)));
+        return h != 0 && (h != PADDING || (int)INT.getAcquire(buf, DATA) != 0); // the next record after padding is at 0
+    }
+
+    private void notifyConsumer() {
+        VarHandle.fullFence();
+        final int w = (int)INT.getVolatile(buf, WAITING);
+        if (w == 0 || !INT.compareAndSet(buf, WAITING, w, 0))
+            return;
+        if (w == JAVA_WAITING) {
+            wakeup();
+            return;
+        }
+        try {
+            waker.call();
+        } catch (IllegalStateException e) { // c++ RingBuffer is destroyed
+        }
+    }
+
+    private static int recordSize(int len) { return (4 + len + 7) & ~7; }
+}
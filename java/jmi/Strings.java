@@ -0,0 +1,51 @@
+package jmi;
+
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
+import java.nio.charset.StandardCharsets;
+
+/**
+ * Converts c++ string arrays packed in 1 buffer, used by jmi if jmi::setStringArrayPacking() is enabled.
+ * Packed strings are count int lengths(-1 for null) in native byte order, then utf-8 bytes.
+ */
+public final class Strings {
+    private Strings() {}
+
+    // stores count strings in buf to dst[position, position + count)
+    static boolean split(ByteBuffer buf, int count, Object dst, int position) {
+        final Object[] a = (Object[])dst;
+        final ByteBuffer b = buf.order(ByteOrder.nativeOrder());
+        final int[] lens = new int[count];
+        b.asIntBuffer().get(lens);
+        final byte[] bytes = new byte[b.capacity() - 4 * count];
+        b.position(4 * count);
+        b.get(bytes);
+        for (int i = 0, off = 0; i < count; ++i) {
+            a[position + i] = lens[i] < 0 ? null : new String(bytes, off, lens[i], StandardCharsets.UTF_8);
+            off += Math.max(lens[i], 0);
+        }
+        return true;
+    }
+
+    // packs the first count strings of src
+    static Object join(Object src, int count) {
+        final Object[] a = (Object[])src;
+        final byte[][] u8 = new byte[count][];
+        int size = 4 * count;
+        for (int i = 0; i < count; ++i) {
+            if (a[i] == null)
+                continue;
+            u8[i] = ((String)a[i]).getBytes(StandardCharsets.UTF_8);
+            size += u8[i].length;
+        }
+        final byte[] out = new byte[size];
+        final ByteBuffer b = ByteBuffer.wrap(out).order(ByteOrder.nativeOrder());
+        for (int i = 0; i < count; ++i)
+            b.putInt(u8[i] == null ? -1 : u8[i].length);
+        for (int i = 0; i < count; ++i) {
+            if (u8[i] != null)
+                b.put(u8[i]);
+        }
+        return out;
+    }
+}
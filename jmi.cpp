@@ -5,12 +5,46 @@
  * MIT License
  */
 #include "jmi.h"
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <vector>
 #include <thread>
 #include <tuple>
+#if defined(_WIN32)
+# ifndef NOMINMAX
+#   define NOMINMAX
+# endif
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+# if (defined(__GLIBC__) || defined(__BIONIC__)) && !defined(__LP64__)
+#   define JMI_MMAP64 1 // off_t can be 32-bit, use 64-bit file offsets and sizes
+# endif
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (_M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define JMI_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+# include <arm_neon.h>
+# define JMI_NEON 1
+# if defined(__aarch64__) || defined(_M_ARM64)
+#   define JMI_NEON_F64 1
+# endif
+#endif
 // Full thread local implementation: https://github.com/wang-bin/ThreadLocal or https://github.com/wang-bin/cppcompat/blob/master/include/cppcompat/thread_local.hpp
 #if defined(__MINGW32__)
 #elif (__clang__ + 0)
@@ -120,6 +154,195 @@ JNIEnv *getEnv() {
     return env;
 }
 
+// per thread pool of java primitive arrays for out parameters
+class ArrayPool {
+public:
+    ~ArrayPool() { clear(); }
+
+    jarray acquire(JNIEnv* env, detail::make_jarray_t create, size_t size, size_t bytes) {
+        for (auto& e : entries_) {
+            if (!e.in_use && e.key == create && e.size == size) {
+                void* p = env->GetPrimitiveArrayCritical(e.a, nullptr); // clear elements of the previous call, java may not write all of them
+                if (!p)
+                    return create(env, size);
+                memset(p, 0, e.bytes);
+                env->ReleasePrimitiveArrayCritical(e.a, p, 0);
+                e.in_use = true;
+                return e.a;
+            }
+        }
+        jarray a = create(env, size);
+        const size_t cap = capacity;
+        if (!a || bytes > cap)
+            return a;
+        for (auto it = entries_.begin(); bytes_ + bytes > cap && it != entries_.end();) { // evict unused arrays
+            if (it->in_use) {
+                ++it;
+                continue;
+            }
+            env->DeleteGlobalRef(it->a);
+            bytes_ -= it->bytes;
+            it = entries_.erase(it);
+        }
+        if (bytes_ + bytes > cap)
+            return a;
+        jarray ga = static_cast<jarray>(env->NewGlobalRef(a));
+        env->DeleteLocalRef(a);
+        entries_.push_back({create, size, bytes, ga, true});
+        bytes_ += bytes;
+        return ga;
+    }
+
+    bool recycle(jarray a) {
+        for (auto& e : entries_) {
+            if (e.a == a && e.in_use) {
+                e.in_use = false;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void clear() {
+        if (entries_.empty() || !javaVM())
+            return;
+        JNIEnv* env = nullptr;
+        bool attached = false;
+        if (javaVM()->GetEnv((void**)&env, jni_ver) == JNI_EDETACHED) { // thread exit, maybe detached by EnvTLS
+            if (javaVM()->AttachCurrentThread(decltype(param_at<0>(&JavaVM::AttachCurrentThread))(&env), nullptr) != JNI_OK)
+                return;
+            attached = true;
+        }
+        for (const auto& e : entries_)
+            env->DeleteGlobalRef(e.a);
+        entries_.clear();
+        bytes_ = 0;
+        if (attached)
+            javaVM()->DetachCurrentThread();
+    }
+
+    static atomic<size_t> capacity;
+private:
+    struct Entry {
+        detail::make_jarray_t key;
+        size_t size;
+        size_t bytes;
+        jarray a;
+        bool in_use;
+    };
+    vector<Entry> entries_;
+    size_t bytes_ = 0;
+};
+atomic<size_t> ArrayPool::capacity{0};
+
+static ArrayPool& arrayPool()
+{
+#if (USE_STD_THREAD_LOCAL + 0)
+    static thread_local ArrayPool pool;
+    return pool;
+#else
+    static pthread_key_t key_ = 0;
+    static once_flag key_once_;
+    call_once(key_once_, []{
+        pthread_key_create(&key_, [](void* p) { delete static_cast<ArrayPool*>(p); });
+    });
+    auto pool = static_cast<ArrayPool*>(pthread_getspecific(key_));
+    if (!pool) {
+        pool = new ArrayPool();
+        pthread_setspecific(key_, pool);
+    }
+    return *pool;
+#endif
+}
+
+void setArrayPoolCapacity(size_t bytes)
+{
+    ArrayPool::capacity = bytes;
+}
+
+static atomic<size_t> packStringsMin{0};
+
+void setStringArrayPacking(size_t minSize)
+{
+    packStringsMin = minSize;
+}
+
+// threads attached to jvm once, converting blocks of object arrays
+class ArrayWorkers {
+public:
+    explicit ArrayWorkers(size_t threads) {
+        if (!javaVM()) // no thread can be attached
+            threads = 0;
+        for (size_t i = 0; i < threads; ++i) {
+            threads_.emplace_back([this] {
+                JNIEnv* env = getEnv(); // attached, and detached at thread exit. null if failed, tasks are not run by this thread
+                for (;;) {
+                    function<void(JNIEnv*)> task;
+                    {
+                        unique_lock<mutex> lock(mtx_);
+                        cv_.wait(lock, [this]{ return stop_ || !tasks_.empty(); });
+                        if (tasks_.empty()) // stop
+                            return;
+                        task = std::move(tasks_.front());
+                        tasks_.pop_front();
+                    }
+                    task(env);
+                }
+            });
+        }
+    }
+    ~ArrayWorkers() {
+        {
+            lock_guard<mutex> lock(mtx_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& t : threads_)
+            t.join();
+    }
+    size_t size() const { return threads_.size(); }
+    bool contains(thread::id id) const {
+        return std::any_of(threads_.cbegin(), threads_.cend(), [id](const thread& t) { return t.get_id() == id; });
+    }
+    void post(function<void(JNIEnv*)>&& task) {
+        {
+            lock_guard<mutex> lock(mtx_);
+            tasks_.push_back(std::move(task));
+        }
+        cv_.notify_one();
+    }
+private:
+    mutex mtx_;
+    condition_variable cv_;
+    deque<function<void(JNIEnv*)>> tasks_;
+    bool stop_ = false;
+    vector<thread> threads_;
+};
+
+static mutex arrayWorkersMutex;
+static atomic<size_t> parallelArrayMin{0};
+
+static shared_ptr<ArrayWorkers>& arrayWorkers()
+{
+    static auto w = new shared_ptr<ArrayWorkers>(); // never destroyed, jvm may be unavailable to detach threads at exit
+    return *w;
+}
+
+void setParallelArrayConversion(size_t threads, size_t minSize)
+{
+    shared_ptr<ArrayWorkers> old; // joined here, or by the last running conversion
+    lock_guard<mutex> lock(arrayWorkersMutex);
+    old = std::move(arrayWorkers());
+    if (threads > 0)
+        arrayWorkers() = make_shared<ArrayWorkers>(threads);
+    parallelArrayMin = threads > 0 ? std::max<size_t>(minSize, 1) : 0;
+}
+
+void flushArrayPool()
+{
+    arrayPool().clear();
+}
+
 string to_string(jstring s, JNIEnv* env)
 {
     if (!s)
@@ -142,6 +365,44 @@ jstring from_string(const string &s, JNIEnv* env)
     return env->NewStringUTF(s.data());
 }
 
+u16string to_u16string(jstring s, JNIEnv* env)
+{
+    if (!s)
+        return {};
+    if (!env)
+        env = getEnv();
+    u16string ss(env->GetStringLength(s), u'\0');
+    if (!ss.empty())
+        env->GetStringRegion(s, 0, (jsize)ss.size(), reinterpret_cast<jchar*>(&ss[0]));
+    env->DeleteLocalRef(s);
+    return ss;
+}
+
+jstring from_string(const u16string &s, JNIEnv* env)
+{
+    return detail::new_string(s.data(), s.size(), env);
+}
+
+JInternedString::JInternedString(const char* s, JNIEnv* env)
+{
+    if (!env)
+        env = getEnv();
+    const LocalRef js = {env->NewStringUTF(s), env};
+    if (js)
+        s_ = static_cast<jstring>(env->NewGlobalRef(js));
+}
+
+const JInternedString& interned(const char* s)
+{
+    static mutex mtx;
+    static map<string, JInternedString, less<>> strs; // less<>: lookup without constructing a string
+    lock_guard<mutex> lock(mtx);
+    auto it = strs.find(s);
+    if (it == strs.end())
+        it = strs.emplace(s, JInternedString(s)).first;
+    return it->second;
+}
+
 namespace android {
 jobject application(JNIEnv* env)
 {
@@ -156,6 +417,131 @@ jobject application(JNIEnv* env)
 } // namespace android
 
 namespace detail {
+jarray pooled_jarray(JNIEnv* env, make_jarray_t create, size_t size, size_t element_size)
+{
+    return arrayPool().acquire(env, create, size, size * element_size);
+}
+
+bool recycle_jarray(JNIEnv*, jarray a)
+{
+    return arrayPool().recycle(a);
+}
+
+bool parallel_jarray(JNIEnv* env, jarray a, size_t n, const parallel_func_t& f)
+{
+    const size_t m = parallelArrayMin;
+    if (m == 0 || n < m)
+        return false;
+    shared_ptr<ArrayWorkers> w;
+    {
+        lock_guard<mutex> lock(arrayWorkersMutex);
+        w = arrayWorkers();
+    }
+    if (!w || !w->size() || w->contains(this_thread::get_id())) // nested conversion in a worker may wait for itself
+        return false;
+    const jarray ga = static_cast<jarray>(env->NewGlobalRef(a)); // local refs are valid only in the caller thread
+    if (!ga)
+        return false;
+    const size_t blocks = (w->size() + 1) * 4; // small blocks balance uneven elements, e.g. string lengths
+    const size_t block = (n + blocks - 1) / blocks;
+    atomic<size_t> next{0};
+    atomic<bool> failed{false};
+    const auto run = [&](JNIEnv* e, jarray arr) {
+        if (e->PushLocalFrame(16) != 0)
+            return;
+        for (size_t b = next++; b * block < n && !failed && !e->ExceptionCheck(); b = next++)
+            f(e, arr, b * block, std::min(n, (b + 1) * block));
+        e->PopLocalFrame(nullptr);
+    };
+    mutex mtx;
+    condition_variable cv;
+    size_t running = w->size();
+    string error; // the first exception in workers
+    for (size_t i = 0; i < w->size(); ++i) {
+        w->post([&](JNIEnv* e) {
+            string err;
+            if (e) { // blocks are taken by other threads if not attached
+                run(e, ga);
+                err = handle_exception("Failed to convert array elements in worker thread.", e);
+            }
+            lock_guard<mutex> lock(mtx);
+            if (!err.empty() && error.empty()) {
+                failed = true;
+                error = std::move(err);
+            }
+            if (--running == 0)
+                cv.notify_all(); // locked, the caller returns after unlock
+        });
+    }
+    run(env, a); // exception is kept for the caller
+    {
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [&]{ return running == 0; });
+    }
+    env->DeleteGlobalRef(ga);
+    if (!error.empty()) // rethrown in the caller thread, unless the caller has its own exception
+        throw_java(env, "java/lang/RuntimeException", error.data());
+    return true;
+}
+
+// decode utf8 (modified utf8 and cesu-8 are also accepted) to utf16. invalid sequences are replaced by U+FFFD. out must have at least n elements
+static size_t utf8_to_utf16(const char* s, size_t n, jchar* out)
+{
+    const auto u = reinterpret_cast<const uint8_t*>(s);
+    size_t k = 0;
+    for (size_t i = 0; i < n;) {
+        uint32_t c = u[i];
+        if (c < 0x80) {
+            out[k++] = jchar(c);
+            ++i;
+            continue;
+        }
+        const size_t len = c >= 0xF8 ? 0 : c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 0;
+        size_t j = 1;
+        if (len > 0 && i + len <= n) {
+            c &= 0x3F >> (len - 1);
+            for (; j < len && (u[i + j] & 0xC0) == 0x80; ++j)
+                c = (c << 6) | (u[i + j] & 0x3F);
+        }
+        if (len == 0 || j != len || c > 0x10FFFF) {
+            out[k++] = 0xFFFD;
+            ++i;
+            continue;
+        }
+        i += len;
+        if (c < 0x10000) {
+            out[k++] = jchar(c);
+        } else { // surrogate pair, 4 bytes => 2 jchars
+            c -= 0x10000;
+            out[k++] = jchar(0xD800 + (c >> 10));
+            out[k++] = jchar(0xDC00 + (c & 0x3FF));
+        }
+    }
+    return k;
+}
+
+jstring new_string(const char* s, size_t n, JNIEnv* env)
+{
+    if (!env)
+        env = getEnv();
+    jchar buf[256]; // utf16 length <= utf8 length
+    unique_ptr<jchar[]> heap;
+    jchar* u16 = buf;
+    if (n > sizeof(buf)/sizeof(buf[0])) {
+        heap.reset(new jchar[n]);
+        u16 = heap.get();
+    }
+    return env->NewString(u16, (jsize)utf8_to_utf16(s, n, u16));
+}
+
+jstring new_string(const char16_t* s, size_t n, JNIEnv* env)
+{
+    static_assert(sizeof(char16_t) == sizeof(jchar), "char16_t and jchar must be of the same size");
+    if (!env)
+        env = getEnv();
+    return env->NewString(reinterpret_cast<const jchar*>(s), (jsize)n);
+}
+
 string handle_exception(string&& msg, JNIEnv* env) noexcept {
     if (!env)
         env = getEnv();
@@ -222,6 +608,29 @@ template<>
 string call_method(JNIEnv *env, jobject obj_id, jmethodID methodId, jvalue *args) {
     return to_string(static_cast<jstring>(call_method<jobject>(env, obj_id, methodId, args)), env);
 }
+template<>
+LocalRef call_method(JNIEnv *env, jobject obj_id, jmethodID methodId, jvalue *args) {
+    return LocalRef(call_method<jobject>(env, obj_id, methodId, args), env);
+}
+template<>
+u16string call_method(JNIEnv *env, jobject obj_id, jmethodID methodId, jvalue *args) {
+    return to_u16string(static_cast<jstring>(call_method<jobject>(env, obj_id, methodId, args)), env);
+}
+
+#if (JMI_CXX17+0)
+template<>
+JStringView call_method(JNIEnv *env, jobject obj_id, jmethodID methodId, jvalue *args) {
+    return JStringView(static_cast<jstring>(call_method<jobject>(env, obj_id, methodId, args)), env);
+}
+template<>
+JU16StringView call_method(JNIEnv *env, jobject obj_id, jmethodID methodId, jvalue *args) {
+    return JU16StringView(static_cast<jstring>(call_method<jobject>(env, obj_id, methodId, args)), env);
+}
+template<>
+JCriticalStringView call_method(JNIEnv *env, jobject obj_id, jmethodID methodId, jvalue *args) {
+    return JCriticalStringView(static_cast<jstring>(call_method<jobject>(env, obj_id, methodId, args)), env);
+}
+#endif
 
 template<>
 jobject call_static_method(JNIEnv *env, jclass classId, jmethodID methodId, jvalue *args) {
@@ -267,6 +676,29 @@ template<>
 string call_static_method(JNIEnv *env, jclass classId, jmethodID methodId, jvalue *args) {
     return to_string(static_cast<jstring>(call_static_method<jobject>(env, classId, methodId, args)), env);
 }
+template<>
+LocalRef call_static_method(JNIEnv *env, jclass classId, jmethodID methodId, jvalue *args) {
+    return LocalRef(call_static_method<jobject>(env, classId, methodId, args), env);
+}
+template<>
+u16string call_static_method(JNIEnv *env, jclass classId, jmethodID methodId, jvalue *args) {
+    return to_u16string(static_cast<jstring>(call_static_method<jobject>(env, classId, methodId, args)), env);
+}
+
+#if (JMI_CXX17+0)
+template<>
+JStringView call_static_method(JNIEnv *env, jclass classId, jmethodID methodId, jvalue *args) {
+    return JStringView(static_cast<jstring>(call_static_method<jobject>(env, classId, methodId, args)), env);
+}
+template<>
+JU16StringView call_static_method(JNIEnv *env, jclass classId, jmethodID methodId, jvalue *args) {
+    return JU16StringView(static_cast<jstring>(call_static_method<jobject>(env, classId, methodId, args)), env);
+}
+template<>
+JCriticalStringView call_static_method(JNIEnv *env, jclass classId, jmethodID methodId, jvalue *args) {
+    return JCriticalStringView(static_cast<jstring>(call_static_method<jobject>(env, classId, methodId, args)), env);
+}
+#endif
 
 // designated initializer jvalue{.b = obj} requires c++20 or gnu
 template<> jvalue to_jvalue(const jboolean &obj, JNIEnv* env) { jvalue v; v.z = obj; return v;} //{ return jvalue{.z = obj};}
@@ -284,6 +716,17 @@ template<> jvalue to_jvalue(const string &obj, JNIEnv* env) {
 jvalue to_jvalue(const char* s, JNIEnv* env) {
     return to_jvalue(env->NewStringUTF(s), env); // local ref will be deleted in set_ref_from_jvalue
 }
+template<> jvalue to_jvalue(const u16string &obj, JNIEnv* env) {
+    return to_jvalue(new_string(obj.data(), obj.size(), env), env);
+}
+#if (JMI_CXX17+0)
+template<> jvalue to_jvalue(const string_view &obj, JNIEnv* env) {
+    return to_jvalue(new_string(obj.data(), obj.size(), env), env);
+}
+template<> jvalue to_jvalue(const u16string_view &obj, JNIEnv* env) {
+    return to_jvalue(new_string(obj.data(), obj.size(), env), env);
+}
+#endif
 
 template<>
 jarray make_jarray(JNIEnv *env, const jobject &element, size_t size) {
@@ -327,10 +770,100 @@ jarray make_jarray(JNIEnv *env, const string&, size_t size) {
     return env->NewObjectArray((jsize)size, c, nullptr);
 }
 template<>
+jarray make_jarray(JNIEnv *env, const u16string&, size_t size) {
+    return make_jarray(env, string(), size);
+}
+#if (JMI_CXX17+0)
+template<>
+jarray make_jarray(JNIEnv *env, const string_view&, size_t size) {
+    return make_jarray(env, string(), size);
+}
+template<>
+jarray make_jarray(JNIEnv *env, const u16string_view&, size_t size) {
+    return make_jarray(env, string(), size);
+}
+#endif
+template<>
 jarray make_jarray(JNIEnv *env, const char&, size_t size) {
     return env->NewByteArray((jsize)size); // must DeleteLocalRef
 }
 
+// jarray_cast() kernels. unaligned loads/stores, the tail is converted by scalar code
+template<> void convert_elements(const jint* s, jlong* d, size_t n)
+{
+    size_t i = 0;
+#if (JMI_SSE2+0)
+    for (; i + 4 <= n; i += 4) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+        const __m128i sign = _mm_srai_epi32(v, 31);
+        _mm_storeu_si128((__m128i*)(d + i), _mm_unpacklo_epi32(v, sign));
+        _mm_storeu_si128((__m128i*)(d + i + 2), _mm_unpackhi_epi32(v, sign));
+    }
+#elif (JMI_NEON+0)
+    for (; i + 4 <= n; i += 4) {
+        const int32x4_t v = vld1q_s32((const int32_t*)(s + i));
+        vst1q_s64((int64_t*)(d + i), vmovl_s32(vget_low_s32(v)));
+        vst1q_s64((int64_t*)(d + i + 2), vmovl_s32(vget_high_s32(v)));
+    }
+#endif
+    for (; i < n; ++i)
+        d[i] = s[i];
+}
+
+template<> void convert_elements(const jlong* s, jint* d, size_t n)
+{
+    size_t i = 0;
+#if (JMI_SSE2+0)
+    for (; i + 4 <= n; i += 4) { // keep the low 32 bits of each element
+        const __m128 lo = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(s + i)));
+        const __m128 hi = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(s + i + 2)));
+        _mm_storeu_si128((__m128i*)(d + i), _mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0))));
+    }
+#elif (JMI_NEON+0)
+    for (; i + 4 <= n; i += 4) {
+        const int32x2_t lo = vmovn_s64(vld1q_s64((const int64_t*)(s + i)));
+        const int32x2_t hi = vmovn_s64(vld1q_s64((const int64_t*)(s + i + 2)));
+        vst1q_s32((int32_t*)(d + i), vcombine_s32(lo, hi));
+    }
+#endif
+    for (; i < n; ++i)
+        d[i] = jint(s[i]);
+}
+
+template<> void convert_elements(const jfloat* s, jdouble* d, size_t n)
+{
+    size_t i = 0;
+#if (JMI_SSE2+0)
+    for (; i + 4 <= n; i += 4) {
+        const __m128 v = _mm_loadu_ps(s + i);
+        _mm_storeu_pd(d + i, _mm_cvtps_pd(v));
+        _mm_storeu_pd(d + i + 2, _mm_cvtps_pd(_mm_movehl_ps(v, v)));
+    }
+#elif (JMI_NEON_F64+0)
+    for (; i + 4 <= n; i += 4) {
+        const float32x4_t v = vld1q_f32(s + i);
+        vst1q_f64(d + i, vcvt_f64_f32(vget_low_f32(v)));
+        vst1q_f64(d + i + 2, vcvt_f64_f32(vget_high_f32(v)));
+    }
+#endif
+    for (; i < n; ++i)
+        d[i] = s[i];
+}
+
+template<> void convert_elements(const jdouble* s, jfloat* d, size_t n)
+{
+    size_t i = 0;
+#if (JMI_SSE2+0)
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(d + i, _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(s + i)), _mm_cvtpd_ps(_mm_loadu_pd(s + i + 2))));
+#elif (JMI_NEON_F64+0)
+    for (; i + 4 <= n; i += 4)
+        vst1q_f32(d + i, vcombine_f32(vcvt_f32_f64(vld1q_f64(s + i)), vcvt_f32_f64(vld1q_f64(s + i + 2))));
+#endif
+    for (; i < n; ++i)
+        d[i] = jfloat(s[i]);
+}
+
 template<>
 void set_jarray(JNIEnv *env, jarray arr, size_t position, size_t n, const jobject &elm) {
     assert(n == 1 && "set only 1 jobject array element is allowed");
@@ -340,12 +873,13 @@ template<>
 void set_jarray(JNIEnv *env, jarray arr, size_t position, size_t n, const bool &elm) {
     if (n == 1 || sizeof(jboolean) == sizeof(bool)) {
         env->SetBooleanArrayRegion((jbooleanArray)arr, (jsize)position, (jsize)n, (const jboolean*)&elm);
-    } else {
-        vector<jboolean> tmp(n);
-        for (size_t i = 0; i < n; ++i)
-            tmp[i] = *(&elm + i);
-        env->SetBooleanArrayRegion((jbooleanArray)arr, (jsize)position, (jsize)n, tmp.data());
+        return;
     }
+    void* p = env->GetPrimitiveArrayCritical(arr, nullptr);
+    if (!p)
+        return;
+    convert_elements(&elm, static_cast<jboolean*>(p) + position, n);
+    env->ReleasePrimitiveArrayCritical(arr, p, 0);
 }
 template<>
 void set_jarray(JNIEnv *env, jarray arr, size_t position, size_t n, const jboolean &elm) {
@@ -379,14 +913,91 @@ template<>
 void set_jarray(JNIEnv *env, jarray arr, size_t position, size_t n, const jdouble &elm) {
     env->SetDoubleArrayRegion((jdoubleArray)arr, (jsize)position, (jsize)n, &elm);
 }
+// packed strings: n int32 lengths(-1 for null) in native byte order, then utf-8 bytes
+static bool pack_strings(JNIEnv *env, jarray arr, size_t position, size_t n, const string* s)
+{
+    size_t size = n * sizeof(jint);
+    for (size_t i = 0; i < n; ++i)
+        size += s[i].size();
+    vector<char> buf(size);
+    char* p = buf.data() + n * sizeof(jint);
+    for (size_t i = 0; i < n; ++i) {
+        const jint len = jint(s[i].size());
+        memcpy(&buf[i * sizeof(jint)], &len, sizeof(len));
+        memcpy(p, s[i].data(), s[i].size());
+        p += s[i].size();
+    }
+    struct Split : MethodTag { static const char* name() { return "split"; } };
+    const JObject<byte_buffer_tag> b(env->NewDirectByteBuffer(buf.data(), jlong(buf.size())));
+    return b && JObject<strings_tag>::callStatic<jboolean, Split>(b, jint(n), JObject<object_tag>(arr, false), jint(position));
+}
+
+static bool unpack_strings(JNIEnv *env, jarray arr, string* s, size_t n)
+{
+    struct Join : MethodTag { static const char* name() { return "join"; } };
+    const auto packed = JObject<strings_tag>::callStatic<JObject<object_tag>, Join>(JObject<object_tag>(arr, false), jint(n));
+    if (!packed)
+        return false;
+    const auto a = static_cast<jarray>(packed.id());
+    const size_t size = size_t(env->GetArrayLength(a));
+    const char* p = static_cast<const char*>(env->GetPrimitiveArrayCritical(a, nullptr)); // no jni call until released
+    if (!p)
+        return false;
+    const char* u8 = p + n * sizeof(jint);
+    for (size_t i = 0; i < n; ++i) {
+        jint len = 0;
+        memcpy(&len, p + i * sizeof(jint), sizeof(len));
+        if (len < 0 || u8 + len > p + size) {
+            s[i].clear();
+            continue;
+        }
+        s[i].assign(u8, size_t(len));
+        u8 += len;
+    }
+    env->ReleasePrimitiveArrayCritical(a, const_cast<char*>(p), JNI_ABORT);
+    return true;
+}
+
 template<>
 void set_jarray(JNIEnv *env, jarray arr, size_t position, size_t n, const string &elm) {
+    const size_t m = packStringsMin;
+    if (m > 0 && n >= m && pack_strings(env, arr, position, n, &elm))
+        return;
+    const auto set = [&elm, position](JNIEnv* e, jarray a, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            LocalRef js(from_string(*(&elm + i), e), e);
+            set_jarray(e, a, position + i, 1, (jobject)js);
+        }
+    };
+    if (!parallel_jarray(env, arr, n, set))
+        set(env, arr, 0, n);
+}
+template<>
+void set_jarray(JNIEnv *env, jarray arr, size_t position, size_t n, const u16string &elm) {
+    for (size_t i = 0; i < n; ++i) {
+        const u16string& s = *(&elm + i);
+        LocalRef js(new_string(s.data(), s.size(), env), env);
+        set_jarray(env, arr, position + i, 1, (jobject)js);
+    }
+}
+#if (JMI_CXX17+0)
+template<>
+void set_jarray(JNIEnv *env, jarray arr, size_t position, size_t n, const string_view &elm) {
+    for (size_t i = 0; i < n; ++i) {
+        const string_view& s = *(&elm + i);
+        LocalRef js(new_string(s.data(), s.size(), env), env);
+        set_jarray(env, arr, position + i, 1, (jobject)js);
+    }
+}
+template<>
+void set_jarray(JNIEnv *env, jarray arr, size_t position, size_t n, const u16string_view &elm) {
     for (size_t i = 0; i < n; ++i) {
-        const string& s = *(&elm + i);
-        LocalRef js(from_string(s, env), env);
+        const u16string_view& s = *(&elm + i);
+        LocalRef js(new_string(s.data(), s.size(), env), env);
         set_jarray(env, arr, position + i, 1, (jobject)js);
     }
 }
+#endif
 
 // no need to specialize other types(jchar, jint etc.) because java parameters are passed by value but not reference. specialize jobject, jarray is ok, now we use jlong for them
 template<> void from_jvalue(JNIEnv*, const jvalue& v, jlong& t) { t = v.j;}
@@ -423,18 +1034,122 @@ template<> void from_jarray(JNIEnv* env, const jvalue& v, double* t, size_t N)
 {
     env->GetDoubleArrayRegion(static_cast<jdoubleArray>(v.l), 0, (jsize)N, t);
 }
+template<> void get_jarray_region(JNIEnv* env, jarray a, size_t start, size_t n, jboolean* t)
+{
+    env->GetBooleanArrayRegion(static_cast<jbooleanArray>(a), (jsize)start, (jsize)n, t);
+}
+template<> void get_jarray_region(JNIEnv* env, jarray a, size_t start, size_t n, jbyte* t)
+{
+    env->GetByteArrayRegion(static_cast<jbyteArray>(a), (jsize)start, (jsize)n, t);
+}
+template<> void get_jarray_region(JNIEnv* env, jarray a, size_t start, size_t n, jchar* t)
+{
+    env->GetCharArrayRegion(static_cast<jcharArray>(a), (jsize)start, (jsize)n, t);
+}
+template<> void get_jarray_region(JNIEnv* env, jarray a, size_t start, size_t n, jshort* t)
+{
+    env->GetShortArrayRegion(static_cast<jshortArray>(a), (jsize)start, (jsize)n, t);
+}
+template<> void get_jarray_region(JNIEnv* env, jarray a, size_t start, size_t n, jint* t)
+{
+    env->GetIntArrayRegion(static_cast<jintArray>(a), (jsize)start, (jsize)n, t);
+}
+template<> void get_jarray_region(JNIEnv* env, jarray a, size_t start, size_t n, jlong* t)
+{
+    env->GetLongArrayRegion(static_cast<jlongArray>(a), (jsize)start, (jsize)n, t);
+}
+template<> void get_jarray_region(JNIEnv* env, jarray a, size_t start, size_t n, jfloat* t)
+{
+    env->GetFloatArrayRegion(static_cast<jfloatArray>(a), (jsize)start, (jsize)n, t);
+}
+template<> void get_jarray_region(JNIEnv* env, jarray a, size_t start, size_t n, jdouble* t)
+{
+    env->GetDoubleArrayRegion(static_cast<jdoubleArray>(a), (jsize)start, (jsize)n, t);
+}
 template<> void from_jarray(JNIEnv* env, const jvalue& v, char* t, size_t N)
 {
     env->GetByteArrayRegion(static_cast<jbyteArray>(v.l), 0, (jsize)N, (jbyte*)t);
 }
 template<> void from_jarray(JNIEnv* env, const jvalue& v, string* t, size_t N)
 {
-    for (jsize i = 0; i < N; ++i) {
+    const size_t m = packStringsMin;
+    if (m > 0 && N >= m && unpack_strings(env, static_cast<jarray>(v.l), t, N))
+        return;
+    const auto get = [t](JNIEnv* e, jarray a, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            auto s = e->GetObjectArrayElement(static_cast<jobjectArray>(a), jsize(i));
+            *(t + i) = to_string((jstring)s, e); // local ref is deleted by to_string
+        }
+    };
+    if (!parallel_jarray(env, static_cast<jarray>(v.l), N, get))
+        get(env, static_cast<jarray>(v.l), 0, N);
+}
+template<> void from_jarray(JNIEnv* env, const jvalue& v, u16string* t, size_t N)
+{
+    for (jsize i = 0; i < jsize(N); ++i) {
         auto s = env->GetObjectArrayElement(static_cast<jobjectArray>(v.l), i);
-        *(t + i) = to_string((jstring)s); // local ref is deleted by to_string
+        *(t + i) = to_u16string((jstring)s, env); // local ref is deleted by to_u16string
     }
 }
 
+////////// JArrayView //////////
+template<> const jboolean* array_elements<jboolean>::get(JNIEnv* env, jarray a, size_t& n) {
+    n = env->GetArrayLength(a);
+    return env->GetBooleanArrayElements(static_cast<jbooleanArray>(a), nullptr);
+}
+template<> void array_elements<jboolean>::release(JNIEnv* env, jarray a, const jboolean* elems) {
+    env->ReleaseBooleanArrayElements(static_cast<jbooleanArray>(a), const_cast<jboolean*>(elems), JNI_ABORT); // read only
+}
+template<> const jbyte* array_elements<jbyte>::get(JNIEnv* env, jarray a, size_t& n) {
+    n = env->GetArrayLength(a);
+    return env->GetByteArrayElements(static_cast<jbyteArray>(a), nullptr);
+}
+template<> void array_elements<jbyte>::release(JNIEnv* env, jarray a, const jbyte* elems) {
+    env->ReleaseByteArrayElements(static_cast<jbyteArray>(a), const_cast<jbyte*>(elems), JNI_ABORT); // read only
+}
+template<> const jchar* array_elements<jchar>::get(JNIEnv* env, jarray a, size_t& n) {
+    n = env->GetArrayLength(a);
+    return env->GetCharArrayElements(static_cast<jcharArray>(a), nullptr);
+}
+template<> void array_elements<jchar>::release(JNIEnv* env, jarray a, const jchar* elems) {
+    env->ReleaseCharArrayElements(static_cast<jcharArray>(a), const_cast<jchar*>(elems), JNI_ABORT); // read only
+}
+template<> const jshort* array_elements<jshort>::get(JNIEnv* env, jarray a, size_t& n) {
+    n = env->GetArrayLength(a);
+    return env->GetShortArrayElements(static_cast<jshortArray>(a), nullptr);
+}
+template<> void array_elements<jshort>::release(JNIEnv* env, jarray a, const jshort* elems) {
+    env->ReleaseShortArrayElements(static_cast<jshortArray>(a), const_cast<jshort*>(elems), JNI_ABORT); // read only
+}
+template<> const jint* array_elements<jint>::get(JNIEnv* env, jarray a, size_t& n) {
+    n = env->GetArrayLength(a);
+    return env->GetIntArrayElements(static_cast<jintArray>(a), nullptr);
+}
+template<> void array_elements<jint>::release(JNIEnv* env, jarray a, const jint* elems) {
+    env->ReleaseIntArrayElements(static_cast<jintArray>(a), const_cast<jint*>(elems), JNI_ABORT); // read only
+}
+template<> const jlong* array_elements<jlong>::get(JNIEnv* env, jarray a, size_t& n) {
+    n = env->GetArrayLength(a);
+    return env->GetLongArrayElements(static_cast<jlongArray>(a), nullptr);
+}
+template<> void array_elements<jlong>::release(JNIEnv* env, jarray a, const jlong* elems) {
+    env->ReleaseLongArrayElements(static_cast<jlongArray>(a), const_cast<jlong*>(elems), JNI_ABORT); // read only
+}
+template<> const jfloat* array_elements<jfloat>::get(JNIEnv* env, jarray a, size_t& n) {
+    n = env->GetArrayLength(a);
+    return env->GetFloatArrayElements(static_cast<jfloatArray>(a), nullptr);
+}
+template<> void array_elements<jfloat>::release(JNIEnv* env, jarray a, const jfloat* elems) {
+    env->ReleaseFloatArrayElements(static_cast<jfloatArray>(a), const_cast<jfloat*>(elems), JNI_ABORT); // read only
+}
+template<> const jdouble* array_elements<jdouble>::get(JNIEnv* env, jarray a, size_t& n) {
+    n = env->GetArrayLength(a);
+    return env->GetDoubleArrayElements(static_cast<jdoubleArray>(a), nullptr);
+}
+template<> void array_elements<jdouble>::release(JNIEnv* env, jarray a, const jdouble* elems) {
+    env->ReleaseDoubleArrayElements(static_cast<jdoubleArray>(a), const_cast<jdouble*>(elems), JNI_ABORT); // read only
+}
+
 ////////// Field //////////
 template<>
 jobject get_field(JNIEnv* env, jobject oid, jfieldID fid) {
@@ -476,6 +1191,25 @@ template<>
 string get_field(JNIEnv* env, jobject oid, jfieldID fid) {
     return to_string((jstring)get_field<jobject>(env, oid, fid), env);
 }
+template<>
+u16string get_field(JNIEnv* env, jobject oid, jfieldID fid) {
+    return to_u16string((jstring)get_field<jobject>(env, oid, fid), env);
+}
+
+#if (JMI_CXX17+0)
+template<>
+JStringView get_field(JNIEnv* env, jobject oid, jfieldID fid) {
+    return JStringView((jstring)get_field<jobject>(env, oid, fid), env);
+}
+template<>
+JU16StringView get_field(JNIEnv* env, jobject oid, jfieldID fid) {
+    return JU16StringView((jstring)get_field<jobject>(env, oid, fid), env);
+}
+template<>
+JCriticalStringView get_field(JNIEnv* env, jobject oid, jfieldID fid) {
+    return JCriticalStringView((jstring)get_field<jobject>(env, oid, fid), env);
+}
+#endif
 
 template<>
 void set_field(JNIEnv* env, jobject oid, jfieldID fid, jobject&& v) {
@@ -518,6 +1252,23 @@ void set_field(JNIEnv* env, jobject oid, jfieldID fid, string&& v) {
     const LocalRef js = {from_string(v, env), env};
     set_field(env, oid, fid, jobject(js));
 }
+template<>
+void set_field(JNIEnv* env, jobject oid, jfieldID fid, u16string&& v) {
+    const LocalRef js = {new_string(v.data(), v.size(), env), env};
+    set_field(env, oid, fid, jobject(js));
+}
+#if (JMI_CXX17+0)
+template<>
+void set_field(JNIEnv* env, jobject oid, jfieldID fid, string_view&& v) {
+    const LocalRef js = {new_string(v.data(), v.size(), env), env};
+    set_field(env, oid, fid, jobject(js));
+}
+template<>
+void set_field(JNIEnv* env, jobject oid, jfieldID fid, u16string_view&& v) {
+    const LocalRef js = {new_string(v.data(), v.size(), env), env};
+    set_field(env, oid, fid, jobject(js));
+}
+#endif
 
 ////////// Static Field //////////
 template<>
@@ -560,14 +1311,33 @@ template<>
 string get_static_field(JNIEnv* env, jclass cid, jfieldID fid) {
     return to_string((jstring)get_static_field<jobject>(env, cid, fid), env);
 }
+template<>
+u16string get_static_field(JNIEnv* env, jclass cid, jfieldID fid) {
+    return to_u16string((jstring)get_static_field<jobject>(env, cid, fid), env);
+}
 
+#if (JMI_CXX17+0)
 template<>
-void set_static_field(JNIEnv* env, jclass cid, jfieldID fid, jobject&& v) {
-    env->SetStaticObjectField(cid, fid, v);
+JStringView get_static_field(JNIEnv* env, jclass cid, jfieldID fid) {
+    return JStringView((jstring)get_static_field<jobject>(env, cid, fid), env);
 }
 template<>
-void set_static_field(JNIEnv* env, jclass cid, jfieldID fid, jboolean&& v) {
-    env->SetStaticBooleanField(cid, fid, v);
+JU16StringView get_static_field(JNIEnv* env, jclass cid, jfieldID fid) {
+    return JU16StringView((jstring)get_static_field<jobject>(env, cid, fid), env);
+}
+template<>
+JCriticalStringView get_static_field(JNIEnv* env, jclass cid, jfieldID fid) {
+    return JCriticalStringView((jstring)get_static_field<jobject>(env, cid, fid), env);
+}
+#endif
+
+template<>
+void set_static_field(JNIEnv* env, jclass cid, jfieldID fid, jobject&& v) {
+    env->SetStaticObjectField(cid, fid, v);
+}
+template<>
+void set_static_field(JNIEnv* env, jclass cid, jfieldID fid, jboolean&& v) {
+    env->SetStaticBooleanField(cid, fid, v);
 }
 template<>
 void set_static_field(JNIEnv* env, jclass cid, jfieldID fid, jbyte&& v) {
@@ -602,5 +1372,1517 @@ void set_static_field(JNIEnv* env, jclass cid, jfieldID fid, string&& v) {
     const LocalRef js = {from_string(v), env};
     set_static_field(env, cid, fid, (jobject)js);
 }
+template<>
+void set_static_field(JNIEnv* env, jclass cid, jfieldID fid, u16string&& v) {
+    const LocalRef js = {new_string(v.data(), v.size(), env), env};
+    set_static_field(env, cid, fid, (jobject)js);
+}
+#if (JMI_CXX17+0)
+template<>
+void set_static_field(JNIEnv* env, jclass cid, jfieldID fid, string_view&& v) {
+    const LocalRef js = {new_string(v.data(), v.size(), env), env};
+    set_static_field(env, cid, fid, (jobject)js);
+}
+template<>
+void set_static_field(JNIEnv* env, jclass cid, jfieldID fid, u16string_view&& v) {
+    const LocalRef js = {new_string(v.data(), v.size(), env), env};
+    set_static_field(env, cid, fid, (jobject)js);
+}
+#endif
+} // namespace detail
+
+////////// Callback //////////
+/*
+  Slots are allocated in segments which are never freed, so a slot address is always valid. Slot state is generation(32 bits) | alive(1 bit) | refs(31 bits),
+  a handle is generation << 32 | slot index. Dispatch acquires a slot by increasing refs if generation matches and alive is set, no lock is required.
+  The callable is destroyed by whoever sees refs == 0 && !alive first, then the slot is pushed to a lock-free free list and its generation increases in the next use.
+ */
+class CallbackTable {
+public:
+    struct Slot {
+        atomic<uint64_t> state{0};
+        atomic<uint32_t> next{0}; // free list: index + 1 of the next free slot
+        uint32_t index = 0;
+        detail::callback_t* f = nullptr;
+    };
+
+    jlong add(detail::callback_t&& f) {
+        uint32_t i = pop();
+        if (i == kNone) {
+            i = size_.fetch_add(1, memory_order_relaxed);
+            if (i >= kSegmentSize * kMaxSegments)
+                return 0;
+        }
+        Slot& s = *slot(i, true);
+        s.f = new detail::callback_t(std::move(f));
+        uint32_t gen = uint32_t(s.state.load(memory_order_relaxed) >> 32) + 1;
+        if (gen == 0) // handle is never 0
+            gen = 1;
+        s.state.store((uint64_t(gen) << 32) | kAlive, memory_order_release);
+        return jlong((uint64_t(gen) << 32) | i);
+    }
+
+    Slot* acquire(jlong handle) {
+        Slot* s = slot(uint32_t(handle), false);
+        if (!s)
+            return nullptr;
+        const uint32_t gen = uint32_t(uint64_t(handle) >> 32);
+        uint64_t st = s->state.load(memory_order_acquire);
+        do {
+            if (uint32_t(st >> 32) != gen || !(st & kAlive))
+                return nullptr;
+        } while (!s->state.compare_exchange_weak(st, st + 1, memory_order_acq_rel, memory_order_acquire));
+        return s;
+    }
+
+    void release(Slot* s) {
+        const uint64_t st = s->state.fetch_sub(1, memory_order_acq_rel) - 1;
+        if ((st & kRefs) == 0 && !(st & kAlive))
+            destroy(s);
+    }
+
+    bool remove(jlong handle) {
+        Slot* s = slot(uint32_t(handle), false);
+        if (!s)
+            return false;
+        const uint32_t gen = uint32_t(uint64_t(handle) >> 32);
+        uint64_t st = s->state.load(memory_order_acquire);
+        do {
+            if (uint32_t(st >> 32) != gen || !(st & kAlive))
+                return false;
+        } while (!s->state.compare_exchange_weak(st, st & ~kAlive, memory_order_acq_rel, memory_order_acquire));
+        if ((st & kRefs) == 0)
+            destroy(s);
+        return true;
+    }
+
+private:
+    static constexpr uint64_t kAlive = 1ULL << 31;
+    static constexpr uint64_t kRefs = kAlive - 1;
+    static constexpr uint32_t kNone = ~0U;
+    static constexpr uint32_t kSegmentSize = 256;
+    static constexpr uint32_t kMaxSegments = 4096;
+
+    Slot* slot(uint32_t i, bool create) {
+        if (i >= size_.load(memory_order_acquire) || i >= kSegmentSize * kMaxSegments)
+            return nullptr;
+        auto& seg = segments_[i / kSegmentSize];
+        Slot* slots = seg.load(memory_order_acquire);
+        if (!slots) {
+            if (!create)
+                return nullptr;
+            Slot* ss = new Slot[kSegmentSize];
+            for (uint32_t k = 0; k < kSegmentSize; ++k)
+                ss[k].index = i / kSegmentSize * kSegmentSize + k;
+            if (seg.compare_exchange_strong(slots, ss, memory_order_acq_rel, memory_order_acquire))
+                slots = ss;
+            else
+                delete[] ss;
+        }
+        return &slots[i % kSegmentSize];
+    }
+
+    void destroy(Slot* s) {
+        delete s->f;
+        s->f = nullptr;
+        push(s);
+    }
+
+    // free list head is tag(32 bits) | index + 1, tag avoids ABA
+    void push(Slot* s) {
+        uint64_t head = free_.load(memory_order_relaxed);
+        uint64_t h;
+        do {
+            s->next.store(uint32_t(head), memory_order_relaxed);
+            h = (((head >> 32) + 1) << 32) | (s->index + 1);
+        } while (!free_.compare_exchange_weak(head, h, memory_order_release, memory_order_relaxed));
+    }
+
+    uint32_t pop() {
+        uint64_t head = free_.load(memory_order_acquire);
+        uint64_t h;
+        do {
+            const uint32_t top = uint32_t(head);
+            if (!top)
+                return kNone;
+            h = (((head >> 32) + 1) << 32) | slot(top - 1, false)->next.load(memory_order_relaxed);
+        } while (!free_.compare_exchange_weak(head, h, memory_order_acquire, memory_order_acquire));
+        return uint32_t(head) - 1;
+    }
+
+    atomic<Slot*> segments_[kMaxSegments] = {};
+    atomic<uint32_t> size_{0};
+    atomic<uint64_t> free_{0};
+};
+
+static CallbackTable& callbackTable()
+{
+    static auto t = new CallbackTable(); // never destroyed, callbacks may be called when exiting
+    return *t;
+}
+
+static jobject JNICALL nativeCall(JNIEnv* env, jclass, jlong handle, jobjectArray args)
+{
+    auto& table = callbackTable();
+    auto s = table.acquire(handle);
+    if (!s) {
+        detail::throw_java(env, "java/lang/IllegalStateException", "NativeCallback is released");
+        return nullptr;
+    }
+    const auto releaser = detail::call_on_exit([&]{ table.release(s); });
+#if (JMI_EXCEPTIONS + 0) // c++ exceptions must not cross jni boundary
+    try {
+        return (*s->f)(env, args);
+    } catch (...) {
+        detail::throw_java_current(env, "java/lang/RuntimeException");
+    }
+    return nullptr;
+#else
+    return (*s->f)(env, args);
+#endif
+}
+
+static bool registerNativeCallback()
+{
+    static const bool registered = [] {
+        static const JNINativeMethod methods[] = {
+            {const_cast<char*>("nativeCall"), const_cast<char*>("(J[Ljava/lang/Object;)Ljava/lang/Object;"), reinterpret_cast<void*>(&nativeCall)},
+        };
+        return NativeCallback::registerNatives(methods, 1);
+    }();
+    return registered;
+}
+
+const NativeCallback& Callback::object() const
+{
+    if (!obj_ && handle_ && registerNativeCallback())
+        obj_.create(handle_);
+    return obj_;
+}
+
+void Callback::reset()
+{
+    if (handle_)
+        detail::remove_callback(handle_);
+    handle_ = 0;
+    obj_.reset();
+}
+
+namespace detail {
+jlong add_callback(callback_t&& f)
+{
+    return callbackTable().add(std::move(f));
+}
+
+bool remove_callback(jlong handle)
+{
+    return callbackTable().remove(handle);
+}
+
+void throw_java(JNIEnv* env, const char* className, const char* msg)
+{
+    if (env->ExceptionCheck()) // keep the pending one
+        return;
+    const LocalRef c(env->FindClass(className), env);
+    if (c)
+        env->ThrowNew(c, msg);
+}
+
+#if (JMI_EXCEPTIONS + 0)
+void throw_java_current(JNIEnv* env, const char* className)
+{
+    try {
+        throw;
+    } catch (const std::exception& e) {
+        throw_java(env, className, e.what());
+    } catch (...) {
+        throw_java(env, className, "Unknown c++ exception");
+    }
+}
+#endif
+
+static jclass box_class(JNIEnv* env, const char* cls)
+{
+    const LocalRef c(env->FindClass(cls), env);
+    return static_cast<jclass>(env->NewGlobalRef(c));
+}
+
+bool string_arg(JNIEnv* env, jobject o)
+{
+    static const jclass c = box_class(env, "java/lang/String");
+    if (!o || env->IsInstanceOf(o, c))
+        return true;
+    env->DeleteLocalRef(o);
+    throw_java(env, "java/lang/IllegalArgumentException", "NativeCallback argument is not a String");
+    return false;
+}
+
+// unbox() of integers and floating points accepts any Number
+template<> bool unboxable<jboolean>(JNIEnv* env, jobject obj) {
+    static const jclass c = box_class(env, "java/lang/Boolean");
+    return obj && env->IsInstanceOf(obj, c);
+}
+template<> bool unboxable<jchar>(JNIEnv* env, jobject obj) {
+    static const jclass c = box_class(env, "java/lang/Character");
+    return obj && env->IsInstanceOf(obj, c);
+}
+static bool is_number(JNIEnv* env, jobject obj)
+{
+    static const jclass c = box_class(env, "java/lang/Number");
+    return obj && env->IsInstanceOf(obj, c);
+}
+template<> bool unboxable<jbyte>(JNIEnv* env, jobject obj) { return is_number(env, obj); }
+template<> bool unboxable<jshort>(JNIEnv* env, jobject obj) { return is_number(env, obj); }
+template<> bool unboxable<jint>(JNIEnv* env, jobject obj) { return is_number(env, obj); }
+template<> bool unboxable<jlong>(JNIEnv* env, jobject obj) { return is_number(env, obj); }
+template<> bool unboxable<jfloat>(JNIEnv* env, jobject obj) { return is_number(env, obj); }
+template<> bool unboxable<jdouble>(JNIEnv* env, jobject obj) { return is_number(env, obj); }
+
+static jmethodID unbox_method(JNIEnv* env, const char* cls, const char* name, const char* sig)
+{
+    const LocalRef c(env->FindClass(cls), env);
+    return env->GetMethodID(c, name, sig); // valid as long as the class is loaded, java.lang classes are never unloaded
+}
+
+struct Boxer {
+    jclass cls;
+    jmethodID valueOf;
+};
+
+static Boxer boxer(JNIEnv* env, const char* cls, const char* sig)
+{
+    const LocalRef c(env->FindClass(cls), env);
+    return {static_cast<jclass>(env->NewGlobalRef(c)), env->GetStaticMethodID(c, "valueOf", sig)};
+}
+
+template<> jboolean unbox(JNIEnv* env, jobject obj) {
+    static const jmethodID mid = unbox_method(env, "java/lang/Boolean", "booleanValue", "()Z");
+    return env->CallBooleanMethodA(obj, mid, nullptr);
+}
+template<> jobject box(JNIEnv* env, jboolean v) {
+    static const auto b = boxer(env, "java/lang/Boolean", "(Z)Ljava/lang/Boolean;");
+    jvalue a;
+    a.z = v;
+    return env->CallStaticObjectMethodA(b.cls, b.valueOf, &a);
+}
+template<> jbyte unbox(JNIEnv* env, jobject obj) {
+    static const jmethodID mid = unbox_method(env, "java/lang/Number", "byteValue", "()B");
+    return env->CallByteMethodA(obj, mid, nullptr);
+}
+template<> jobject box(JNIEnv* env, jbyte v) {
+    static const auto b = boxer(env, "java/lang/Byte", "(B)Ljava/lang/Byte;");
+    jvalue a;
+    a.b = v;
+    return env->CallStaticObjectMethodA(b.cls, b.valueOf, &a);
+}
+template<> jchar unbox(JNIEnv* env, jobject obj) {
+    static const jmethodID mid = unbox_method(env, "java/lang/Character", "charValue", "()C");
+    return env->CallCharMethodA(obj, mid, nullptr);
+}
+template<> jobject box(JNIEnv* env, jchar v) {
+    static const auto b = boxer(env, "java/lang/Character", "(C)Ljava/lang/Character;");
+    jvalue a;
+    a.c = v;
+    return env->CallStaticObjectMethodA(b.cls, b.valueOf, &a);
+}
+template<> jshort unbox(JNIEnv* env, jobject obj) {
+    static const jmethodID mid = unbox_method(env, "java/lang/Number", "shortValue", "()S");
+    return env->CallShortMethodA(obj, mid, nullptr);
+}
+template<> jobject box(JNIEnv* env, jshort v) {
+    static const auto b = boxer(env, "java/lang/Short", "(S)Ljava/lang/Short;");
+    jvalue a;
+    a.s = v;
+    return env->CallStaticObjectMethodA(b.cls, b.valueOf, &a);
+}
+template<> jint unbox(JNIEnv* env, jobject obj) {
+    static const jmethodID mid = unbox_method(env, "java/lang/Number", "intValue", "()I");
+    return env->CallIntMethodA(obj, mid, nullptr);
+}
+template<> jobject box(JNIEnv* env, jint v) {
+    static const auto b = boxer(env, "java/lang/Integer", "(I)Ljava/lang/Integer;");
+    jvalue a;
+    a.i = v;
+    return env->CallStaticObjectMethodA(b.cls, b.valueOf, &a);
+}
+template<> jlong unbox(JNIEnv* env, jobject obj) {
+    static const jmethodID mid = unbox_method(env, "java/lang/Number", "longValue", "()J");
+    return env->CallLongMethodA(obj, mid, nullptr);
+}
+template<> jobject box(JNIEnv* env, jlong v) {
+    static const auto b = boxer(env, "java/lang/Long", "(J)Ljava/lang/Long;");
+    jvalue a;
+    a.j = v;
+    return env->CallStaticObjectMethodA(b.cls, b.valueOf, &a);
+}
+template<> jfloat unbox(JNIEnv* env, jobject obj) {
+    static const jmethodID mid = unbox_method(env, "java/lang/Number", "floatValue", "()F");
+    return env->CallFloatMethodA(obj, mid, nullptr);
+}
+template<> jobject box(JNIEnv* env, jfloat v) {
+    static const auto b = boxer(env, "java/lang/Float", "(F)Ljava/lang/Float;");
+    jvalue a;
+    a.f = v;
+    return env->CallStaticObjectMethodA(b.cls, b.valueOf, &a);
+}
+template<> jdouble unbox(JNIEnv* env, jobject obj) {
+    static const jmethodID mid = unbox_method(env, "java/lang/Number", "doubleValue", "()D");
+    return env->CallDoubleMethodA(obj, mid, nullptr);
+}
+template<> jobject box(JNIEnv* env, jdouble v) {
+    static const auto b = boxer(env, "java/lang/Double", "(D)Ljava/lang/Double;");
+    jvalue a;
+    a.d = v;
+    return env->CallStaticObjectMethodA(b.cls, b.valueOf, &a);
+}
+
+// global refs of boxes of [lo, lo + n) returned by valueOf(), i.e. the objects in java cache. never deleted
+template<typename T>
+class BoxCache {
+public:
+    BoxCache(JNIEnv* env, jint lo, jint n) : lo_(lo) {
+        refs_.reserve(n);
+        for (jint i = 0; i < n; ++i) {
+            const LocalRef b(box(env, T(lo + i)), env);
+            if (!b || env->ExceptionCheck()) // values cached so far are valid, others are boxed by every call
+                break;
+            refs_.push_back(env->NewGlobalRef(b));
+        }
+        handle_exception("Failed to cache java boxed values.", env);
+    }
+    jobject get(T v) const {
+        const jlong i = jlong(v) - lo_;
+        return i >= 0 && i < jlong(refs_.size()) ? refs_[size_t(i)] : nullptr;
+    }
+private:
+    jint lo_;
+    vector<jobject> refs_;
+};
+
+template<> jobject cached_box(JNIEnv* env, jboolean v) {
+    static const BoxCache<jboolean> c(env, 0, 2);
+    return c.get(v ? JNI_TRUE : JNI_FALSE);
+}
+template<> jobject cached_box(JNIEnv* env, jbyte v) {
+    static const BoxCache<jbyte> c(env, -128, 256);
+    return c.get(v);
+}
+template<> jobject cached_box(JNIEnv* env, jchar v) {
+    static const BoxCache<jchar> c(env, 0, 128);
+    return c.get(v);
+}
+template<> jobject cached_box(JNIEnv* env, jshort v) {
+    static const BoxCache<jshort> c(env, -128, 256);
+    return c.get(v);
+}
+template<> jobject cached_box(JNIEnv* env, jint v) {
+    static const BoxCache<jint> c(env, -128, 256);
+    return c.get(v);
+}
+template<> jobject cached_box(JNIEnv* env, jlong v) {
+    static const BoxCache<jlong> c(env, -128, 256);
+    return c.get(v);
+}
+// java does not cache Float and Double
+template<> jobject cached_box(JNIEnv*, jfloat) { return nullptr; }
+template<> jobject cached_box(JNIEnv*, jdouble) { return nullptr; }
+} // namespace detail
+
+////////// CommandBuffer //////////
+static jclass objectClass(JNIEnv* env)
+{
+    static const jclass c = [env] {
+        const LocalRef c(env->FindClass("java/lang/Object"), env);
+        return static_cast<jclass>(env->NewGlobalRef(c));
+    }();
+    return c;
+}
+
+CommandBuffer& CommandBuffer::operator=(CommandBuffer&& that) noexcept
+{
+    swap(buf_, that.buf_);
+    swap(offsets_, that.offsets_);
+    swap(refs_, that.refs_);
+    swap(lastKey_, that.lastKey_);
+    swap(lastRef_, that.lastRef_);
+    swap(buffer_, that.buffer_);
+    swap(refArray_, that.refArray_);
+    swap(out_, that.out_);
+    swap(synced_, that.synced_);
+    swap(executed_, that.executed_);
+    swap(error_, that.error_);
+    return *this;
+}
+
+void CommandBuffer::clear()
+{
+    buf_.clear();
+    offsets_.clear();
+    lastKey_ = nullptr;
+    lastRef_ = -1;
+    synced_ = 0;
+    executed_ = 0;
+    error_.clear();
+    if (refs_.empty() && !buffer_ && !refArray_ && !out_)
+        return;
+    JNIEnv* env = getEnv();
+    for (auto r : refs_)
+        env->DeleteGlobalRef(r);
+    refs_.clear();
+    env->DeleteGlobalRef(buffer_); // can be null
+    env->DeleteGlobalRef(refArray_);
+    env->DeleteGlobalRef(out_);
+    buffer_ = nullptr;
+    refArray_ = nullptr;
+    out_ = nullptr;
+}
+
+jint CommandBuffer::method(JNIEnv* env, jclass cid, const char* name, const char* sig, bool isStatic)
+{
+    if (!env) {
+        error_ = "Invalid JNIEnv";
+        return -1;
+    }
+    if (!cid) {
+        error_ = detail::handle_exception(string("Failed to find class of method '") + name + "'.", env);
+        return -1;
+    }
+    // jmethodID is unique for a method, but GetMethodID() is not required if class, name and signature are known
+    static mutex mtx;
+    static map<pair<jclass, string>, jint> methods;
+    auto key = make_pair(cid, string(name) + sig);
+    {
+        lock_guard<mutex> lock(mtx);
+        const auto it = methods.find(key);
+        if (it != methods.cend())
+            return it->second;
+    }
+    const jmethodID mid = isStatic ? env->GetStaticMethodID(cid, name, sig) : env->GetMethodID(cid, name, sig);
+    jint index = -1;
+    if (mid) {
+        const jclass bcid = JObject<detail::command_buffer_tag>::classId(env);
+        static jmethodID addId = nullptr;
+        if (bcid && !addId)
+            addId = env->GetStaticMethodID(bcid, "add", "(Ljava/lang/reflect/Method;)I");
+        const LocalRef m(env->ToReflectedMethod(cid, mid, isStatic), env);
+        if (m && addId)
+            index = env->CallStaticIntMethod(bcid, addId, m.get<jobject>());
+    }
+    auto ex = detail::handle_exception(string("Failed to resolve method '") + name + "' with signature '" + sig + "' for CommandBuffer.", env);
+    if (!ex.empty() || index < 0) {
+        error_ = ex.empty() ? string("Failed to find class 'jmi/CommandBuffer'") : std::move(ex);
+        return -1;
+    }
+    lock_guard<mutex> lock(mtx);
+    methods.emplace(std::move(key), index); // the same method may be added to java table by multiple threads, it's fine
+    return index;
+}
+
+jint CommandBuffer::ref(JNIEnv* env, jobject obj, bool local)
+{
+    if (!obj)
+        return -1;
+    if (!local && obj == lastKey_ && env->IsSameObject(refs_[lastRef_], obj)) // a JObject's global ref may be reused by another object
+        return lastRef_;
+    refs_.push_back(env->NewGlobalRef(obj));
+    if (local) {
+        env->DeleteLocalRef(obj);
+    } else {
+        lastKey_ = obj;
+        lastRef_ = jint(refs_.size() - 1);
+    }
+    return jint(refs_.size() - 1);
+}
+
+bool CommandBuffer::execute()
+{
+    error_.clear();
+    executed_ = 0;
+    if (offsets_.empty())
+        return true;
+    JNIEnv* env = getEnv();
+    if (!env) {
+        error_ = "Invalid JNIEnv";
+        return false;
+    }
+    const jclass cid = JObject<detail::command_buffer_tag>::classId(env);
+    static jmethodID mid = nullptr;
+    if (cid && !mid)
+        mid = env->GetStaticMethodID(cid, "execute", "(Ljava/nio/ByteBuffer;I[Ljava/lang/Object;[Ljava/lang/Object;)I");
+    if (!mid) {
+        error_ = detail::handle_exception("Failed to find jmi.CommandBuffer.execute().", env);
+        return false;
+    }
+    // buf_ address changes only if capacity grows, then a new ByteBuffer is required
+    const jlong bytes = jlong(buf_.capacity() * sizeof(jvalue));
+    if (!buffer_ || env->GetDirectBufferAddress(buffer_) != buf_.data() || env->GetDirectBufferCapacity(buffer_) != bytes) {
+        env->DeleteGlobalRef(buffer_);
+        const LocalRef b(env->NewDirectByteBuffer(buf_.data(), bytes), env);
+        buffer_ = b ? env->NewGlobalRef(b) : nullptr;
+    }
+    if (refs_.size() > synced_) {
+        const jsize n = refArray_ ? env->GetArrayLength(static_cast<jarray>(refArray_)) : 0;
+        if (refs_.size() > size_t(n)) {
+            env->DeleteGlobalRef(refArray_);
+            const LocalRef a(env->NewObjectArray(jsize(std::max<size_t>(refs_.size(), 2 * n)), objectClass(env), nullptr), env);
+            refArray_ = a ? env->NewGlobalRef(a) : nullptr;
+            synced_ = 0;
+        }
+        for (; refArray_ && synced_ < refs_.size(); ++synced_)
+            env->SetObjectArrayElement(static_cast<jobjectArray>(refArray_), jsize(synced_), refs_[synced_]);
+    }
+    if (!out_ || size_t(env->GetArrayLength(static_cast<jarray>(out_))) < offsets_.size()) {
+        env->DeleteGlobalRef(out_);
+        const LocalRef a(env->NewObjectArray(jsize(offsets_.size()), objectClass(env), nullptr), env);
+        out_ = a ? env->NewGlobalRef(a) : nullptr;
+    }
+    if (!buffer_ || (refs_.size() && !refArray_) || !out_) {
+        error_ = detail::handle_exception("Failed to create CommandBuffer java objects.", env);
+        if (error_.empty())
+            error_ = "Failed to create CommandBuffer java objects.";
+        return false;
+    }
+    const jint failed = env->CallStaticIntMethod(cid, mid, buffer_, jint(offsets_.size()), refArray_, out_);
+    error_ = detail::handle_exception("Failed to execute CommandBuffer.", env);
+    if (!error_.empty())
+        return false;
+    executed_ = offsets_.size();
+    if (failed > 0)
+        error_ = std::to_string(failed) + " of " + std::to_string(executed_) + " commands failed";
+    return failed == 0;
+}
+
+bool CommandBuffer::ok(size_t i) const
+{
+    if (i >= executed_)
+        return false;
+    detail::command_header h;
+    memcpy(&h, &buf_[offsets_[i]], sizeof(h));
+    return h.status == 0;
+}
+
+string CommandBuffer::error(size_t i) const
+{
+    if (i >= executed_ || ok(i))
+        return {};
+    JNIEnv* env = getEnv();
+    static const jmethodID toString = env->GetMethodID(objectClass(env), "toString", "()Ljava/lang/String;");
+    const LocalRef e(env->GetObjectArrayElement(static_cast<jobjectArray>(out_), jsize(i)), env);
+    return to_string(static_cast<jstring>(env->CallObjectMethod(e, toString)), env);
+}
+
+////////// RingBuffer //////////
+/*
+  Layout(the same as java jmi.RingBuffer): head(reserved bytes) | tail(consumed bytes) | waiting consumer | data, each control field is in its own cache line.
+  A record is int32 header(0: not committed, -1: padding to the end, otherwise size + 1) + payload, aligned to 8 bytes. Consumed bytes are zeroed, so
+  headers of uncommitted records are always 0. Producers reserve space by increasing head(CAS if multiProducer), then commit by storing the header.
+ */
+namespace detail {
+// T has member atomic<int> refs
+template<typename T>
+static void retain(T* m)
+{
+    m->refs.fetch_add(1, memory_order_relaxed);
+}
+
+template<typename T>
+static void release(T* m)
+{
+    if (m->refs.fetch_sub(1, memory_order_acq_rel) == 1)
+        delete m;
+}
+
+// returns buf tracked by jmi.DirectBuffers, release() is called once after it's garbage collected. if not tracked, release() is called now
+static JByteBuffer track_direct_buffer(LocalRef&& buf, bool readOnly, const function<void()>& release)
+{
+    if (!buf || !registerNativeCallback()) {
+        release();
+        return JByteBuffer();
+    }
+    // the callback called by the java cleaner removes itself
+    auto handle = make_shared<jlong>(0);
+    *handle = add_callback([release, handle](JNIEnv*, jobjectArray) -> jobject {
+        if (remove_callback(*handle))
+            release();
+        return nullptr;
+    });
+    if (!*handle) {
+        release();
+        return JByteBuffer();
+    }
+    struct Track : MethodTag { static const char* name() { return "track"; } };
+    NativeCallback releaser;
+    JByteBuffer b;
+    if (releaser.create(*handle))
+        b = JObject<direct_buffers_tag>::callStatic<JByteBuffer, Track>(JByteBuffer(std::move(buf)), releaser, jboolean(readOnly));
+    if (!b && remove_callback(*handle)) // not tracked by java
+        release();
+    return b;
+}
+
+struct ring_waiter {
+    mutex mtx;
+    condition_variable cv;
+};
+
+struct ring_memory {
+    atomic<int> refs{1}; // RingBuffer and java ByteBuffer
+    char* mem = nullptr;
+
+    ~ring_memory() { delete[] mem; }
+};
+} // namespace detail
+
+enum : size_t {
+    kRingHead = 0,
+    kRingTail = 64,
+    kRingWaiting = 128,
+    kRingData = 192,
+};
+enum : int32_t {
+    kRingPadding = -1,
+    kJavaWaiting = 1,
+    kNativeWaiting = 2,
+};
+
+static inline size_t ringRecordSize(size_t size) { return (4 + size + 7) & ~size_t(7); }
+static inline atomic<uint64_t>& ringCounter(char* base, size_t offset) { return *reinterpret_cast<atomic<uint64_t>*>(base + offset); }
+static inline atomic<int32_t>& ringInt(char* base, size_t offset) { return *reinterpret_cast<atomic<int32_t>*>(base + offset); }
+static_assert(sizeof(atomic<uint64_t>) == 8 && sizeof(atomic<int32_t>) == 4, "atomics must have the same layout as java");
+
+RingBuffer::RingBuffer(size_t capacity, bool multiProducer)
+    : cap_(64), mp_(multiProducer)
+{
+    while (cap_ < capacity)
+        cap_ *= 2;
+    mem_ = new detail::ring_memory();
+    mem_->mem = new char[kRingData + cap_ + 63](); // zeroed
+    base_ = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(mem_->mem) + 63) & ~uintptr_t(63));
+    new (base_ + kRingHead) atomic<uint64_t>(0);
+    new (base_ + kRingTail) atomic<uint64_t>(0);
+    new (base_ + kRingWaiting) atomic<int32_t>(0);
+    const auto w = make_shared<detail::ring_waiter>(); // java may be calling waker_ when RingBuffer is destroyed
+    waiter_ = w.get();
+    waker_ = Callback([w] {
+        lock_guard<mutex> lock(w->mtx);
+        w->cv.notify_all();
+    });
+}
+
+RingBuffer::~RingBuffer()
+{
+    obj_.reset();
+    waker_.reset();
+    if (mem_)
+        detail::release(mem_); // java ByteBuffer may still hold a reference
+}
+
+RingBuffer& RingBuffer::operator=(RingBuffer&& that) noexcept
+{
+    swap(mem_, that.mem_);
+    swap(base_, that.base_);
+    swap(cap_, that.cap_);
+    swap(mp_, that.mp_);
+    swap(waiter_, that.waiter_);
+    swap(waker_, that.waker_);
+    swap(obj_, that.obj_);
+    return *this;
+}
+
+bool RingBuffer::write(const void* data, size_t size)
+{
+    const size_t n = ringRecordSize(size);
+    if (!base_ || !size || n > cap_)
+        return false;
+    auto& head = ringCounter(base_, kRingHead);
+    auto& tail = ringCounter(base_, kRingTail);
+    uint64_t h = head.load(memory_order_relaxed);
+    size_t i = 0;
+    size_t pad = 0;
+    for (;;) {
+        const uint64_t t = tail.load(memory_order_acquire); // consumed bytes are zeroed
+        i = size_t(h & (cap_ - 1));
+        pad = i + n > cap_ ? cap_ - i : 0; // a record is never split
+        if (h + pad + n - t > cap_)
+            return false;
+        if (!mp_) {
+            head.store(h + pad + n, memory_order_relaxed);
+            break;
+        }
+        if (head.compare_exchange_weak(h, h + pad + n, memory_order_relaxed))
+            break;
+    }
+    char* d = base_ + kRingData;
+    if (pad) {
+        ringInt(d, i).store(kRingPadding, memory_order_release);
+        i = 0;
+    }
+    memcpy(d + i + 4, data, size);
+    ringInt(d, i).store(int32_t(size + 1), memory_order_release);
+    notify();
+    return true;
+}
+
+const char* RingBuffer::front(size_t* size)
+{
+    if (!base_)
+        return nullptr;
+    auto& tail = ringCounter(base_, kRingTail);
+    char* d = base_ + kRingData;
+    for (;;) {
+        const uint64_t t = tail.load(memory_order_relaxed); // only consumer changes tail
+        const size_t i = size_t(t & (cap_ - 1));
+        const int32_t h = ringInt(d, i).load(memory_order_acquire);
+        if (h == 0)
+            return nullptr;
+        if (h != kRingPadding) {
+            *size = size_t(h - 1);
+            return d + i + 4;
+        }
+        ringInt(d, i).store(0, memory_order_relaxed);
+        tail.store(t + cap_ - i, memory_order_release);
+    }
+}
+
+void RingBuffer::pop(size_t size)
+{
+    auto& tail = ringCounter(base_, kRingTail);
+    const uint64_t t = tail.load(memory_order_relaxed);
+    const size_t i = size_t(t & (cap_ - 1));
+    char* d = base_ + kRingData;
+    const size_t n = ringRecordSize(size);
+    ringInt(d, i).store(0, memory_order_relaxed);
+    memset(d + i + 4, 0, n - 4);
+    tail.store(t + n, memory_order_release);
+}
+
+size_t RingBuffer::read(void* data, size_t size)
+{
+    size_t n = 0;
+    const char* p = front(&n);
+    if (!p || n > size)
+        return n;
+    memcpy(data, p, n);
+    pop(n);
+    return n;
+}
+
+bool RingBuffer::wait(int timeoutMs)
+{
+    size_t n = 0;
+    if (front(&n))
+        return true;
+    if (!base_)
+        return false;
+    auto& waiting = ringInt(base_, kRingWaiting);
+    const auto deadline = chrono::steady_clock::now() + chrono::milliseconds(timeoutMs < 0 ? 0 : timeoutMs);
+    unique_lock<mutex> lock(waiter_->mtx);
+    bool ready = false;
+    while (!ready) {
+        waiting.store(kNativeWaiting, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst); // pairs with the fence in notify(), either producer sees waiting or consumer sees the record
+        ready = !!front(&n);
+        if (ready)
+            break;
+        if (timeoutMs < 0)
+            waiter_->cv.wait(lock);
+        else if (waiter_->cv.wait_until(lock, deadline) == cv_status::timeout)
+            ready = !!front(&n);
+        if (timeoutMs >= 0 && chrono::steady_clock::now() >= deadline)
+            break;
+    }
+    waiting.store(0, memory_order_relaxed);
+    return ready;
+}
+
+void RingBuffer::notify()
+{
+    auto& waiting = ringInt(base_, kRingWaiting);
+    atomic_thread_fence(memory_order_seq_cst);
+    int32_t w = waiting.load(memory_order_relaxed);
+    if (!w || !waiting.compare_exchange_strong(w, 0, memory_order_relaxed))
+        return;
+    if (w == kNativeWaiting) {
+        lock_guard<mutex> lock(waiter_->mtx);
+        waiter_->cv.notify_all();
+        return;
+    }
+    struct Wakeup : MethodTag { static const char* name() { return "wakeup"; } };
+    if (obj_)
+        obj_.call<Wakeup>();
+}
+
+const JRingBuffer& RingBuffer::object() const
+{
+    if (obj_ || !base_)
+        return obj_;
+    JNIEnv* env = getEnv();
+    detail::ring_memory* m = mem_;
+    detail::retain(m);
+    const auto buf = detail::track_direct_buffer(LocalRef(env->NewDirectByteBuffer(base_, jlong(kRingData + cap_)), env), false, [m]{ detail::release(m); });
+    if (buf)
+        obj_.create(buf, jboolean(mp_), waker_.object());
+    return obj_;
+}
+
+////////// MappedBuffer //////////
+namespace detail {
+struct mapping {
+    atomic<int> refs{1}; // MappedBuffer and java windows
+    char* base = nullptr; // aligned to page(allocation granularity on windows)
+    size_t length = 0; // mapped bytes from base
+    char* data = nullptr; // requested offset
+    size_t size = 0;
+    bool writable = false;
+
+    ~mapping() {
+        if (!base)
+            return;
+#if defined(_WIN32)
+        UnmapViewOfFile(base);
+#else
+        munmap(base, length);
+#endif
+    }
+};
+
+} // namespace detail
+
+MappedBuffer& MappedBuffer::operator=(MappedBuffer&& that) noexcept
+{
+    if (this == &that)
+        return *this;
+    reset();
+    std::swap(m_, that.m_);
+    error_ = std::move(that.error_);
+    return *this;
+}
+
+bool MappedBuffer::open(const string& path, size_t offset, size_t size, bool writable)
+{
+    reset();
+    error_.clear();
+    unique_ptr<detail::mapping> m(new detail::mapping());
+    m->writable = writable;
+#if defined(_WIN32)
+    wstring wpath(MultiByteToWideChar(CP_UTF8, 0, path.data(), -1, nullptr, 0), 0);
+    MultiByteToWideChar(CP_UTF8, 0, path.data(), -1, &wpath[0], int(wpath.size()));
+    const HANDLE file = CreateFileW(wpath.data(), GENERIC_READ | (writable ? GENERIC_WRITE : 0), FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        error_ = "failed to open " + path + ": " + std::to_string(GetLastError());
+        return false;
+    }
+    const auto closeFile = detail::call_on_exit([=]{ CloseHandle(file); });
+    LARGE_INTEGER fsize;
+    if (!GetFileSizeEx(file, &fsize)) {
+        error_ = "failed to get size of " + path + ": " + std::to_string(GetLastError());
+        return false;
+    }
+    const uint64_t fileSize = uint64_t(fsize.QuadPart);
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    const uint64_t align = si.dwAllocationGranularity;
+#else
+    const int fd = ::open(path.data(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (fd < 0) {
+        error_ = "failed to open " + path + ": " + strerror(errno);
+        return false;
+    }
+    const auto closeFile = detail::call_on_exit([=]{ ::close(fd); });
+#if (JMI_MMAP64+0)
+    struct stat64 st;
+    if (fstat64(fd, &st) != 0) {
+#else
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+#endif
+        error_ = "failed to stat " + path + ": " + strerror(errno);
+        return false;
+    }
+    const uint64_t fileSize = uint64_t(st.st_size);
+    const uint64_t align = uint64_t(sysconf(_SC_PAGESIZE));
+#endif
+    if (offset >= fileSize || (size && size > fileSize - offset)) {
+        error_ = "out of range of " + path + ", size " + std::to_string(fileSize);
+        return false;
+    }
+    if (!size && fileSize - offset > numeric_limits<size_t>::max()) {
+        error_ = "too large to map " + path + ", size " + std::to_string(fileSize);
+        return false;
+    }
+    if (!size)
+        size = size_t(fileSize - offset);
+    const uint64_t start = offset / align * align;
+    const size_t delta = size_t(offset - start);
+    if (size > numeric_limits<size_t>::max() - delta) {
+        error_ = "too large to map " + path + ", size " + std::to_string(size);
+        return false;
+    }
+    m->length = delta + size;
+#if defined(_WIN32)
+    const HANDLE map = CreateFileMappingW(file, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+    if (!map) {
+        error_ = "failed to create file mapping of " + path + ": " + std::to_string(GetLastError());
+        return false;
+    }
+    m->base = static_cast<char*>(MapViewOfFile(map, writable ? FILE_MAP_WRITE : FILE_MAP_READ, DWORD(start >> 32), DWORD(start), m->length));
+    CloseHandle(map); // the view keeps the mapping object
+    if (!m->base) {
+        error_ = "failed to map " + path + ": " + std::to_string(GetLastError());
+        return false;
+    }
+#else
+#if (JMI_MMAP64+0)
+    void* p = mmap64(nullptr, m->length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, off64_t(start));
+#else
+    if (start > uint64_t(numeric_limits<off_t>::max())) {
+        error_ = "offset out of range of off_t: " + std::to_string(start);
+        return false;
+    }
+    void* p = mmap(nullptr, m->length, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, off_t(start));
+#endif
+    if (p == MAP_FAILED) {
+        error_ = "failed to map " + path + ": " + strerror(errno);
+        return false;
+    }
+    m->base = static_cast<char*>(p);
+#endif
+    m->data = m->base + delta;
+    m->size = size;
+    m_ = m.release();
+    return true;
+}
+
+void MappedBuffer::reset()
+{
+    if (m_)
+        detail::release(m_);
+    m_ = nullptr;
+}
+
+char* MappedBuffer::data() const
+{
+    return m_ ? m_->data : nullptr;
+}
+
+size_t MappedBuffer::size() const
+{
+    return m_ ? m_->size : 0;
+}
+
+bool MappedBuffer::writable() const
+{
+    return m_ && m_->writable;
+}
+
+JByteBuffer MappedBuffer::window(size_t offset, size_t size) const
+{
+    if (!m_ || offset >= m_->size)
+        return JByteBuffer();
+    size = std::min<size_t>(size ? std::min(size, m_->size - offset) : m_->size - offset, 0x7fffffff);
+    JNIEnv* env = getEnv();
+    detail::mapping* m = m_;
+    detail::retain(m); // released by java DirectBuffers
+    return detail::track_direct_buffer(LocalRef(env->NewDirectByteBuffer(m->data + offset, jlong(size)), env), !m->writable, [m]{ detail::release(m); });
+}
+
+bool MappedBuffer::advise(Advice advice, size_t offset, size_t size) const
+{
+    if (!m_ || offset >= m_->size)
+        return false;
+#if defined(_WIN32)
+    (void)advice;
+    (void)size;
+    return false;
+#else
+    if (!size || size > m_->size - offset)
+        size = m_->size - offset;
+    static const int kAdvice[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED, MADV_DONTNEED };
+    const size_t page = size_t(sysconf(_SC_PAGESIZE));
+    char* p = m_->data + offset;
+    char* start = m_->base + size_t(p - m_->base) / page * page;
+    return madvise(start, size_t(p + size - start), kAdvice[advice]) == 0;
+#endif
+}
+
+////////// Streams //////////
+namespace detail {
+struct stream_prefetcher {
+    mutex mtx;
+    condition_variable cv;
+    vector<char> data; // the next chunk, swapped with JInputStreamBuf::buf_
+    jint size = 0;
+    bool ready = false;
+    bool stop = false;
+    string error;
+    thread worker;
+};
+} // namespace detail
+
+static jmethodID streamMethod(JNIEnv* env, const char* cls, const char* name, const char* sig)
+{
+    const LocalRef c(env->FindClass(cls), env);
+    return c ? env->GetMethodID(c, name, sig) : nullptr; // valid as long as the class is loaded, java.io classes are never unloaded
+}
+
+static jobject newByteArray(JNIEnv* env, size_t size)
+{
+    const LocalRef a(env->NewByteArray(jsize(size)), env);
+    return a ? env->NewGlobalRef(a) : nullptr;
+}
+
+JInputStreamBuf::JInputStreamBuf(jobject stream, size_t chunk, bool prefetch)
+    : chunk_(std::min<size_t>(std::max<size_t>(chunk, 1), 0x7fffffff))
+    , buf_(chunk_)
+{
+    JNIEnv* env = getEnv();
+    stream_ = stream ? env->NewGlobalRef(stream) : nullptr;
+    array_ = newByteArray(env, chunk_);
+    if (!stream_ || !array_) {
+        error_ = detail::handle_exception("Failed to create JInputStreamBuf.", env);
+        return;
+    }
+    setg(buf_.data(), buf_.data(), buf_.data());
+    if (!prefetch)
+        return;
+    prefetch_ = new detail::stream_prefetcher();
+    prefetch_->data.resize(chunk_);
+    prefetch_->worker = thread([this] {
+        JNIEnv* env = getEnv(); // attached, and detached at thread exit
+        auto p = prefetch_;
+        for (;;) {
+            {
+                unique_lock<mutex> lock(p->mtx);
+                p->cv.wait(lock, [p]{ return !p->ready || p->stop; });
+                if (p->stop)
+                    return;
+            }
+            string error;
+            const jint n = fill(env, p->data.data(), error); // data is not used by consumer until ready
+            {
+                lock_guard<mutex> lock(p->mtx);
+                p->size = n;
+                p->error = std::move(error);
+                p->ready = true;
+            }
+            p->cv.notify_all();
+            if (n < 0)
+                return;
+        }
+    });
+}
+
+JInputStreamBuf::~JInputStreamBuf()
+{
+    if (prefetch_) {
+        {
+            lock_guard<mutex> lock(prefetch_->mtx);
+            prefetch_->stop = true;
+        }
+        prefetch_->cv.notify_all();
+        prefetch_->worker.join();
+        delete prefetch_;
+    }
+    JNIEnv* env = getEnv();
+    if (stream_)
+        env->DeleteGlobalRef(stream_);
+    if (array_)
+        env->DeleteGlobalRef(array_);
+}
+
+jint JInputStreamBuf::fill(JNIEnv* env, char* data, string& error) const
+{
+    static jmethodID mid = nullptr;
+    if (!mid)
+        mid = streamMethod(env, "java/io/InputStream", "read", "([BII)I");
+    if (!mid) {
+        error = detail::handle_exception("Failed to find InputStream.read().", env);
+        return -1;
+    }
+    jint n = 0;
+    do { // some streams return 0 before the end
+        n = env->CallIntMethod(stream_, mid, array_, jint(0), jint(chunk_));
+    } while (n == 0 && !env->ExceptionCheck());
+    error = detail::handle_exception("Failed to read InputStream.", env);
+    if (!error.empty() || n < 0)
+        return -1;
+    env->GetByteArrayRegion(static_cast<jbyteArray>(array_), 0, n, reinterpret_cast<jbyte*>(data));
+    return n;
+}
+
+JInputStreamBuf::int_type JInputStreamBuf::underflow()
+{
+    if (gptr() < egptr())
+        return traits_type::to_int_type(*gptr());
+    if (!stream_ || !array_)
+        return traits_type::eof();
+    jint n = -1;
+    if (!prefetch_) {
+        n = fill(getEnv(), buf_.data(), error_);
+    } else {
+        unique_lock<mutex> lock(prefetch_->mtx);
+        prefetch_->cv.wait(lock, [this]{ return prefetch_->ready; });
+        n = prefetch_->size;
+        error_ = prefetch_->error;
+        if (n < 0) // keep ready, the worker is finished
+            return traits_type::eof();
+        buf_.swap(prefetch_->data);
+        prefetch_->ready = false;
+        lock.unlock();
+        prefetch_->cv.notify_all();
+    }
+    if (n < 0)
+        return traits_type::eof();
+    setg(buf_.data(), buf_.data(), buf_.data() + n);
+    return traits_type::to_int_type(*gptr());
+}
+
+JOutputStreamBuf::JOutputStreamBuf(jobject stream, size_t chunk)
+    : buf_(std::min<size_t>(std::max<size_t>(chunk, 1), 0x7fffffff))
+{
+    JNIEnv* env = getEnv();
+    stream_ = stream ? env->NewGlobalRef(stream) : nullptr;
+    array_ = newByteArray(env, buf_.size());
+    if (!stream_ || !array_) {
+        error_ = detail::handle_exception("Failed to create JOutputStreamBuf.", env);
+        return;
+    }
+    setp(buf_.data(), buf_.data() + buf_.size());
+}
+
+JOutputStreamBuf::~JOutputStreamBuf()
+{
+    JNIEnv* env = getEnv();
+    if (stream_ && array_)
+        flushBuffer(env);
+    if (stream_)
+        env->DeleteGlobalRef(stream_);
+    if (array_)
+        env->DeleteGlobalRef(array_);
+}
+
+bool JOutputStreamBuf::flushBuffer(JNIEnv* env)
+{
+    const jint n = jint(pptr() - pbase());
+    if (n <= 0)
+        return true;
+    static jmethodID mid = nullptr;
+    if (!mid)
+        mid = streamMethod(env, "java/io/OutputStream", "write", "([BII)V");
+    if (!mid) {
+        error_ = detail::handle_exception("Failed to find OutputStream.write().", env);
+        return false;
+    }
+    env->SetByteArrayRegion(static_cast<jbyteArray>(array_), 0, n, reinterpret_cast<const jbyte*>(pbase()));
+    env->CallVoidMethod(stream_, mid, array_, jint(0), n);
+    error_ = detail::handle_exception("Failed to write OutputStream.", env);
+    setp(buf_.data(), buf_.data() + buf_.size()); // data is dropped on error
+    return error_.empty();
+}
+
+JOutputStreamBuf::int_type JOutputStreamBuf::overflow(int_type c)
+{
+    if (!stream_ || !array_ || !flushBuffer(getEnv()))
+        return traits_type::eof();
+    if (traits_type::eq_int_type(c, traits_type::eof()))
+        return traits_type::not_eof(c);
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
+    return c;
+}
+
+int JOutputStreamBuf::sync()
+{
+    if (!stream_ || !array_)
+        return -1;
+    JNIEnv* env = getEnv();
+    if (!flushBuffer(env))
+        return -1;
+    static jmethodID mid = nullptr;
+    if (!mid)
+        mid = streamMethod(env, "java/io/OutputStream", "flush", "()V");
+    if (mid)
+        env->CallVoidMethod(stream_, mid);
+    error_ = detail::handle_exception("Failed to flush OutputStream.", env);
+    return error_.empty() ? 0 : -1;
+}
+
+namespace detail {
+struct input_source {
+    stream_source_t read;
+    vector<char> buf; // for byte[]
+};
+} // namespace detail
+
+static detail::input_source* inputSource(JNIEnv* env, jlong handle)
+{
+    if (!handle) { // java checks closed streams, just in case
+        const LocalRef c(env->FindClass("java/io/IOException"), env);
+        env->ThrowNew(c, "Stream closed");
+    }
+    return reinterpret_cast<detail::input_source*>(handle);
+}
+
+// a c++ exception thrown by the source is rethrown in java as IOException, and 0 is returned
+static size_t readSource(JNIEnv* env, detail::input_source* s, char* data, size_t size)
+{
+#if (JMI_EXCEPTIONS + 0) // c++ exceptions must not cross jni boundary
+    try {
+        return s->read(data, size);
+    } catch (...) {
+        detail::throw_java_current(env, "java/io/IOException");
+    }
+    return 0;
+#else
+    (void)env;
+    return s->read(data, size);
+#endif
+}
+
+static jint JNICALL nativeRead(JNIEnv* env, jclass, jlong handle, jbyteArray b, jint off, jint len)
+{
+    auto s = inputSource(env, handle);
+    if (!s)
+        return -1;
+    const size_t n = readSource(env, s, s->buf.data(), std::min(size_t(len), s->buf.size()));
+    if (n == 0)
+        return -1;
+    env->SetByteArrayRegion(b, off, jsize(n), reinterpret_cast<const jbyte*>(s->buf.data()));
+    return jint(n);
+}
+
+static jint JNICALL nativeReadDirect(JNIEnv* env, jclass, jlong handle, jobject buf, jint off, jint len)
+{
+    auto s = inputSource(env, handle);
+    if (!s)
+        return -1;
+    char* p = static_cast<char*>(env->GetDirectBufferAddress(buf));
+    if (!p) { // not eof
+        detail::throw_java(env, "java/lang/IllegalArgumentException", "direct ByteBuffer address is not available");
+        return -1;
+    }
+    const size_t n = readSource(env, s, p + off, size_t(len));
+    return n == 0 ? -1 : jint(n);
+}
+
+static void JNICALL nativeClose(JNIEnv*, jclass, jlong handle)
+{
+    delete reinterpret_cast<detail::input_source*>(handle);
+}
+
+JNativeInputStream makeInputStream(std::streambuf* sb, size_t chunk)
+{
+    return makeInputStream([sb](char* data, size_t size) {
+        const auto n = sb->sgetn(data, streamsize(size));
+        return n > 0 ? size_t(n) : 0;
+    }, chunk);
+}
+
+namespace detail {
+JNativeInputStream make_input_stream(stream_source_t&& read, size_t chunk)
+{
+    static const bool registered = [] {
+        static const JNINativeMethod methods[] = {
+            {const_cast<char*>("nativeRead"), const_cast<char*>("(J[BII)I"), reinterpret_cast<void*>(&nativeRead)},
+            {const_cast<char*>("nativeReadDirect"), const_cast<char*>("(JLjava/nio/ByteBuffer;II)I"), reinterpret_cast<void*>(&nativeReadDirect)},
+            {const_cast<char*>("nativeClose"), const_cast<char*>("(J)V"), reinterpret_cast<void*>(&nativeClose)},
+        };
+        return JNativeInputStream::registerNatives(methods, 3);
+    }();
+    JNativeInputStream in;
+    if (!registered || !read)
+        return in;
+    auto s = new input_source{std::move(read), vector<char>(std::min<size_t>(std::max<size_t>(chunk, 1), 0x7fffffff))};
+    if (!in.create(jlong(reinterpret_cast<intptr_t>(s)))) // owned by java object
+        delete s;
+    return in;
+}
+} // namespace detail
+
+////////// Enums //////////
+namespace detail {
+const vector<jobject>* java_enum_constants(const char* className)
+{
+    static mutex mtx;
+    static auto tables = new map<string, vector<jobject>>(); // never destroyed, elements are never removed so addresses are stable
+    {
+        lock_guard<mutex> lock(mtx);
+        const auto it = tables->find(className);
+        if (it != tables->end())
+            return &it->second;
+    }
+    JNIEnv* env = getEnv();
+    const LocalRef c(env->FindClass(className), env);
+    static jmethodID getEnumConstants = nullptr; // Class.getEnumConstants()
+    if (c && !getEnumConstants) {
+        const LocalRef cc(env->FindClass("java/lang/Class"), env);
+        if (cc)
+            getEnumConstants = env->GetMethodID(cc, "getEnumConstants", "()[Ljava/lang/Object;");
+    }
+    const LocalRef a(c && getEnumConstants ? env->CallObjectMethod(c, getEnumConstants) : nullptr, env);
+    if (!a) { // class not found, or not an enum class
+        if (!env->ExceptionCheck())
+            throw_java(env, "java/lang/IllegalArgumentException", (string("Not a java enum: ") + className).data());
+        return nullptr;
+    }
+    const jsize n = env->GetArrayLength(static_cast<jarray>(jobject(a)));
+    vector<jobject> constants;
+    constants.reserve(n);
+    for (jsize i = 0; i < n; ++i) {
+        const LocalRef e(env->GetObjectArrayElement(static_cast<jobjectArray>(jobject(a)), i), env);
+        constants.push_back(env->NewGlobalRef(e));
+    }
+    lock_guard<mutex> lock(mtx);
+    const auto it = tables->find(className);
+    if (it != tables->end()) { // resolved by another thread
+        for (auto e : constants)
+            env->DeleteGlobalRef(e);
+        return &it->second;
+    }
+    return &tables->emplace(className, std::move(constants)).first->second;
+}
+
+jint java_enum_ordinal(JNIEnv* env, jobject e, const vector<jobject>& constants)
+{
+    if (!e)
+        return -1;
+    static const jmethodID ordinal = [env] { // Enum.ordinal()
+        const LocalRef c(env->FindClass("java/lang/Enum"), env);
+        return c ? env->GetMethodID(c, "ordinal", "()I") : nullptr;
+    }();
+    if (!ordinal)
+        return -1;
+    const jint i = env->CallIntMethod(e, ordinal);
+    if (!handle_exception("Failed to get ordinal of java enum.", env).empty())
+        return -1;
+    if (i < 0 || size_t(i) >= constants.size() || !env->IsSameObject(e, constants[i])) // a constant of another enum class
+        return -1;
+    return i;
+}
+} // namespace detail
+
+////////// Array Chunks //////////
+namespace detail {
+// 1 chunk exchanged between the caller and the background thread. data is owned by the reader(c++ caller for read, worker for write) if full
+struct region_slot {
+    mutex mtx;
+    condition_variable cv;
+    vector<char> data;
+    size_t offset = 0;
+    size_t size = 0;
+    size_t written = 0;
+    bool full = false;
+    bool failed = false;
+    bool stop = false;
+};
+
+static bool copy_region(JNIEnv* env, region_copy_t copy, jarray a, size_t offset, size_t n, void* data)
+{
+    copy(env, a, offset, n, data);
+    return handle_exception("Failed to copy java array region.", env).empty();
+}
+
+size_t stream_jarray(jobject array, size_t element_size, region_copy_t copy, bool write, size_t chunk, bool background, const region_func_t& f)
+{
+    JNIEnv* env = getEnv();
+    if (!env || !array)
+        return 0;
+    const size_t len = env->GetArrayLength(static_cast<jarray>(array));
+    chunk = std::max<size_t>(std::min(chunk, len), 1);
+    vector<char> buf(chunk * element_size);
+    size_t done = 0;
+    if (!background || len <= chunk) {
+        for (size_t offset = 0; offset < len; offset += chunk) {
+            const size_t n = std::min(chunk, len - offset);
+            if (!write && !copy_region(env, copy, static_cast<jarray>(array), offset, n, buf.data()))
+                break;
+            const bool more = f(buf.data(), offset, n);
+            if (write && !copy_region(env, copy, static_cast<jarray>(array), offset, n, buf.data()))
+                break;
+            done += n;
+            if (!more)
+                break;
+        }
+        return done;
+    }
+    const jarray a = static_cast<jarray>(env->NewGlobalRef(array)); // used by the worker thread
+    const auto unref = call_on_exit([&]{ env->DeleteGlobalRef(a); }); // after the worker is joined, or if the thread fails to start
+    region_slot s;
+    s.data.resize(buf.size());
+    thread worker([&] {
+        JNIEnv* env = getEnv(); // attached, and detached at thread exit
+        if (!env) { // failed to attach
+            {
+                lock_guard<mutex> lock(s.mtx);
+                s.failed = true;
+            }
+            s.cv.notify_all();
+            return;
+        }
+        for (size_t offset = 0; ; offset += chunk) {
+            unique_lock<mutex> lock(s.mtx);
+            s.cv.wait(lock, [&]{ return s.stop || s.full == write; }); // read: wait for an empty slot, write: wait for data
+            if (s.stop || (!write && offset >= len))
+                return;
+            if (write)
+                offset = s.offset;
+            const size_t n = write ? s.size : std::min(chunk, len - offset);
+            lock.unlock();
+            const bool ok = copy_region(env, copy, a, offset, n, s.data.data());
+            lock.lock();
+            s.offset = offset;
+            s.size = n;
+            s.failed = !ok;
+            s.full = !write;
+            if (write && ok)
+                s.written += n;
+            lock.unlock();
+            s.cv.notify_all();
+            if (!ok)
+                return;
+        }
+    });
+    bool finished = false;
+    const auto stop = [&] {
+        {
+            unique_lock<mutex> lock(s.mtx);
+            if (write && finished) // wait for the last chunk
+                s.cv.wait(lock, [&]{ return !s.full || s.failed; });
+            s.stop = true;
+        }
+        s.cv.notify_all();
+        worker.join();
+    };
+    const auto stopper = call_on_exit([&]{ // f throws
+        if (!finished)
+            stop();
+    });
+    for (size_t offset = 0; offset < len; offset += chunk) {
+        size_t n = std::min(chunk, len - offset);
+        bool more = true;
+        if (write)
+            more = f(buf.data(), offset, n);
+        {
+            unique_lock<mutex> lock(s.mtx);
+            s.cv.wait(lock, [&]{ return s.full != write || s.failed; });
+            if (s.failed)
+                break;
+            buf.swap(s.data);
+            s.offset = offset;
+            s.size = n;
+            s.full = write;
+        }
+        s.cv.notify_all();
+        if (!write) {
+            more = f(buf.data(), offset, n);
+            done += n;
+        }
+        if (!more)
+            break;
+    }
+    finished = true;
+    stop();
+    return write ? s.written : done;
+}
 } // namespace detail
 } //namespace jmi
@@ -14,9 +14,18 @@
 #pragma once
 #include <algorithm>
 #include <array>
+#include <cstring> // memcpy
 #include <functional> // std::ref
+#include <iterator>
+#include <map>
+#include <set>
+#include <streambuf>
 #include <string>
+#include <tuple>
 #include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <jni.h>
 #define JMI_USE_CXX17 1
 #if (__cplusplus + 0) >= 201707L || (_MSVC_LANG+0) > 201703L
@@ -30,6 +39,9 @@
 #elif !defined(_LIBCPP_STRING_VIEW)
 using string_view = std::string;
 #endif
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS) || defined(_CPPUNWIND)
+# define JMI_EXCEPTIONS 1
+#endif
 #if (JMI_CXX17+0) && (JMI_USE_CXX17 + 0)
 # define CONSTEXPR17 constexpr
 #else
@@ -52,6 +64,22 @@ JNIEnv *getEnv();
 string to_string(jstring s, JNIEnv* env = nullptr);
 // You have to call DeleteLocalRef() manually for the returned jstring
 jstring from_string(const string& s, JNIEnv* env = nullptr);
+// utf-16 variants. to_u16string copies java chars directly, local ref is deleted internally
+u16string to_u16string(jstring s, JNIEnv* env = nullptr);
+jstring from_string(const u16string& s, JNIEnv* env = nullptr);
+
+// java primitive arrays created for out parameters(std::ref(container)) are kept as global refs and reused by the same thread, keyed by element type and length.
+// bytes is the max total size of arrays kept by each thread, 0 disables the pool, the default. reused arrays are zeroed.
+// DO NOT enable it if a java method keeps a reference to the out parameter array.
+void setArrayPoolCapacity(size_t bytes);
+// delete arrays kept by current thread
+void flushArrayPool();
+// string arrays(std::string elements) of at least minSize elements are converted by jmi.Strings through 1 packed utf-8 buffer, a constant number of jni calls
+// instead of 3~4 per element. strings are standard utf-8 in this mode(modified utf-8 otherwise). 0 disables it, the default. Fallback to per element conversion if failed.
+void setStringArrayPacking(size_t minSize);
+// object arrays(string, JObject, nested arrays etc.) of at least minSize elements are converted by the caller and threads worker threads attached to jvm once.
+// index range is partitioned into blocks, each thread uses its own local frame. 0 threads disables it, the default. Conversions in worker threads are never parallel.
+void setParallelArrayConversion(size_t threads, size_t minSize = 1 << 14);
 
 namespace android {
 // current android/app/Application object containing a local ref
@@ -59,6 +87,22 @@ jobject application(JNIEnv* env = nullptr); // TODO: return LocalRef
 } // namespace android
 
 #define JMISTR(cstr) jmi::to_array(cstr) // cstr is a c string literal. the result is a const char* for c++14, array<char,N> for c++17
+// java string for a c string literal. NewStringUTF() is called only once for each call site, e.g. format.call<jint>("getInteger", JMI_INTERNED("width"))
+#define JMI_INTERNED(cstr) ([]() -> const jmi::JInternedString& { static const jmi::JInternedString s(cstr); return s; }())
+/*
+  register data members of a c++ struct S, which are loaded from/stored to the java fields of the same names by JObject::load()/store(). MUST be used in the namespace of S.
+    struct BufferInfo { jint offset; jint size; jlong presentationTimeUs; jint flags; };
+    JMI_STRUCT(BufferInfo, offset, size, presentationTimeUs, flags)
+  up to 16 members, member types can be any type supported by JObject::get<T>() and set(T&&)
+ */
+/*
+  JMI_NATIVE(fn): JNINativeMethod of c++ function fn for jmi::registerNatives(), java method name is the same as fn. fn type is R(JNIEnv*, jobject or jclass, Args...),
+  R and Args can be any type supported by call(), and JArrayView<T>, string_view and JStringView etc. as parameter. A trampoline converting arguments and return value is generated at compile time.
+  JMI_NATIVE_NAMED(name, fn): the same as JMI_NATIVE(fn) but the java method name is name
+ */
+#define JMI_NATIVE(fn) JMI_NATIVE_NAMED(#fn, fn)
+#define JMI_NATIVE_NAMED(name, fn) jmi::detail::native_method<decltype(&fn), &fn>::get(name)
+#define JMI_STRUCT(S, ...) inline auto jmi_struct_fields(const S*) { return std::make_tuple(JMI_FIELDS_(S, __VA_ARGS__)); }
 
 struct ClassTag {}; // used by JObject<Tag>. subclasses must define static constexpr auto name() {return JMISTR("someName");}, with or without "L ;" around someName
 struct MethodTag {}; // used by call() and callStatic(). subclasses must define static const char* name() or static constexpr const char*();
@@ -89,6 +133,18 @@ using if_not_JObject = typename enable_if<!is_JObject<T>::value, bool>::type;
 //template<typename T> // jni primitive types(not all c++ arithmetic types?), jobject, jstring, ..., JObject, c++ array types
 //using if_jni_type = typename enable_if<is_arithmetic<T>::value || is_array_like<T>::value || is_same<T,jobject> || ... || is_JObject<T>::value
 template<typename T, bool = is_enum<T>::value> struct signature;
+/*
+  Converter<T> makes a user type T usable as parameter(including std::ref(t) out parameter), return type and field type like builtin types. Specialize it in namespace jmi:
+    template<> struct Converter<Rect> {
+        using jni_type = jobject; // jni type of java value: jint, jlong, jobject, jstring etc.
+        static constexpr bool owns_local_ref = true; // to_java() returns a new local ref which is deleted after use
+        static constexpr auto signature() { return JMISTR("Landroid/graphics/Rect;"); }
+        static jobject to_java(const Rect& r, JNIEnv* env);
+        static Rect from_java(jobject r, JNIEnv* env); // r can be null. local ref r is owned by jmi, or the same as to_java() result for out parameter
+    };
+  Members are called directly by inline functions, no overhead compared with builtin types. T must be default constructible if used as return type or field type.
+ */
+template<typename T, typename = void> struct Converter {};
 #if (JMI_CXX17+0)
 template<typename T>
 inline constexpr auto signature_v = signature<T, is_enum_v<T>>::value;
@@ -99,6 +155,7 @@ template<typename R, typename... Args> CONSTEXPR17 auto signature_of(R(*)(Args..
 
 class LocalRef {
 public:
+    LocalRef() = default;
     template<typename J, detail::if_jobject<J> = true>
     LocalRef(J j, JNIEnv* env = nullptr) : j_(j), env_(env) {}
 
@@ -128,6 +185,111 @@ private:
     JNIEnv* env_ = nullptr;
 };
 
+/*
+  A java string stored as a global ref which is never deleted, so it's valid in any thread and copy is cheap.
+  As a parameter, the string is passed directly instead of creating a new java string in every call.
+ */
+class JInternedString {
+public:
+    explicit JInternedString(const char* s, JNIEnv* env = nullptr);
+    jstring id() const { return s_; }
+    operator jstring() const { return s_; }
+private:
+    jstring s_ = nullptr;
+};
+// returns the interned java string of the same content as s. the first call for each content creates a global ref. thread safe.
+// JMI_INTERNED(cstr) is faster for string literals because no lookup is required
+const JInternedString& interned(const char* s);
+
+#if (JMI_CXX17+0)
+/*
+  Read only view of java string characters without copying them to a native string. Can be used as return type and field type, e.g.
+    auto mime = format.call<JStringView>("getString", "mime"); if (mime.view() == "video/avc") ...
+  The jstring local ref is owned by the view, so it's bound to the current thread. Characters are pinned (or copied by vm) at the first access and released in dtor.
+  Char: char for modified utf8 (GetStringUTFChars), char16_t for utf16 (GetStringChars, or GetStringCritical if Critical is true).
+  WARNING: NO jni call is allowed between the first access and destruction of a critical view, including other JMI calls.
+ */
+template<typename Char, bool Critical = false>
+class BasicJStringView {
+    static_assert(!Critical || is_same<Char, char16_t>::value, "only utf16 view can be critical");
+public:
+    BasicJStringView() = default;
+    // takes the local ref s
+    explicit BasicJStringView(jstring s, JNIEnv* env = nullptr) : s_(s), env_(env) {}
+    BasicJStringView(const BasicJStringView&) = delete;
+    BasicJStringView& operator=(const BasicJStringView&) = delete;
+    BasicJStringView(BasicJStringView&& that) noexcept { *this = std::move(that); }
+    BasicJStringView& operator=(BasicJStringView&& that) noexcept {
+        swap(s_, that.s_);
+        swap(env_, that.env_);
+        swap(chars_, that.chars_);
+        swap(size_, that.size_);
+        return *this;
+    }
+    ~BasicJStringView() { reset(); }
+
+    explicit operator bool() const { return !!s_; }
+    jstring id() const { return s_; }
+    basic_string_view<Char> view() const { return {data(), size()}; }
+    operator basic_string_view<Char>() const { return view(); }
+    const Char* data() const;
+    size_t size() const { return data() ? size_ : 0; }
+    bool empty() const { return size() == 0; }
+    // release characters and the local ref
+    void reset();
+private:
+    jstring s_ = nullptr;
+    JNIEnv* env_ = nullptr;
+    mutable const Char* chars_ = nullptr;
+    mutable size_t size_ = 0;
+};
+using JStringView = BasicJStringView<char>;
+using JU16StringView = BasicJStringView<char16_t>;
+using JCriticalStringView = BasicJStringView<char16_t, true>;
+#endif // (JMI_CXX17+0)
+
+/*
+  Read only view of java primitive array elements(T is jint, jfloat etc.) without copying them to a c++ container, e.g. as a parameter of native method registered by registerNatives().
+  The jarray local ref is owned by the view. Elements are pinned (or copied by vm) at the first access and released without copying back in dtor.
+ */
+template<typename T>
+class JArrayView {
+    static_assert(is_arithmetic<T>::value, "T must be a java primitive type");
+public:
+    JArrayView() = default;
+    // takes the local ref a
+    explicit JArrayView(jarray a, JNIEnv* env = nullptr) : a_(a), env_(env) {}
+    JArrayView(const JArrayView&) = delete;
+    JArrayView& operator=(const JArrayView&) = delete;
+    JArrayView(JArrayView&& that) noexcept { *this = std::move(that); }
+    JArrayView& operator=(JArrayView&& that) noexcept {
+        swap(a_, that.a_);
+        swap(env_, that.env_);
+        swap(elems_, that.elems_);
+        swap(size_, that.size_);
+        return *this;
+    }
+    ~JArrayView() { reset(); }
+
+    explicit operator bool() const { return !!a_; }
+    jarray id() const { return a_; }
+    const T* data() const;
+    size_t size() const { return data() ? size_ : 0; }
+    bool empty() const { return size() == 0; }
+    const T* begin() const { return data(); }
+    const T* end() const { return data() + size(); }
+    // release elements and the local ref
+    void reset();
+private:
+    jarray a_ = nullptr;
+    JNIEnv* env_ = nullptr;
+    mutable const T* elems_ = nullptr;
+    mutable size_t size_ = 0;
+};
+
+template<class CTag> class ObjectArray;
+class CommandBuffer;
+
 // object must be a class template, thus we can cache class id using static member and call FindClass() only once, and also make it possible to cache method id because method id
 template<class CTag>
 class JObject : public ClassTag
@@ -172,6 +334,15 @@ public:
 
     template<typename... Args>
     bool create(Args&&... args);
+    // register native methods in 1 RegisterNatives() call. usually called by jmi::registerNatives<CTag>(JMI_NATIVE(fn)...)
+    static bool registerNatives(const JNINativeMethod* methods, size_t count);
+    /*
+      create n objects with the same constructor. gen(i) returns a std::tuple of constructor arguments for the i-th object, e.g.
+        auto rects = JObject<Rect>::createMany(n, [&](size_t i) { return std::make_tuple(l[i], t[i], r[i], b[i]); });
+      jclass, jmethodID and jvalue buffer are reused, only 1 global ref is created for all objects. error is stored in the returned array
+     */
+    template<typename Gen>
+    static ObjectArray<CTag> createMany(size_t n, Gen&& gen);
 
     /* with MethodTag we can avoid calling GetMethodID() in every call()
         struct MyMethod : jmi::MethodTag { static const char* name() { return "myMethod";} };
@@ -219,6 +390,49 @@ public:
     template<typename T>
     static bool setStatic(string_view fieldName, T&& v);
 
+    /*
+      "Into" variants for methods and fields of java array type. The java array is copied into an existing container instead of a new one,
+      C can be a resizable container(vector, valarray etc., resized only if length changes), or a fixed size one(std::array, span, c array. at most c.size() elements are copied).
+      No memory allocation if container size is not changed. Return value is the java array length, 0 if null or error.
+        std::array<jfloat, 16> mat4;
+        struct GetTransformMatrix : MethodTag { static const char* name() {return "getTransformMatrix";}};
+        texture.callInto<GetTransformMatrix>(mat4); // java: float[] getTransformMatrix()
+     */
+    template<class MTag, typename C, typename... Args, detail::if_MethodTag<MTag> = true>
+    size_t callInto(C& out, Args&&... args) const;
+    template<class MTag, typename C, typename... Args, detail::if_MethodTag<MTag> = true>
+    static size_t callStaticInto(C& out, Args&&... args);
+    template<typename C, typename... Args>
+    size_t callInto(const string_view& methodName, C& out, Args&&... args) const;
+    template<typename C, typename... Args>
+    static size_t callStaticInto(const string_view& name, C& out, Args&&... args);
+    template<class FTag, typename C, detail::if_FieldTag<FTag> = true>
+    size_t getInto(C& out) const;
+    template<class FTag, typename C, detail::if_FieldTag<FTag> = true>
+    static size_t getStaticInto(C& out);
+    template<typename C>
+    size_t getInto(string_view fieldName, C& out) const;
+    template<typename C>
+    static size_t getStaticInto(string_view fieldName, C& out);
+
+    /*
+      load/store all data members of a struct S registered by JMI_STRUCT from/to java fields of this object. jfieldIDs are resolved only once
+      for each S, all fields are accessed with 1 JNIEnv and exceptions are checked once.
+        auto info = bufferInfo.load<BufferInfo>();
+        info.flags = 0;
+        bufferInfo.store(info);
+     */
+    template<class S>
+    S load() const {
+        S s{};
+        load(s);
+        return s;
+    }
+    template<class S>
+    bool load(S& s) const;
+    template<class S>
+    bool store(const S& s);
+
     /*
         Field API
        Field lifetime is bounded to JObject, it does not add object ref, when object is destroyed/reset, accessing Field will fail (TODO: how to avoid crash?)
@@ -274,7 +488,16 @@ public:
         return Field<T, void, true>(classId(), name.data());
     }
 private:
+    template<class> friend class JObject;
+    template<class> friend class LocalObject;
+    template<class> friend class ObjectArray;
+    friend class CommandBuffer;
     static jclass classId(JNIEnv* env = nullptr);
+    template<typename Gen, typename... Args>
+    static ObjectArray<CTag> createMany(size_t n, Gen& gen, tuple<Args...>*);
+    template<class S>
+    static const jfieldID* structFieldIds(JNIEnv* env); // nullptr if any field is not found
+    bool structError(JNIEnv* env, const jfieldID* ids, const char* what) const;
     JObject& setError(const string& s) const noexcept {
         error_ = s;
         return *const_cast<JObject*>(this);
@@ -290,12 +513,600 @@ private:
 
 template<class CTag>
 using Object = JObject<CTag>;
+
+/*
+  A java object of class CTag holding a local ref instead of a global ref, e.g. an element of ObjectArray. It's bound to the current thread.
+  Methods and fields can be accessed like JObject. Convert to JObject<CTag>, or reset(localObj) a JObject subclass to keep it
+ */
+template<class CTag>
+class LocalObject {
+public:
+    LocalObject() = default;
+    LocalObject(LocalRef&& ref) : ref_(std::move(ref)) {}
+
+    operator jobject() const { return ref_.get<jobject>(); }
+    jobject id() const { return ref_.get<jobject>(); }
+    explicit operator bool() const { return !!ref_; }
+    operator JObject<CTag>() const { return JObject<CTag>(id(), false); }
+    const string& error() const {return error_;}
+
+    template<typename T, class MTag, typename... Args,  detail::if_MethodTag<MTag> = true>
+    T call(Args&&... args) const;
+    template<class MTag, typename... Args,  detail::if_MethodTag<MTag> = true>
+    void call(Args&&... args) const;
+    template<typename T, typename... Args>
+    T call(const string_view& methodName, Args&&... args) const;
+    template<typename... Args>
+    void call(const string_view& methodName, Args&&... args) const;
+    template<class FTag, typename T, detail::if_FieldTag<FTag> = true>
+    T get() const;
+    template<typename T>
+    T get(string_view fieldName) const;
+private:
+    LocalRef ref_;
+    mutable string error_;
+};
+
+namespace detail {
+template<class CTag> struct array_tag;
+}
+/*
+  Java array of CTag objects(CTag[]), only 1 global ref for the whole array, while std containers of JObject hold a global ref for each element.
+  It's a JObject, so it can be used as parameter(elements can be modified by java), return type and field type.
+  Elements are accessed as LocalObject<CTag> on demand.
+    auto a = obj.call<ObjectArray<MyClass>>("getItems");
+    for (auto&& item : a) item.call<jint>("getId");
+ */
+template<class CTag>
+class ObjectArray : public JObject<detail::array_tag<CTag>> {
+    using Base = JObject<detail::array_tag<CTag>>;
+public:
+    using Base::Base;
+    ObjectArray() = default; // required by msvc
+
+    // create an array of n null elements
+    bool create(size_t n);
+    // create an array from a range of JObject<CTag>, LocalObject<CTag> or jobject elements
+    template<class It>
+    bool create(It first, It last);
+
+    size_t size() const;
+    LocalObject<CTag> get(size_t i) const;
+    LocalObject<CTag> operator[](size_t i) const { return get(i); }
+    bool set(size_t i, jobject obj);
+    // load/store a container of structs registered by JMI_STRUCT from/to elements, see JObject::load(). a resizable container is resized to size() by load()
+    template<class C>
+    bool load(C& structs) const;
+    template<class C>
+    bool store(const C& structs);
+
+    class iterator {
+    public:
+        using iterator_category = input_iterator_tag;
+        using value_type = LocalObject<CTag>;
+        using difference_type = ptrdiff_t;
+        using pointer = void;
+        using reference = LocalObject<CTag>;
+        iterator(const ObjectArray* a, size_t i) : a_(a), i_(i) {}
+        reference operator*() const { return a_->get(i_); }
+        iterator& operator++() { ++i_; return *this; }
+        iterator operator++(int) { auto it = *this; ++i_; return it; }
+        bool operator==(const iterator& that) const { return i_ == that.i_; }
+        bool operator!=(const iterator& that) const { return i_ != that.i_; }
+    private:
+        const ObjectArray* a_;
+        size_t i_;
+    };
+    iterator begin() const { return {this, 0}; }
+    iterator end() const { return {this, size()}; }
+private:
+    friend class JObject<CTag>; // createMany
+    bool create(JNIEnv* env, size_t n);
+};
+/*
+  register native methods of java class CTag in 1 RegisterNatives() call, e.g. in JNI_OnLoad
+    jint add(JNIEnv*, jobject thiz, jint a, jint b);
+    std::string join(JNIEnv*, jclass, string_view prefix, JArrayView<jint> values);
+    jmi::registerNatives<MyClass>(JMI_NATIVE(add), JMI_NATIVE(join));
+ */
+template<class CTag, typename... Methods>
+bool registerNatives(const JNINativeMethod& method, const Methods&... methods) {
+    const JNINativeMethod ms[] = {method, methods...};
+    return JObject<CTag>::registerNatives(ms, 1 + sizeof...(Methods));
+}
+
+namespace detail {
+struct native_callback_tag;
+using callback_t = function<jobject(JNIEnv*, jobjectArray)>;
+} // namespace detail
+using NativeCallback = JObject<detail::native_callback_tag>; // java class jmi.NativeCallback
+/*
+  A c++ callable called by java. The callable is stored in a lock-free handle table, and a java jmi.NativeCallback object holds its generation checked handle.
+  Java code calls it by NativeCallback.call(Object... args), or as a listener interface by NativeCallback.as(Listener.class). Boxed java arguments are converted
+  to parameter types of the callable(jni primitives, bool, string, JObject, jobject, Converter types), and return value is converted to a java object.
+    jmi::Callback onError([this](jint what, std::string msg) { onPlayerError(what, msg); });
+    player.call("setErrorListener", onError.object()); // java: listener = cb.as(ErrorListener.class);
+  The callable is removed from the table by reset() or dtor, and calls in progress finish before it's destroyed. Calling a removed callback throws IllegalStateException in java.
+ */
+class Callback {
+public:
+    Callback() = default;
+    template<typename F, typename enable_if<!is_same<typename decay<F>::type, Callback>::value, bool>::type = true>
+    explicit Callback(F&& f);
+    Callback(const Callback&) = delete;
+    Callback& operator=(const Callback&) = delete;
+    Callback(Callback&& that) noexcept { *this = std::move(that); }
+    Callback& operator=(Callback&& that) noexcept {
+        swap(handle_, that.handle_);
+        swap(obj_, that.obj_);
+        return *this;
+    }
+    ~Callback() { reset(); }
+
+    explicit operator bool() const { return !!handle_; }
+    jlong handle() const { return handle_; }
+    // java jmi.NativeCallback object, created at the first call
+    const NativeCallback& object() const;
+    void reset();
+private:
+    jlong handle_ = 0;
+    mutable NativeCallback obj_;
+};
+
+/*
+  Record method calls and replay them in java by jmi.CommandBuffer in 1 jni call, e.g. to configure an object with dozens of setters.
+  jmethodIDs are resolved only once, and mapped to MethodHandles cached in java. Arguments are packed as jvalues in a native buffer which is a direct ByteBuffer in java,
+  objects(including strings and arrays) are kept as global refs until clear(). Primitive results are written back to the buffer, object results and exceptions to an Object[].
+  Recorded commands can be executed again and again. Out parameters(std::ref) are not supported.
+    CommandBuffer cb;
+    cb.call(paint, "setColor", color);
+    const auto w = cb.call<jfloat>(paint, "measureText", text);
+    cb.execute();
+    jfloat width = cb.result<jfloat>(w);
+ */
+class CommandBuffer {
+public:
+    static constexpr size_t npos = size_t(-1); // a command is not recorded
+    CommandBuffer() = default;
+    CommandBuffer(const CommandBuffer&) = delete;
+    CommandBuffer& operator=(const CommandBuffer&) = delete;
+    CommandBuffer(CommandBuffer&& that) noexcept { *this = std::move(that); }
+    CommandBuffer& operator=(CommandBuffer&& that) noexcept;
+    ~CommandBuffer() { clear(); }
+
+    // record a call. return the command index for result() and error(), or npos if method is not found
+    template<typename T = void, class CTag, typename... Args>
+    size_t call(const JObject<CTag>& obj, const string_view& methodName, Args&&... args);
+    template<typename T, class MTag, class CTag, typename... Args, detail::if_MethodTag<MTag> = true>
+    size_t call(const JObject<CTag>& obj, Args&&... args);
+    template<class CTag, typename T = void, typename... Args>
+    size_t callStatic(const string_view& methodName, Args&&... args);
+    template<class CTag, typename T, class MTag, typename... Args, detail::if_MethodTag<MTag> = true>
+    size_t callStatic(Args&&... args);
+
+    size_t size() const { return offsets_.size(); }
+    bool empty() const { return offsets_.empty(); }
+    // release all commands and refs
+    void clear();
+    // execute all recorded commands in order. an exception does not stop the following commands. return true if no exception
+    bool execute();
+    // error of recording or executing
+    const string& error() const { return error_; }
+    // exception of command i in the last execute(), empty if succeeded
+    string error(size_t i) const;
+    bool ok(size_t i) const;
+    // return value of command i in the last execute(). T can be jni primitives, enum, bool, string, u16string, JObject, jobject(a local ref) and Converter types
+    template<typename T>
+    T result(size_t i) const;
+private:
+    static constexpr size_t kHeaderSlots = 3; // jvalues of detail::command_header
+    // index of java MethodHandle, -1 if not found
+    jint method(JNIEnv* env, jclass cid, const char* name, const char* sig, bool isStatic);
+    // ref index in java Object[]. obj is a local ref and will be deleted if local is true
+    jint ref(JNIEnv* env, jobject obj, bool local);
+    template<typename... Args>
+    size_t add(JNIEnv* env, jint method, jobject target, bool isStatic, Args&&... args);
+    template<typename T>
+    jvalue arg(JNIEnv* env, T&& t);
+    const jvalue& slot(size_t i) const { return buf_[offsets_[i] + kHeaderSlots - 1]; }
+
+    vector<jvalue> buf_; // commands
+    vector<size_t> offsets_; // jvalue offset of each command
+    vector<jobject> refs_; // global refs
+    jobject lastKey_ = nullptr; // JObject id of the last ref, avoid adding the same object repeatly, e.g. target object
+    jint lastRef_ = -1;
+    jobject buffer_ = nullptr; // global ref of java ByteBuffer
+    jobject refArray_ = nullptr; // global ref of java Object[] refs
+    jobject out_ = nullptr; // global ref of java Object[] for object results and exceptions
+    size_t synced_ = 0; // number of refs in refArray_
+    size_t executed_ = 0;
+    string error_;
+};
+
+namespace detail {
+struct ring_buffer_tag;
+struct ring_waiter;
+struct ring_memory;
+} // namespace detail
+using JRingBuffer = JObject<detail::ring_buffer_tag>; // java class jmi.RingBuffer
+/*
+  Single consumer ring buffer of variable size records in memory shared with java jmi.RingBuffer(a direct ByteBuffer), no jni call to exchange records.
+  Producers and the consumer can be c++ or java. Multiple producers are allowed if multiProducer is true, otherwise at most 1 producer thread at the same time.
+  head/tail counters are cache line padded, and a record is committed by writing its size header, so the consumer never sees a partial record.
+  A consumer can wait until a record is available, a producer wakes it up by 1 jni call(java consumer) or a NativeCallback(c++ consumer) only if it's waiting.
+  The memory is reference counted by c++ RingBuffer and the java ByteBuffer(released by jmi.DirectBuffers after it's garbage collected), so java object
+  is still valid after RingBuffer is destroyed, but no c++ consumer will be woken up.
+    RingBuffer events(1 << 20);
+    listener.call("setEvents", events.object()); // java: while (events.await(-1)) { n = events.read(buf); ... }
+    events.write(Event{...});
+ */
+class RingBuffer {
+public:
+    // capacity in bytes is rounded up to a power of 2. a record takes 4 + size bytes aligned to 8
+    explicit RingBuffer(size_t capacity = 1 << 16, bool multiProducer = false);
+    RingBuffer(const RingBuffer&) = delete;
+    RingBuffer& operator=(const RingBuffer&) = delete;
+    RingBuffer(RingBuffer&& that) noexcept { *this = std::move(that); }
+    RingBuffer& operator=(RingBuffer&& that) noexcept;
+    ~RingBuffer();
+
+    size_t capacity() const { return cap_; }
+    // copy a record. return false if no enough space or size is 0
+    bool write(const void* data, size_t size);
+    template<typename T>
+    bool write(const T& record) {
+        static_assert(is_trivially_copyable<T>::value, "record must be trivially copyable");
+        return write(&record, sizeof(T));
+    }
+    // copy the next record and return its size, 0 if empty. if the record is larger than size, it's not consumed and its size is returned
+    size_t read(void* data, size_t size);
+    template<typename T>
+    bool read(T& record) {
+        static_assert(is_trivially_copyable<T>::value, "record must be trivially copyable");
+        return read(&record, sizeof(T)) == sizeof(T);
+    }
+    // call f(const void* data, size_t size) for each available record(at most max) without copy. return the number of consumed records
+    template<typename F>
+    size_t consume(F&& f, size_t max = size_t(-1));
+    // block until a record is available, or timeout if timeoutMs >= 0. return true if available
+    bool wait(int timeoutMs = -1);
+    // java jmi.RingBuffer sharing the memory, created at the first call. create it before java producers/consumers start
+    const JRingBuffer& object() const;
+private:
+    const char* front(size_t* size); // payload of the next record, nullptr if empty
+    void pop(size_t size);
+    void notify(); // wake up the waiting consumer
+
+    detail::ring_memory* mem_ = nullptr;
+    char* base_ = nullptr; // control block(cache line aligned) + data
+    size_t cap_ = 0;
+    bool mp_ = false;
+    detail::ring_waiter* waiter_ = nullptr; // owned by waker_, valid until waker_ is reset
+    Callback waker_; // called by java producers to wake up c++ consumer
+    mutable JRingBuffer obj_;
+};
+
+namespace detail {
+struct byte_buffer_tag;
+struct mapping;
+} // namespace detail
+using JByteBuffer = JObject<detail::byte_buffer_tag>; // java class java.nio.ByteBuffer
+/*
+  A file(or a range of a file) mapped into memory, exposed to java as direct ByteBuffers without copy.
+  The mapping is reference counted: each window() ByteBuffer holds a reference, released by jmi.DirectBuffers after the ByteBuffer is garbage collected,
+  so the file is unmapped after MappedBuffer is reset/destroyed and all windows are unreachable in java. Windows are read-only if not writable.
+  java ByteBuffer capacity is int, so a multi-GB file is streamed by windows:
+    MappedBuffer file("video.raw");
+    file.advise(MappedBuffer::Sequential);
+    for (size_t off = 0; off < file.size(); off += kWindow)
+        parser.call("parse", file.window(off, kWindow)); // dropped pages can be released by advise(DontNeed, off, kWindow)
+ */
+class MappedBuffer {
+public:
+    enum Advice { // madvise(). not supported on windows
+        Normal,
+        Sequential,
+        Random,
+        WillNeed,
+        DontNeed,
+    };
+    MappedBuffer() = default;
+    // map size bytes from offset of the file, or to the end of file if size is 0. check operator bool() and error() for the result
+    explicit MappedBuffer(const string& path, size_t offset = 0, size_t size = 0, bool writable = false) { open(path, offset, size, writable); }
+    MappedBuffer(const MappedBuffer&) = delete;
+    MappedBuffer& operator=(const MappedBuffer&) = delete;
+    MappedBuffer(MappedBuffer&& that) noexcept { *this = std::move(that); }
+    MappedBuffer& operator=(MappedBuffer&& that) noexcept;
+    ~MappedBuffer() { reset(); }
+
+    bool open(const string& path, size_t offset = 0, size_t size = 0, bool writable = false);
+    // release the mapping. unmapped when no window is alive in java
+    void reset();
+    explicit operator bool() const { return !!m_; }
+    const string& error() const { return error_; }
+    char* data() const;
+    size_t size() const;
+    bool writable() const;
+    // direct ByteBuffer of [offset, offset + size), size 0 means to the end. size is truncated to the end and at most 2^31 - 1
+    JByteBuffer window(size_t offset = 0, size_t size = 0) const;
+    // access pattern hint of [offset, offset + size), size 0 means to the end
+    bool advise(Advice advice, size_t offset = 0, size_t size = 0) const;
+private:
+    detail::mapping* m_ = nullptr;
+    string error_;
+};
+
+namespace detail {
+struct stream_prefetcher;
+} // namespace detail
+/*
+  std::streambuf reading a java.io.InputStream by chunks. A global ref java byte[] is reused, 2 jni calls per chunk.
+  If prefetch is true, the next chunk is read by a background attached thread while the current chunk is consumed.
+    JInputStreamBuf sb(inputStream.id(), 1 << 20, true);
+    std::istream in(&sb);
+ */
+class JInputStreamBuf : public std::streambuf {
+public:
+    explicit JInputStreamBuf(jobject stream, size_t chunk = 1 << 16, bool prefetch = false);
+    JInputStreamBuf(const JInputStreamBuf&) = delete;
+    JInputStreamBuf& operator=(const JInputStreamBuf&) = delete;
+    // wait for the pending prefetch. the stream is not closed
+    ~JInputStreamBuf() override;
+    // java exception of the last read
+    const string& error() const { return error_; }
+protected:
+    int_type underflow() override;
+private:
+    jint fill(JNIEnv* env, char* data, string& error) const; // read a chunk, return -1 if end of stream or error
+
+    const size_t chunk_;
+    jobject stream_ = nullptr; // global ref
+    jobject array_ = nullptr; // global ref of byte[chunk]
+    vector<char> buf_; // swapped with prefetched data
+    detail::stream_prefetcher* prefetch_ = nullptr;
+    string error_;
+};
+
+/*
+  std::streambuf writing a java.io.OutputStream by chunks. A global ref java byte[] is reused, 2 jni calls per chunk.
+  pubsync()(e.g. std::ostream::flush()) writes buffered data and calls OutputStream.flush(). Buffered data is written in destructor.
+ */
+class JOutputStreamBuf : public std::streambuf {
+public:
+    explicit JOutputStreamBuf(jobject stream, size_t chunk = 1 << 16);
+    JOutputStreamBuf(const JOutputStreamBuf&) = delete;
+    JOutputStreamBuf& operator=(const JOutputStreamBuf&) = delete;
+    ~JOutputStreamBuf() override;
+    // java exception of the last write
+    const string& error() const { return error_; }
+protected:
+    int_type overflow(int_type c) override;
+    int sync() override;
+private:
+    bool flushBuffer(JNIEnv* env);
+
+    jobject stream_ = nullptr; // global ref
+    jobject array_ = nullptr; // global ref of byte[chunk]
+    vector<char> buf_;
+    string error_;
+};
+
+namespace detail {
+struct native_input_stream_tag;
+using stream_source_t = function<size_t(char*, size_t)>;
+} // namespace detail
+using JNativeInputStream = JObject<detail::native_input_stream_tag>; // java class jmi.NativeInputStream, a java.io.InputStream
+/*
+  Create a java InputStream reading data from c++ without materializing the whole data in java.
+  read(char* data, size_t size) copies at most size bytes to data and returns the number of bytes, 0 at the end. It's called in java reader threads.
+  InputStream.read(byte[]) reads at most chunk bytes by 1 SetByteArrayRegion(), and read(ByteBuffer) of a direct buffer reads to the buffer memory directly.
+  The source is destroyed by InputStream.close() or after the java object is garbage collected.
+    auto in = jmi::makeInputStream([&](char* data, size_t size) { return decoder.read(data, size); });
+    parser.call("parse", in);
+ */
+template<typename F, typename enable_if<!is_convertible<F, std::streambuf*>::value, bool>::type = true>
+JNativeInputStream makeInputStream(F&& read, size_t chunk = 1 << 16);
+// sb must be alive until the java stream is closed or garbage collected
+JNativeInputStream makeInputStream(std::streambuf* sb, size_t chunk = 1 << 16);
+
+/*
+  Process a huge java primitive array T[] by chunks of at most chunk elements instead of copying it into a whole c++ container.
+  readArrayChunks: f(const T* data, size_t offset, size_t n) consumes elements [offset, offset + n). If prefetch is true, the next chunk is copied
+  by a background attached thread while f is running.
+  writeArrayChunks: f(T* data, size_t offset, size_t n) produces elements [offset, offset + n). If prefetch is true, the previous chunk is written
+  by a background attached thread while f is running.
+  f returns false to stop after the current chunk. Native memory is 1 chunk, or 2 chunks if prefetch. Returns the number of elements read or written.
+    jmi::readArrayChunks<jfloat>(samples, [&](const jfloat* data, size_t offset, size_t n) { return filter.process(data, n); });
+ */
+template<typename T, typename F>
+size_t readArrayChunks(jobject array, F&& f, size_t chunk = 1 << 20, bool prefetch = true);
+template<typename T, typename F>
+size_t writeArrayChunks(jobject array, F&& f, size_t chunk = 1 << 20, bool prefetch = true);
+
+namespace detail {
+struct iterator_tag;
+} // namespace detail
+/*
+  Input range of a java Iterator or Iterable(e.g. Collection, List). Elements are fetched by chunks by jmi.Containers and converted by array APIs,
+  so the number of jni calls is O(n / chunk) instead of 2 per element. T can be a primitive type(java element is unboxed), string or JObject<...>.
+  A chunk is valid until the iterator is incremented to the next chunk.
+    for (const auto& s : jmi::iterate<std::string>(list))
+        ...
+ */
+template<typename T>
+class JavaRange {
+    static_assert(!is_same<T, bool>::value, "iterate<bool> is not supported because vector<bool> elements have no reference, use iterate<jboolean>");
+public:
+    class iterator {
+    public:
+        using iterator_category = input_iterator_tag;
+        using value_type = T;
+        using difference_type = ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
+        explicit iterator(JavaRange* r = nullptr) : r_(r) {}
+        reference operator*() const { return r_->buf_[i_]; }
+        pointer operator->() const { return &r_->buf_[i_]; }
+        iterator& operator++() {
+            if (++i_ >= r_->buf_.size()) {
+                i_ = 0;
+                if (!r_->fetch())
+                    r_ = nullptr;
+            }
+            return *this;
+        }
+        bool operator==(const iterator& that) const { return r_ == that.r_ && i_ == that.i_; }
+        bool operator!=(const iterator& that) const { return !(*this == that); }
+    private:
+        JavaRange* r_;
+        size_t i_ = 0;
+    };
+
+    JavaRange(jobject source, size_t chunk);
+    JavaRange(const JavaRange&) = delete;
+    JavaRange& operator=(const JavaRange&) = delete;
+    JavaRange(JavaRange&&) = default;
+    JavaRange& operator=(JavaRange&&) = default;
+
+    // fetch the first chunk. call only once
+    iterator begin() { return fetch() ? iterator(this) : iterator(); }
+    iterator end() { return iterator(); }
+    // not empty if iteration is stopped by error, e.g. source is not Iterable, ClassCastException
+    const string& error() const { return error_; }
+private:
+    bool fetch(); // return false if no more elements
+
+    JObject<detail::iterator_tag> it_;
+    size_t chunk_;
+    vector<T> buf_;
+    string error_;
+};
+
+// source is a java Iterator or Iterable
+template<typename T>
+JavaRange<T> iterate(jobject source, size_t chunk = 1024) { return JavaRange<T>(source, chunk); }
+template<typename T, class CTag>
+JavaRange<T> iterate(const JObject<CTag>& source, size_t chunk = 1024) { return JavaRange<T>(source.id(), chunk); }
+
+/*
+  java.util.List of T. std::vector<T> is a java array, use JList<T> as parameter, return and field type for a java List.
+  std::set, std::unordered_set(java.util.Set), std::map and std::unordered_map(java.util.Map) are also supported by Converter.
+  A collection is converted by jmi.Containers in a constant number of jni calls: boxed values are packed into a primitive array, map entries into
+  parallel key/value arrays. string and JObject elements still need 1 jni call per element to convert. Created java objects are ArrayList, LinkedHashSet and HashMap.
+ */
+template<typename T>
+struct JList : vector<T> {
+    using vector<T>::vector;
+};
+
+/*
+  A c++ container(vector, array etc.) as a java array of J(jbyte, jint, jlong, jfloat, jdouble etc.) whose element type is different from the container's,
+  e.g. vector<int32_t> as long[], vector<double> as float[], vector<uint8_t> as byte[](vector<uint8_t> is boolean[] by default).
+  Elements are converted directly in the new java array without a temporary buffer. int <-> long and float <-> double are vectorized(SSE2, NEON).
+  If the container is not const, java array elements are converted back after the call like std::ref(container).
+  For return values and fields, pass a jarray_cast of a non-const container to callInto()/getInto().
+    obj.call("setTimestamps", jmi::jarray_cast<jlong>(ms)); // ms: vector<int32_t>
+    auto out = jmi::jarray_cast<jlong>(ms);
+    obj.callInto("getTimestamps", out); // java: long[] getTimestamps()
+ */
+template<typename J, class C>
+struct JArrayCast {
+    static_assert(is_arithmetic<J>::value, "J must be a java primitive type");
+    C& c;
+};
+template<typename J, class C>
+JArrayCast<J, C> jarray_cast(C& c) { return {c}; }
+template<typename J, class C>
+JArrayCast<J, const C> jarray_cast(const C& c) { return {c}; }
+
+/*
+  Row-major matrix of java primitive type T as a java 2d array T[][], e.g. JMatrix<jfloat> is float[][]. Nested containers(vector<vector<float>>,
+  vector<vector<vector<jint>>> etc.) are also supported, but JMatrix rows are copied from/to 1 contiguous buffer.
+  JMatrixView is an existing row-major buffer as a parameter. Each row is converted by 1 bulk region copy and 1 local ref is alive at a time.
+  Java rows are expected to be of the same length, the length of the 1st row is cols, shorter rows are zero padded.
+ */
+template<typename T>
+struct JMatrix {
+    static_assert(is_arithmetic<T>::value, "T must be a java primitive type");
+    size_t rows = 0;
+    size_t cols = 0;
+    vector<T> data;
+
+    JMatrix() = default;
+    JMatrix(size_t r, size_t c) : rows(r), cols(c), data(r * c) {}
+    T* operator[](size_t r) { return data.data() + r * cols; }
+    const T* operator[](size_t r) const { return data.data() + r * cols; }
+};
+template<typename T>
+struct JMatrixView {
+    static_assert(is_arithmetic<T>::value, "T must be a java primitive type");
+    const T* data;
+    size_t rows;
+    size_t cols;
+};
+
+/*
+  c++ enum E as a java enum of class CTag::name() for parameters, return values and fields(requires c++17 for the signature). Java constants are resolved
+  once at the first successful use(a failure is the error of the call) into a global ref table indexed by ordinal, so converting to java is an array lookup, and converting from java is 1 ordinal()
+  call and an identity check. E values must be the ordinals of the java constants. null and unknown objects are E(-1).
+    enum class Unit { Nanos, Micros, Millis, Seconds };
+    struct TimeUnitTag : jmi::ClassTag { static constexpr auto name() { return JMISTR("java/util/concurrent/TimeUnit"); } };
+    using TimeUnit = jmi::JEnum<Unit, TimeUnitTag>;
+    executor.call<jboolean>("awaitTermination", jlong(3), TimeUnit(Unit::Seconds));
+ */
+template<typename E, class CTag>
+struct JEnum {
+    static_assert(is_enum<E>::value, "E must be an enum");
+    E value;
+
+    JEnum(E v = E()) : value(v) {}
+    operator E() const { return value; }
+};
+
+/*
+  java.lang.Integer, Long, Double, Boolean etc. of primitive T for parameters, return values and fields. Default constructed value is java null.
+  Boxing uses resolved valueOf() methods, and values in java box cache(-128~127, true/false) are global refs resolved at the first use, so passing
+  them to call() costs no jni call. Unboxing is 1 xxxValue() call. Boxed<T, true> has signature java.lang.Object for generic apis:
+    map.call<jmi::Boxed<jdouble, true>>("put", jmi::Boxed<jint, true>(7), jmi::Boxed<jdouble, true>(1.5));
+ */
+template<typename T, bool AsObject = false>
+struct Boxed {
+    static_assert(is_arithmetic<T>::value, "T must be a java primitive type");
+    T value = T();
+    bool null = true;
+
+    Boxed() = default;
+    Boxed(T v) : value(v), null(false) {}
+    operator T() const { return value; }
+};
 /*************************** JMI Public APIs End ***************************/
 } // namespace jmi
 
 #define JMI_STRINGIFY(X) _JMI_STRINGIFY(X)
 #define _JMI_STRINGIFY(X) #X
 
+#define JMI_EXPAND_(x) x
+#define JMI_STRUCT_FIELD_(S, f) jmi::detail::make_struct_field(#f, &S::f)
+#define JMI_FIELDS_1(S, f) JMI_STRUCT_FIELD_(S, f)
+#define JMI_FIELDS_2(S, f, ...) JMI_STRUCT_FIELD_(S, f), JMI_EXPAND_(JMI_FIELDS_1(S, __VA_ARGS__))
+#define JMI_FIELDS_3(S, f, ...) JMI_STRUCT_FIELD_(S, f), JMI_EXPAND_(JMI_FIELDS_2(S, __VA_ARGS__))
+#define JMI_FIELDS_4(S, f, ...) JMI_STRUCT_FIELD_(S, f), JMI_EXPAND_(JMI_FIELDS_3(S, __VA_ARGS__))
+#define JMI_FIELDS_5(S, f, ...) JMI_STRUCT_FIELD_(S, f), JMI_EXPAND_(JMI_FIELDS_4(S, __VA_ARGS__))
+#define JMI_FIELDS_6(S, f, ...) JMI_STRUCT_FIELD_(S, f), JMI_EXPAND_(JMI_FIELDS_5(S, __VA_ARGS__))
+#define JMI_FIELDS_7(S, f, ...) JMI_STRUCT_FIELD_(S, f), JMI_EXPAND_(JMI_FIELDS_6(S, __VA_ARGS__))
+#define JMI_FIELDS_8(S, f, ...) JMI_STRUCT_FIELD_(S, f), JMI_EXPAND_(JMI_FIELDS_7(S, __VA_ARGS__))
+#define JMI_FIELDS_9(S, f, ...) JMI_STRUCT_FIELD_(S, f), JMI_EXPAND_(JMI_FIELDS_8(S, __VA_ARGS__))
+#define JMI_FIELDS_10(S, f, ...) JMI_STRUCT_FIELD_(S, f), JMI_EXPAND_(JMI_FIELDS_9(S, __VA_ARGS__))
+#define JMI_FIELDS_11(S, f, ...) JMI_STRUCT_FIELD_(S, f), JMI_EXPAND_(JMI_FIELDS_10(S, __VA_ARGS__))
+#define JMI_FIELDS_12(S, f, ...) JMI_STRUCT_FIELD_(S, f), JMI_EXPAND_(JMI_FIELDS_11(S, __VA_ARGS__))
+#define JMI_FIELDS_13(S, f, ...) JMI_STRUCT_FIELD_(S, f), JMI_EXPAND_(JMI_FIELDS_12(S, __VA_ARGS__))
+#define JMI_FIELDS_14(S, f, ...) JMI_STRUCT_FIELD_(S, f), JMI_EXPAND_(JMI_FIELDS_13(S, __VA_ARGS__))
+#define JMI_FIELDS_15(S, f, ...) JMI_STRUCT_FIELD_(S, f), JMI_EXPAND_(JMI_FIELDS_14(S, __VA_ARGS__))
+#define JMI_FIELDS_16(S, f, ...) JMI_STRUCT_FIELD_(S, f), JMI_EXPAND_(JMI_FIELDS_15(S, __VA_ARGS__))
+#define JMI_FIELDS_N_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13, _14, _15, _16, N, ...) N
+#define JMI_FIELDS_(S, ...) JMI_EXPAND_(JMI_FIELDS_N_(__VA_ARGS__, JMI_FIELDS_16, JMI_FIELDS_15, JMI_FIELDS_14, JMI_FIELDS_13, JMI_FIELDS_12, JMI_FIELDS_11, JMI_FIELDS_10, JMI_FIELDS_9, JMI_FIELDS_8, JMI_FIELDS_7, JMI_FIELDS_6, JMI_FIELDS_5, JMI_FIELDS_4, JMI_FIELDS_3, JMI_FIELDS_2, JMI_FIELDS_1)(S, __VA_ARGS__))
+
 namespace jmi {
 
 #if !(JMI_CXX20 + 0)
@@ -318,9 +1129,19 @@ template <typename T, typename = void>
 struct is_string : false_type {};
 template <typename T>
 struct is_string<T, decltype(void(declval<T>().substr()))> : true_type {};
+template<typename T, typename = void>
+struct has_converter : false_type {};
+template<typename T>
+struct has_converter<T, decltype(void(sizeof(typename Converter<T>::jni_type)))> : true_type {};
+template<typename T>
+using if_converter = typename enable_if<has_converter<remove_cvref_t<T>>::value, bool>::type;
+template<typename T>
+using if_not_converter = typename enable_if<!has_converter<remove_cvref_t<T>>::value, bool>::type;
 template <typename T>
 struct is_jarray_cpp : integral_constant<bool, (is_array_like<T>::value || is_array<T>::value)
     && !is_string<T>::value
+    && !has_converter<T>::value
+    && !is_JObject<T>::value // ObjectArray
     && !is_same<typename decay<T>::type, char*>::value
     && !is_same<typename decay<T>::type, const char*>::value> {};
 
@@ -498,9 +1319,27 @@ template<> struct signature<jdoubleArray> { static constexpr auto value = to_arr
 // "L...;" is used in method parameter
 template<> struct signature<string> { static constexpr auto value = to_array("Ljava/lang/String;");};
 template<> struct signature<char*> { static constexpr auto value = to_array("Ljava/lang/String;");};
+template<> struct signature<u16string> { static constexpr auto value = to_array("Ljava/lang/String;");};
+template<> struct signature<JInternedString> { static constexpr auto value = to_array("Ljava/lang/String;");};
+#if (JMI_CXX17+0)
+template<> struct signature<string_view> { static constexpr auto value = to_array("Ljava/lang/String;");};
+template<> struct signature<u16string_view> { static constexpr auto value = to_array("Ljava/lang/String;");};
+template<typename Char, bool Critical> struct signature<BasicJStringView<Char, Critical>, false> : signature<string> {};
+#endif
+template<> struct signature<JArrayView<jboolean>> : signature<jbooleanArray> {};
+template<> struct signature<JArrayView<jbyte>> : signature<jbyteArray> {};
+template<> struct signature<JArrayView<jchar>> : signature<jcharArray> {};
+template<> struct signature<JArrayView<jshort>> : signature<jshortArray> {};
+template<> struct signature<JArrayView<jint>> : signature<jintArray> {};
+template<> struct signature<JArrayView<jlong>> : signature<jlongArray> {};
+template<> struct signature<JArrayView<jfloat>> : signature<jfloatArray> {};
+template<> struct signature<JArrayView<jdouble>> : signature<jdoubleArray> {};
+template<typename J, class C> struct signature<JArrayCast<J, C>, false> : signature<JArrayView<J>> {};
 
 template<typename E>
 struct signature<E, true> : signature<jint>{};
+template<typename T, bool>
+struct signature { static constexpr auto value = Converter<T>::signature(); }; // user types
 
 template<typename T, detail::if_not_pointer<T> = true, detail::if_not_JObject<T> = true, detail::if_not_jarray_cpp<T> = true
     , detail::if_not_ref_wrap<T> = true, detail::if_not_cstring<T> = true>
@@ -562,6 +1401,9 @@ CONSTEXPR17 auto signature_of(R (*)(Args...)) {
 
 namespace detail {
     std::string handle_exception(std::string&& msg = {}, JNIEnv* env = nullptr) noexcept;
+    // length aware, s is not required to be null terminated. utf8 is decoded to utf16 without an intermediate std::string
+    jstring new_string(const char* s, size_t n, JNIEnv* env);
+    jstring new_string(const char16_t* s, size_t n, JNIEnv* env);
 
     template<class F>
     class scope_exit_handler {
@@ -588,22 +1430,49 @@ namespace detail {
         return scope_exit_handler<F>(std::forward<F>(f));
     }
 
-    template<typename T, if_not_JObject<T> = true>
+    template<typename T, if_not_JObject<T> = true, if_not_jarray_cpp<T> = true>
     jarray make_jarray(JNIEnv *env, const T &element, size_t size); // element is for getting jobject class
     template<class T, if_JObject<T> = true>
     jarray make_jarray(JNIEnv *env, const T &element, size_t size) {
         return env->NewObjectArray(size, jclass(element), nullptr);
     }
+    // class of java array type of c++ container R, e.g. float[] for vector<float>
+    template<typename R>
+    jclass array_class(JNIEnv* env) {
+        static jclass c = nullptr;
+        if (!c) {
+            static CONSTEXPR17 auto s = signature_of<R>();
+            LocalRef cid(env->FindClass(&s[0]), env);
+            if (cid)
+                c = static_cast<jclass>(env->NewGlobalRef(cid));
+        }
+        return c;
+    }
+    // nested arrays, e.g. vector<vector<float>> is float[][]. a row is converted by 1 bulk region copy
+    template<typename R, if_jarray_cpp<R> = true>
+    jarray make_jarray(JNIEnv *env, const R&, size_t size) {
+        return env->NewObjectArray(jsize(size), array_class<R>(env), nullptr);
+    }
 
-    template<typename T, if_not_JObject<T> = true>
+    template<typename T, if_not_JObject<T> = true, if_not_jarray_cpp<T> = true>
     void set_jarray(JNIEnv *env, jarray arr, size_t position, size_t n, const T &elm);
     template<class T, if_JObject<T> = true>
     void set_jarray(JNIEnv *env, jarray arr, size_t position, size_t n, const T &elm) {
         set_jarray(env, arr, position, n, jobject(elm));
     }
+    template<typename R, if_jarray_cpp<R> = true>
+    void set_jarray(JNIEnv *env, jarray arr, size_t position, size_t n, const R &row);
 
     template<typename T>
     jarray to_jarray(JNIEnv* env, const T &c0, size_t N, bool is_ref = false);
+    // per thread out parameter array pool. create is also used as the key of element type
+    using make_jarray_t = jarray(*)(JNIEnv*, size_t);
+    jarray pooled_jarray(JNIEnv* env, make_jarray_t create, size_t size, size_t element_size);
+    bool recycle_jarray(JNIEnv* env, jarray a); // false if a is not from pool
+    // convert elements [begin, end) of object array a. a is a global ref in worker threads
+    using parallel_func_t = function<void(JNIEnv* env, jarray a, size_t begin, size_t end)>;
+    // false if parallel conversion is disabled, n is too small or called in a worker thread, then the caller converts all elements
+    bool parallel_jarray(JNIEnv* env, jarray a, size_t n, const parallel_func_t& f);
     template<typename T, size_t N>
     jarray to_jarray(JNIEnv* env, const T(&c)[N], bool is_ref = false) {
         return to_jarray(env, c[0], N, is_ref);
@@ -612,13 +1481,24 @@ namespace detail {
     jarray to_jarray(JNIEnv* env, const C &c, bool is_ref = false) {
         return to_jarray(env, c[0], c.size(), is_ref);
     }
+    template<typename R, if_jarray_cpp<R>>
+    void set_jarray(JNIEnv *env, jarray arr, size_t position, size_t n, const R &row) {
+        for (size_t i = 0; i < n; ++i) { // only 1 local ref at a time for each dimension
+            const LocalRef r(to_jarray(env, *(&row + i)), env);
+            if (!r)
+                return;
+            env->SetObjectArrayElement(static_cast<jobjectArray>(arr), jsize(position + i), r);
+        }
+    }
     // env can be null for base types
     template<typename T>
     using if_enum = typename enable_if<is_enum<T>::value, bool>::type;
     template<typename T>
     using if_not_enum = typename enable_if<!is_enum<T>::value, bool>::type;
-    template<typename T, if_not_enum<T> = true, if_not_JObject<T> = true>
+    template<typename T, if_not_enum<T> = true, if_not_JObject<T> = true, if_not_converter<T> = true>
     jvalue to_jvalue(const T &obj, JNIEnv* env = nullptr);
+    template<typename T, if_converter<T> = true>
+    jvalue to_jvalue(const T &obj, JNIEnv* env = nullptr) { return to_jvalue(Converter<T>::to_java(obj, env), env); }
     template<typename T, if_enum<T> = true, if_not_JObject<T> = true>
     jvalue to_jvalue(const T &obj, JNIEnv* env = nullptr) {return to_jvalue((jint)obj, env);}
     template<typename T> jvalue to_jvalue(T *obj, JNIEnv* env) { return to_jvalue((jlong)obj, env); } // works for jobject
@@ -636,22 +1516,82 @@ namespace detail {
     template<typename T, size_t N> jvalue to_jvalue(const reference_wrapper<T[N]>& c, JNIEnv* env) { return to_jvalue(to_jarray<T,N>(env, c.get(), true), env); }
     template<class CTag>
     jvalue to_jvalue(const JObject<CTag> &obj, JNIEnv* env);
+    static inline jvalue to_jvalue(const JInternedString &s, JNIEnv* env) { return to_jvalue(s.id(), env); } // global ref, no local ref to delete
+    // element conversion kernels for jarray_cast(). same width integers are copied, others are converted by static_cast
+    template<typename S, typename D>
+    void convert_elements(const S* s, D* d, size_t n) {
+        if (is_integral<S>::value && is_integral<D>::value && sizeof(S) == sizeof(D) && !is_same<D, bool>::value) {
+            memcpy(d, s, n * sizeof(D));
+            return;
+        }
+        for (size_t i = 0; i < n; ++i)
+            d[i] = static_cast<D>(s[i]);
+    }
+    // vectorized
+    template<> void convert_elements(const jint* s, jlong* d, size_t n);
+    template<> void convert_elements(const jlong* s, jint* d, size_t n);
+    template<> void convert_elements(const jfloat* s, jdouble* d, size_t n);
+    template<> void convert_elements(const jdouble* s, jfloat* d, size_t n);
+    template<typename J, class C>
+    jvalue to_jvalue(const JArrayCast<J, C>& a, JNIEnv* env) {
+        const size_t n = a.c.size();
+        jarray arr = make_jarray(env, J(), n);
+        if (arr && n > 0) {
+            void* p = env->GetPrimitiveArrayCritical(arr, nullptr);
+            if (p) {
+                convert_elements(&a.c[0], static_cast<J*>(p), n);
+                env->ReleasePrimitiveArrayCritical(arr, p, 0);
+            }
+        }
+        return to_jvalue(arr, env);
+    }
+    // java.lang.Integer etc. <=> primitive T
+    template<typename T> T unbox(JNIEnv* env, jobject obj);
+    template<typename T> jobject box(JNIEnv* env, T v); // returns a local ref
+    template<typename T> bool unboxable(JNIEnv* env, jobject obj); // obj is not null and an instance of the box class of T
+    // global ref of a value in java box cache(Integer.valueOf(-128~127), Boolean.TRUE etc.), or null. filled at the first use
+    template<typename T> jobject cached_box(JNIEnv* env, T v);
+    template<typename T, bool O>
+    jvalue to_jvalue(const Boxed<T, O>& b, JNIEnv* env) {
+        jvalue v;
+        v.l = nullptr;
+        if (!b.null) {
+            v.l = cached_box(env, b.value);
+            if (!v.l)
+                v.l = box(env, b.value);
+        }
+        return v;
+    }
+    // whether the jvalue of an argument from to_jvalue() is a local ref to be deleted
+    template<typename T, bool O>
+    bool is_local_arg(JNIEnv* env, const Boxed<T, O>& b, jobject j) { return j && j != cached_box(env, b.value); }
     // T(&)[N]?
 
 // from_jvalue/array() is called if parameter of call() is of type reference_wrapper<...>
-    template<typename T, if_not_JObject<T> = true>
+    template<typename T, if_not_JObject<T> = true, if_not_jarray_cpp<T> = true>
     void from_jarray(JNIEnv* env, const jvalue& v, T* t, size_t N);
+    template<typename R, if_jarray_cpp<R> = true>
+    void from_jarray(JNIEnv* env, const jvalue& v, R* t, size_t N);
     template<typename T, if_JObject<T> = true>
     void from_jarray(JNIEnv* env, const jvalue& v, T* t, size_t N) {
-        for (size_t i = 0; i < N; ++i) {
-            LocalRef s = {env->GetObjectArrayElement(static_cast<jobjectArray>(v.l), i), env};
-            (t + i)->reset(s);
-        }
+        const auto get = [t](JNIEnv* e, jarray a, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                LocalRef s = {e->GetObjectArrayElement(static_cast<jobjectArray>(a), jsize(i)), e};
+                (t + i)->reset(s, e);
+            }
+        };
+        if (!parallel_jarray(env, static_cast<jarray>(v.l), N, get))
+            get(env, static_cast<jarray>(v.l), 0, N);
     }
     // reference_wrapper<const T> should do nothing
     template<typename T> void from_jvalue(JNIEnv* env, const jvalue& v, const T &t) {}
     // env can be null for base types
-    template<typename T, if_not_JObject<T> = true> void from_jvalue(JNIEnv* env, const jvalue& v, T &t);
+    template<typename T, if_not_JObject<T> = true, if_not_converter<T> = true> void from_jvalue(JNIEnv* env, const jvalue& v, T &t);
+    template<typename T, if_converter<T> = true> void from_jvalue(JNIEnv* env, const jvalue& v, T &t) {
+        typename Converter<T>::jni_type j;
+        memcpy(&j, &v, sizeof(j)); // all jvalue members start at address 0
+        t = Converter<T>::from_java(j, env);
+    }
     // reference_wrapper<const T[]> should do nothing
     template<typename T> void from_jvalue(JNIEnv* env, const jvalue& v, const T *t, size_t n = 0) {}
     template<typename T> void from_jvalue(JNIEnv* env, const jvalue& v, T *t, size_t n = 0) { // T* and T(&)[N] is the same
@@ -668,9 +1608,13 @@ namespace detail {
     template<typename T, size_t N> void from_jvalue(JNIEnv* env, const jvalue& v, array<T, N> &t) { from_jarray(env, v, t.data(), N); }
     //template<typename T, size_t N> void from_jvalue(JNIEnv* env, const jvalue& v, T(&t)[N]) { from_jarray(env, v, t, N); }
 
-    template<typename T> struct has_local_ref { // is_jobject<T>? is_jarray_cpp?
+    template<typename T, typename = void> struct has_local_ref { // is_jobject<T>? is_jarray_cpp?
         static const bool value = !is_arithmetic<T>::value && !is_pointer<T>::value && !is_JObject<T>::value;
     };
+    template<typename T> struct has_local_ref<T, typename enable_if<has_converter<T>::value>::type> {
+        static const bool value = Converter<T>::owns_local_ref;
+    };
+    template<> struct has_local_ref<JInternedString> : false_type {};
     template<typename T>
     void set_ref_from_jvalue(JNIEnv* env, jvalue* jargs, T) {
         using Tn = typename remove_reference<T>::type;
@@ -688,6 +1632,8 @@ namespace detail {
             env->DeleteLocalRef(jargs->l);
     }
     static inline void delete_array_local_ref(JNIEnv* env, jarray a, size_t n, bool delete_elements) {
+        if (!delete_elements && recycle_jarray(env, a))
+            return;
         if (delete_elements) {
             for (jsize i = 0; i < jsize(n); ++i)
                 LocalRef ei = {env->GetObjectArrayElement(jobjectArray(a), i), env};
@@ -711,6 +1657,39 @@ namespace detail {
         delete_array_local_ref(env, static_cast<jarray>(jargs->l), N, has_local_ref<T>::value);
     }
 
+    template<typename T>
+    bool is_local_arg(JNIEnv*, const T&, jobject) { return has_local_ref<T>::value; }
+    template<typename T, bool O>
+    void set_ref_from_jvalue(JNIEnv* env, jvalue *jargs, Boxed<T, O> b) {
+        if (is_local_arg(env, b, jargs->l))
+            env->DeleteLocalRef(jargs->l);
+    }
+    template<typename T, bool O>
+    void set_ref_from_jvalue(JNIEnv* env, jvalue *jargs, reference_wrapper<const Boxed<T, O>> ref) {
+        set_ref_from_jvalue(env, jargs, ref.get());
+    }
+    template<typename T, bool O>
+    void set_ref_from_jvalue(JNIEnv* env, jvalue *jargs, reference_wrapper<Boxed<T, O>> ref) { // java boxes are immutable
+        set_ref_from_jvalue(env, jargs, ref.get());
+    }
+    template<typename J, class C>
+    void set_ref_from_jvalue(JNIEnv* env, jvalue *jargs, JArrayCast<J, const C>) {
+        env->DeleteLocalRef(jargs->l);
+    }
+    template<typename J, class C>
+    void set_ref_from_jvalue(JNIEnv* env, jvalue *jargs, JArrayCast<J, C> a) {
+        jarray arr = static_cast<jarray>(jargs->l);
+        const size_t n = arr ? std::min<size_t>(a.c.size(), env->GetArrayLength(arr)) : 0;
+        if (n > 0) {
+            void* p = env->GetPrimitiveArrayCritical(arr, nullptr);
+            if (p) {
+                convert_elements(static_cast<const J*>(p), &a.c[0], n);
+                env->ReleasePrimitiveArrayCritical(arr, p, JNI_ABORT);
+            }
+        }
+        env->DeleteLocalRef(arr);
+    }
+
     static inline void ref_args_from_jvalues(JNIEnv*, jvalue*) {}
     template<typename Arg, typename... Args>
     void ref_args_from_jvalues(JNIEnv* env, jvalue *jargs, Arg&& arg, Args&&... args) {
@@ -718,8 +1697,34 @@ namespace detail {
         ref_args_from_jvalues(env, jargs + 1, std::forward<Args>(args)...);
     }
 
-    template<typename T, if_not_JObject<T> = true, if_not_jarray_cpp<T> = true>
+    // java value of a user type is returned by jni as jobject if it's an object type
+    template<typename T>
+    using converter_jni_t = typename conditional<is_jobject<typename Converter<T>::jni_type>::value, jobject, typename Converter<T>::jni_type>::type;
+    template<typename T, typename J, if_jobject<J> = true>
+    T from_java(JNIEnv* env, J j) { // j is a local ref
+        const LocalRef r(j, env);
+        if (env->ExceptionCheck())
+            return T();
+        return Converter<T>::from_java(static_cast<typename Converter<T>::jni_type>(j), env);
+    }
+    template<typename T, typename J, if_not_jobject<J> = true>
+    T from_java(JNIEnv* env, J j) {
+        if (env->ExceptionCheck())
+            return T();
+        return Converter<T>::from_java(j, env);
+    }
+
+    template<typename J, if_jobject<J> = true>
+    void delete_local_ref(JNIEnv* env, J j) { env->DeleteLocalRef(j); }
+    template<typename J, if_not_jobject<J> = true>
+    void delete_local_ref(JNIEnv*, J) {}
+
+    template<typename T, if_not_JObject<T> = true, if_not_jarray_cpp<T> = true, if_not_converter<T> = true>
     T call_method(JNIEnv *env, jobject oid, jmethodID mid, jvalue *args);
+    template<typename T, if_converter<T> = true>
+    T call_method(JNIEnv *env, jobject oid, jmethodID mid, jvalue *args) {
+        return from_java<T>(env, call_method<converter_jni_t<T>>(env, oid, mid, args));
+    }
     template<class T, if_JObject<T> = true>
     T call_method(JNIEnv *env, jobject oid, jmethodID mid, jvalue *args) {
         T t;
@@ -746,11 +1751,17 @@ namespace detail {
         auto setter = call_on_exit([=]{
             ref_args_from_jvalues(env, jargs, args...);
         });
-       return call_method<T>(env, oid, mid, jargs);
+        if (env->ExceptionCheck()) // failed to convert an argument, e.g. invalid JMatrix
+            return T();
+        return call_method<T>(env, oid, mid, jargs);
     }
 
-    template<typename T, if_not_JObject<T> = true, if_not_jarray_cpp<T> = true>
+    template<typename T, if_not_JObject<T> = true, if_not_jarray_cpp<T> = true, if_not_converter<T> = true>
     T call_static_method(JNIEnv *env, jclass classId, jmethodID methodId, jvalue *args);
+    template<typename T, if_converter<T> = true>
+    T call_static_method(JNIEnv *env, jclass cid, jmethodID mid, jvalue *args) {
+        return from_java<T>(env, call_static_method<converter_jni_t<T>>(env, cid, mid, args));
+    }
     template<class T, if_JObject<T> = true>
     T call_static_method(JNIEnv *env, jclass cid, jmethodID mid, jvalue *args) {
         LocalRef r = call_static_method<jobject>(env, cid, mid, args);
@@ -776,6 +1787,8 @@ namespace detail {
         auto setter = call_on_exit([=]{ // std::forward?
             ref_args_from_jvalues(env, jargs, args...);
         });
+        if (env->ExceptionCheck()) // failed to convert an argument, e.g. invalid JMatrix
+            return T();
         return call_static_method<T>(env, cid, mid, jargs);
     }
 
@@ -838,8 +1851,12 @@ namespace detail {
     template<typename T>
     jfieldID get_field_id(JNIEnv* env, jclass cid, const char* name, jfieldID* pfid = nullptr);
 
-    template<class T, if_not_JObject<T> = true, if_not_jarray_cpp<T> = true>
+    template<class T, if_not_JObject<T> = true, if_not_jarray_cpp<T> = true, if_not_converter<T> = true>
     T get_field(JNIEnv* env, jobject oid, jfieldID fid);
+    template<class T, if_converter<T> = true>
+    T get_field(JNIEnv* env, jobject oid, jfieldID fid) {
+        return from_java<T>(env, get_field<converter_jni_t<T>>(env, oid, fid));
+    }
     template<class T, if_JObject<T> = true>
     T get_field(JNIEnv* env, jobject oid, jfieldID fid) {
         LocalRef r = env->GetObjectField(oid, fid);
@@ -870,8 +1887,16 @@ namespace detail {
             return T();
         return get_field<T>(env, oid, fid);
     }
-    template<class T>
+    template<class T, if_not_converter<T> = true>
     void set_field(JNIEnv* env, jobject oid, jfieldID fid, T&& v);
+    template<class T, if_converter<T> = true>
+    void set_field(JNIEnv* env, jobject oid, jfieldID fid, T&& v) {
+        using C = remove_cvref_t<T>;
+        converter_jni_t<C> j = Converter<C>::to_java(v, env);
+        set_field<converter_jni_t<C>>(env, oid, fid, converter_jni_t<C>(j));
+        if (has_local_ref<C>::value)
+            delete_local_ref(env, j);
+    }
     template<typename T>
     void set_field(jobject oid, jclass cid, jfieldID* pfid, const char* name, T&& v) {
         JNIEnv* env = getEnv();
@@ -884,8 +1909,12 @@ namespace detail {
 
     template<typename T>
     jfieldID get_static_field_id(JNIEnv* env, jclass cid, const char* name, jfieldID* pfid = nullptr);
-    template<typename T, if_not_JObject<T> = true, if_not_jarray_cpp<T> = true>
+    template<typename T, if_not_JObject<T> = true, if_not_jarray_cpp<T> = true, if_not_converter<T> = true>
     T get_static_field(JNIEnv* env, jclass cid, jfieldID fid);
+    template<class T, if_converter<T> = true>
+    T get_static_field(JNIEnv* env, jclass cid, jfieldID fid) {
+        return from_java<T>(env, get_static_field<converter_jni_t<T>>(env, cid, fid));
+    }
     template<class T, if_JObject<T> = true>
     T get_static_field(JNIEnv* env, jclass cid, jfieldID fid) {
         LocalRef r = env->GetStaticObjectField(cid, fid);
@@ -915,8 +1944,16 @@ namespace detail {
             return T();
         return get_static_field<T>(env, cid, fid);
     }
-    template<typename T>
+    template<typename T, if_not_converter<T> = true>
     void set_static_field(JNIEnv* env, jclass cid, jfieldID fid, T&& v);
+    template<class T, if_converter<T> = true>
+    void set_static_field(JNIEnv* env, jclass cid, jfieldID fid, T&& v) {
+        using C = remove_cvref_t<T>;
+        converter_jni_t<C> j = Converter<C>::to_java(v, env);
+        set_static_field<converter_jni_t<C>>(env, cid, fid, converter_jni_t<C>(j));
+        if (has_local_ref<C>::value)
+            delete_local_ref(env, j);
+    }
     template<typename T>
     void set_static_field(jclass cid, jfieldID* pfid, const char* name, T&& v) {
         JNIEnv* env = getEnv();
@@ -950,16 +1987,107 @@ namespace detail {
         }
         return fid;
     }
-} // namespace detail
 
-template<class CTag>
-CONSTEXPR17 auto JObject<CTag>::className()
-{
-#if (JMI_CXX17+0) && (JMI_USE_CXX17 + 0)
-    if constexpr (CTag::name()[0] == 'L' && CTag::name()[CTag::name().size() - 2] == ';') // N - 1 == '\0', check N - 2
-        return impl::norm(zsub<CTag::name().size() - 3>(CTag::name(), 1));
-    else
-        return impl::norm(CTag::name());
+    template<typename T, typename = void>
+    struct is_resizable : false_type {};
+    template<typename T>
+    struct is_resizable<T, decltype(void(declval<T&>().resize(0)))> : true_type {};
+    template<typename C>
+    void fit_size(C& c, size_t n, true_type) {
+        if (c.size() != n)
+            c.resize(n);
+    }
+    template<typename C>
+    void fit_size(C&, size_t, false_type) {}
+
+    template<typename T>
+    using array_element_t = typename conditional<is_same<T, bool>::value, jboolean, T>::type; // element type of a staging vector, vector<bool> has no data()
+
+    // copy java array ja into an existing container, returns java array length
+    template<typename C>
+    size_t from_jarray_into(JNIEnv* env, jobject ja, C& c) {
+        static_assert(!is_base_of<vector<bool>, C>::value, "vector<bool> is not supported because its elements are not contiguous, use vector<jboolean>");
+        if (!ja || env->ExceptionCheck())
+            return 0;
+        const size_t n = env->GetArrayLength(static_cast<jarray>(ja));
+        fit_size(c, n, is_resizable<C>());
+        const size_t m = std::min<size_t>(n, c.size());
+        if (m > 0) {
+            jvalue jv;
+            jv.l = ja;
+            from_jarray(env, jv, &c[0], m);
+        }
+        return n;
+    }
+    template<typename T, size_t N>
+    size_t from_jarray_into(JNIEnv* env, jobject ja, T(&c)[N]) {
+        if (!ja || env->ExceptionCheck())
+            return 0;
+        const size_t n = env->GetArrayLength(static_cast<jarray>(ja));
+        jvalue jv;
+        jv.l = ja;
+        from_jarray(env, jv, c, std::min(n, N));
+        return n;
+    }
+
+    // java array of J into a container of another element type, resized if possible
+    template<typename J, class C>
+    size_t from_jarray_into(JNIEnv* env, jobject ja, JArrayCast<J, C>& a) {
+        if (!ja || env->ExceptionCheck())
+            return 0;
+        const size_t n = env->GetArrayLength(static_cast<jarray>(ja));
+        fit_size(a.c, n, is_resizable<C>());
+        const size_t m = std::min<size_t>(n, a.c.size());
+        if (m > 0) {
+            void* p = env->GetPrimitiveArrayCritical(static_cast<jarray>(ja), nullptr);
+            if (p) {
+                convert_elements(static_cast<const J*>(p), &a.c[0], m);
+                env->ReleasePrimitiveArrayCritical(static_cast<jarray>(ja), p, JNI_ABORT);
+            }
+        }
+        return n;
+    }
+
+    template<typename R, if_jarray_cpp<R>>
+    void from_jarray(JNIEnv* env, const jvalue& v, R* t, size_t N) {
+        const auto get = [t](JNIEnv* e, jarray a, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) { // rows are resized if possible
+                const LocalRef r(e->GetObjectArrayElement(static_cast<jobjectArray>(a), jsize(i)), e);
+                from_jarray_into(e, r, t[i]);
+            }
+        };
+        if (!parallel_jarray(env, static_cast<jarray>(v.l), N, get))
+            get(env, static_cast<jarray>(v.l), 0, N);
+    }
+
+    template<typename C>
+    size_t get_field_into(jobject oid, jclass cid, jfieldID* pfid, const char* name, C& out) {
+        JNIEnv* env = getEnv();
+        jfieldID fid = get_field_id<C>(env, cid, name, pfid);
+        if (!fid)
+            return 0;
+        const LocalRef ja = env->GetObjectField(oid, fid);
+        return from_jarray_into(env, ja, out);
+    }
+    template<typename C>
+    size_t get_static_field_into(jclass cid, jfieldID* pfid, const char* name, C& out) {
+        JNIEnv* env = getEnv();
+        jfieldID fid = get_static_field_id<C>(env, cid, name, pfid);
+        if (!fid)
+            return 0;
+        const LocalRef ja = env->GetStaticObjectField(cid, fid);
+        return from_jarray_into(env, ja, out);
+    }
+} // namespace detail
+
+template<class CTag>
+CONSTEXPR17 auto JObject<CTag>::className()
+{
+#if (JMI_CXX17+0) && (JMI_USE_CXX17 + 0)
+    if constexpr (CTag::name()[0] == 'L' && CTag::name()[CTag::name().size() - 2] == ';') // N - 1 == '\0', check N - 2
+        return impl::norm(zsub<CTag::name().size() - 3>(CTag::name(), 1));
+    else
+        return impl::norm(CTag::name());
 #else
     static string s = impl::norm(CTag::name());
     return s;
@@ -969,7 +2097,14 @@ CONSTEXPR17 auto JObject<CTag>::className()
 template<class CTag>
 CONSTEXPR17 auto JObject<CTag>::signature()
 {
-    return zconcat("L", className(), ";");
+#if (JMI_CXX17+0) && (JMI_USE_CXX17 + 0)
+    if constexpr (className()[0] == '[') // array class
+        return className();
+    else
+        return zconcat("L", className(), ";");
+#else
+    return className()[0] == '[' ? className() : zconcat("L", className(), ";");
+#endif
 }
 
 template<class CTag>
@@ -1025,6 +2160,189 @@ bool JObject<CTag>::create(Args&&... args) {
     return !!oid_;
 }
 
+template<class CTag>
+bool JObject<CTag>::registerNatives(const JNINativeMethod* methods, size_t count) {
+    JNIEnv* env = getEnv();
+    const jclass cid = classId(env);
+    if (!cid)
+        return false;
+    if (env->RegisterNatives(cid, methods, (jint)count) == JNI_OK)
+        return true;
+    detail::handle_exception(string("Failed to register native methods of '") + to_string(className()) + "'.", env);
+    return false;
+}
+
+namespace detail {
+    // returns a local ref
+    template<typename Tuple, size_t... I>
+    jobject new_object(JNIEnv* env, jclass cid, jmethodID mid, jvalue* jargs, Tuple& args, index_sequence<I...>) {
+        (void)initializer_list<int>{(jargs[I] = to_jvalue(get<I>(args), env), 0)...};
+        const jobject obj = env->NewObjectA(cid, mid, jargs);
+        ref_args_from_jvalues(env, jargs, get<I>(args)...);
+        return obj;
+    }
+} // namespace detail
+
+template<class CTag>
+template<typename Gen>
+ObjectArray<CTag> JObject<CTag>::createMany(size_t n, Gen&& gen) {
+    using Tuple = typename decay<decltype(gen(size_t()))>::type;
+    return createMany(n, gen, static_cast<Tuple*>(nullptr));
+}
+
+template<class CTag>
+template<typename Gen, typename... Args>
+ObjectArray<CTag> JObject<CTag>::createMany(size_t n, Gen& gen, tuple<Args...>*) {
+    using namespace detail;
+    ObjectArray<CTag> a;
+    JNIEnv* env = getEnv();
+    if (!env) {
+        a.setError("No JNIEnv when creating class '" + to_string(className()) + "'");
+        return a;
+    }
+    if (!a.create(env, n))
+        return a;
+    string err;
+    {
+        const jclass cid = classId(env);
+        const auto checker = call_on_exit([&]{
+            auto ex = handle_exception(string(err), env);
+            if (!ex.empty())
+                err = std::move(ex);
+        });
+        static CONSTEXPR17 auto s = zconcat(args_signature<Args...>(), signature_of());
+        static const jmethodID mid = env->GetMethodID(cid, "<init>", s.data());
+        if (!mid) {
+            err = string("Failed to find constructor of '") + className().data() + "' with signature '" + s.data() + "'.";
+        } else if (env->PushLocalFrame(2 + sizeof...(Args)) == JNI_OK) {
+            const auto ja = static_cast<jobjectArray>(a.id());
+            jvalue jargs[sizeof...(Args) + 1]; // reused for all objects. +1: avoid zero size array
+            for (size_t i = 0; i < n; ++i) {
+                auto&& args = gen(i);
+                const jobject obj = new_object(env, cid, mid, jargs, args, index_sequence_for<Args...>());
+                if (!obj) {
+                    err = string("Failed to call constructor '") + className().data() + "' with signature '" + s.data() + "' for object " + std::to_string(i) + ".";
+                    break;
+                }
+                env->SetObjectArrayElement(ja, (jsize)i, obj);
+                env->DeleteLocalRef(obj);
+            }
+            env->PopLocalFrame(nullptr);
+        } else {
+            err = "Failed to push local frame.";
+        }
+    }
+    if (!err.empty()) {
+        a.reset();
+        a.setError(std::move(err));
+    }
+    return a;
+}
+
+namespace detail {
+    template<class S, typename M>
+    struct struct_field {
+        using type = M;
+        const char* name;
+        M S::*member;
+    };
+    template<class S, typename M>
+    struct_field<S, M> make_struct_field(const char* name, M S::*member) { return {name, member}; }
+    // defined by JMI_STRUCT in the namespace of S, found by ADL
+    template<class S>
+    auto struct_fields() -> decltype(jmi_struct_fields(static_cast<const S*>(nullptr))) {
+        return jmi_struct_fields(static_cast<const S*>(nullptr));
+    }
+    template<class Fields, size_t I>
+    using struct_field_t = typename tuple_element<I, Fields>::type::type;
+
+    // stop at the first field not found, so the last id is null if any field is not found
+    template<class Fields, size_t... I>
+    array<jfieldID, sizeof...(I)> struct_field_ids(JNIEnv* env, jclass cid, const Fields& fs, index_sequence<I...>) {
+        array<jfieldID, sizeof...(I)> ids{};
+        if (cid)
+            (void)initializer_list<int>{(ids[I] = env->ExceptionCheck() ? nullptr : get_field_id<struct_field_t<Fields, I>>(env, cid, get<I>(fs).name), 0)...};
+        return ids;
+    }
+    template<class S, class Fields, size_t... I>
+    void load_struct(JNIEnv* env, jobject oid, const jfieldID* ids, const Fields& fs, S& s, index_sequence<I...>) {
+        (void)initializer_list<int>{(s.*get<I>(fs).member = get_field<struct_field_t<Fields, I>>(env, oid, ids[I]), 0)...};
+    }
+    template<class S, class Fields, size_t... I>
+    void store_struct(JNIEnv* env, jobject oid, const jfieldID* ids, const Fields& fs, const S& s, index_sequence<I...>) {
+        (void)initializer_list<int>{(set_field<struct_field_t<Fields, I>>(env, oid, ids[I], struct_field_t<Fields, I>(s.*get<I>(fs).member)), 0)...};
+    }
+    template<class S>
+    void load_struct(JNIEnv* env, jobject oid, const jfieldID* ids, S& s) {
+        static const auto fs = struct_fields<S>();
+        load_struct(env, oid, ids, fs, s, make_index_sequence<tuple_size<decltype(struct_fields<S>())>::value>());
+    }
+    template<class S>
+    void store_struct(JNIEnv* env, jobject oid, const jfieldID* ids, const S& s) {
+        static const auto fs = struct_fields<S>();
+        store_struct(env, oid, ids, fs, s, make_index_sequence<tuple_size<decltype(struct_fields<S>())>::value>());
+    }
+} // namespace detail
+
+template<class CTag>
+template<class S>
+const jfieldID* JObject<CTag>::structFieldIds(JNIEnv* env) {
+    using Fields = decltype(detail::struct_fields<S>());
+    static array<jfieldID, tuple_size<Fields>::value> ids{}; // cached only if all fields are found, retry if the class is not available yet
+    if (ids.back())
+        return ids.data();
+    const auto found = detail::struct_field_ids(env, classId(env), detail::struct_fields<S>(), make_index_sequence<tuple_size<Fields>::value>());
+    if (!found.back())
+        return nullptr;
+    ids = found;
+    return ids.data();
+}
+
+template<class CTag>
+bool JObject<CTag>::structError(JNIEnv* env, const jfieldID* ids, const char* what) const {
+    string err = detail::handle_exception(string("Failed to ") + what + " fields of '" + to_string(className()) + "'.", env);
+    if (err.empty() && !ids)
+        err = string("Failed to find fields of '") + to_string(className()) + "'.";
+    setError(std::move(err));
+    return error_.empty();
+}
+
+template<class CTag>
+template<class S>
+bool JObject<CTag>::load(S& s) const {
+    JNIEnv* env = getEnv();
+    if (!env) {
+        setError("Invalid JNIEnv");
+        return false;
+    }
+    if (!oid_) {
+        setError("Invalid object instance");
+        return false;
+    }
+    const jfieldID* ids = structFieldIds<S>(env);
+    if (ids)
+        detail::load_struct(env, oid_, ids, s);
+    return structError(env, ids, "load");
+}
+
+template<class CTag>
+template<class S>
+bool JObject<CTag>::store(const S& s) {
+    JNIEnv* env = getEnv();
+    if (!env) {
+        setError("Invalid JNIEnv");
+        return false;
+    }
+    if (!oid_) {
+        setError("Invalid object instance");
+        return false;
+    }
+    const jfieldID* ids = structFieldIds<S>(env);
+    if (ids)
+        detail::store_struct(env, oid_, ids, s);
+    return structError(env, ids, "store");
+}
+
 template<class CTag>
 template<typename T, class MTag, typename... Args, detail::if_MethodTag<MTag>>
 T JObject<CTag>::call(Args&&... args) const {
@@ -1156,6 +2474,72 @@ bool JObject<CTag>::setStatic(string_view fieldName, T&& v) {
     return true;
 }
 
+// call_method<LocalRef> keeps the returned java array without copy, then it's copied into the output container
+template<class CTag>
+template<class MTag, typename C, typename... Args, detail::if_MethodTag<MTag>>
+size_t JObject<CTag>::callInto(C& out, Args&&... args) const {
+    using namespace detail;
+    static CONSTEXPR17 auto s = zconcat(args_signature<Args...>(), signature_of<C>());
+    static jmethodID mid = nullptr;
+    const LocalRef ja = call_with_methodID<LocalRef>(oid_, classId(), &mid, [this](string&& err){ setError(std::move(err));}, s.data(), MTag::name(), std::forward<Args>(args)...);
+    return from_jarray_into(getEnv(), ja, out);
+}
+template<class CTag>
+template<class MTag, typename C, typename... Args, detail::if_MethodTag<MTag>>
+size_t JObject<CTag>::callStaticInto(C& out, Args&&... args) {
+    using namespace detail;
+    static CONSTEXPR17 auto s = zconcat(args_signature<Args...>(), signature_of<C>());
+    static jmethodID mid = nullptr;
+    const LocalRef ja = call_static_with_methodID<LocalRef>(classId(), &mid, nullptr, s.data(), MTag::name(), std::forward<Args>(args)...);
+    return from_jarray_into(getEnv(), ja, out);
+}
+template<class CTag>
+template<typename C, typename... Args>
+size_t JObject<CTag>::callInto(const string_view& methodName, C& out, Args&&... args) const {
+    using namespace detail;
+    static CONSTEXPR17 auto s = zconcat(args_signature<Args...>(), signature_of<C>());
+    const LocalRef ja = call_with_methodID<LocalRef>(oid_, classId(), nullptr, [this](string&& err){ setError(std::move(err));}, s.data(), methodName.data(), std::forward<Args>(args)...);
+    return from_jarray_into(getEnv(), ja, out);
+}
+template<class CTag>
+template<typename C, typename... Args>
+size_t JObject<CTag>::callStaticInto(const string_view& name, C& out, Args&&... args) {
+    using namespace detail;
+    static CONSTEXPR17 auto s = zconcat(args_signature<Args...>(), signature_of<C>());
+    const LocalRef ja = call_static_with_methodID<LocalRef>(classId(), nullptr, nullptr, s.data(), name.data(), std::forward<Args>(args)...);
+    return from_jarray_into(getEnv(), ja, out);
+}
+template<class CTag>
+template<class FTag, typename C, detail::if_FieldTag<FTag>>
+size_t JObject<CTag>::getInto(C& out) const {
+    static jfieldID fid = nullptr;
+    auto checker = detail::call_on_exit([this]{
+        setError(detail::handle_exception(string("Failed to get field '") + FTag::name() + "' with signature '" + signature_of<C>().data() + "'."));
+    });
+    return detail::get_field_into(oid_, classId(), &fid, FTag::name(), out);
+}
+template<class CTag>
+template<class FTag, typename C, detail::if_FieldTag<FTag>>
+size_t JObject<CTag>::getStaticInto(C& out) {
+    static jfieldID fid = nullptr;
+    return detail::get_static_field_into(classId(), &fid, FTag::name(), out);
+}
+template<class CTag>
+template<typename C>
+size_t JObject<CTag>::getInto(string_view fieldName, C& out) const {
+    jfieldID fid = nullptr;
+    auto checker = detail::call_on_exit([fieldName, this]{
+        setError(detail::handle_exception(string("Failed to get field '") + fieldName.data() + "' with signature '" + signature_of<C>().data() + "'."));
+    });
+    return detail::get_field_into(oid_, classId(), &fid, fieldName.data(), out);
+}
+template<class CTag>
+template<typename C>
+size_t JObject<CTag>::getStaticInto(string_view fieldName, C& out) {
+    jfieldID fid = nullptr;
+    return detail::get_static_field_into(classId(), &fid, fieldName.data(), out);
+}
+
 template<class CTag>
 template<typename F, class MayBeFTag, bool isStaticField>
 F JObject<CTag>::Field<F, MayBeFTag, isStaticField>::get() const
@@ -1233,6 +2617,189 @@ jclass JObject<CTag>::classId(JNIEnv* env) {
     return c;
 }
 
+template<class CTag>
+template<typename T, class MTag, typename... Args, detail::if_MethodTag<MTag>>
+T LocalObject<CTag>::call(Args&&... args) const {
+    using namespace detail;
+    static CONSTEXPR17 auto s = zconcat(args_signature<Args...>(), signature_of_no_ptr<typename add_pointer<T>::type>());
+    static jmethodID mid = nullptr;
+    return call_with_methodID<T>(id(), JObject<CTag>::classId(), &mid, [this](string&& err){ error_ = std::move(err);}, s.data(), MTag::name(), std::forward<Args>(args)...);
+}
+template<class CTag>
+template<class MTag, typename... Args, detail::if_MethodTag<MTag>>
+void LocalObject<CTag>::call(Args&&... args) const {
+    using namespace detail;
+    static CONSTEXPR17 auto s = zconcat(args_signature<Args...>(), signature_of());
+    static jmethodID mid = nullptr;
+    call_with_methodID<void>(id(), JObject<CTag>::classId(), &mid, [this](string&& err){ error_ = std::move(err);}, s.data(), MTag::name(), std::forward<Args>(args)...);
+}
+template<class CTag>
+template<typename T, typename... Args>
+T LocalObject<CTag>::call(const string_view &methodName, Args&&... args) const {
+    using namespace detail;
+    static CONSTEXPR17 auto s = zconcat(args_signature<Args...>(), signature_of_no_ptr<typename add_pointer<T>::type>());
+    return call_with_methodID<T>(id(), JObject<CTag>::classId(), nullptr, [this](string&& err){ error_ = std::move(err);}, s.data(), methodName.data(), std::forward<Args>(args)...);
+}
+template<class CTag>
+template<typename... Args>
+void LocalObject<CTag>::call(const string_view &methodName, Args&&... args) const {
+    using namespace detail;
+    static CONSTEXPR17 auto s = zconcat(args_signature<Args...>(), signature_of());
+    call_with_methodID<void>(id(), JObject<CTag>::classId(), nullptr, [this](string&& err){ error_ = std::move(err);}, s.data(), methodName.data(), std::forward<Args>(args)...);
+}
+template<class CTag>
+template<class FTag, typename T, detail::if_FieldTag<FTag>>
+T LocalObject<CTag>::get() const {
+    static jfieldID fid = nullptr;
+    auto checker = detail::call_on_exit([this]{
+        error_ = detail::handle_exception(string("Failed to get field '") + FTag::name() + "' with signature '" + signature_of<T>().data() + "'.");
+    });
+    return detail::get_field<T>(id(), JObject<CTag>::classId(), &fid, FTag::name());
+}
+template<class CTag>
+template<typename T>
+T LocalObject<CTag>::get(string_view fieldName) const {
+    jfieldID fid = nullptr;
+    auto checker = detail::call_on_exit([fieldName, this]{
+        error_ = detail::handle_exception(string("Failed to get field '") + fieldName.data() + "' with signature '" + signature_of<T>().data() + "'.");
+    });
+    return detail::get_field<T>(id(), JObject<CTag>::classId(), &fid, fieldName.data());
+}
+
+namespace detail {
+template<class CTag>
+struct array_tag : ClassTag { static CONSTEXPR17 auto name() { return zconcat("[", JObject<CTag>::signature()); } };
+} // namespace detail
+
+template<class CTag>
+bool ObjectArray<CTag>::create(JNIEnv* env, size_t n) {
+    const jclass cid = JObject<CTag>::classId(env);
+    if (!cid) {
+        this->setError("Failed to find class '" + to_string(JObject<CTag>::className()) + "'");
+        return false;
+    }
+    const auto checker = detail::call_on_exit([this, env]{ this->setError(detail::handle_exception({}, env)); });
+    const LocalRef a = env->NewObjectArray((jsize)n, cid, nullptr);
+    if (!a)
+        return false;
+    this->reset(a, env);
+    return true;
+}
+
+template<class CTag>
+bool ObjectArray<CTag>::create(size_t n) {
+    JNIEnv* env = getEnv();
+    if (!env) {
+        this->setError("Invalid JNIEnv");
+        return false;
+    }
+    return create(env, n);
+}
+
+template<class CTag>
+template<class It>
+bool ObjectArray<CTag>::create(It first, It last) {
+    JNIEnv* env = getEnv();
+    if (!env) {
+        this->setError("Invalid JNIEnv");
+        return false;
+    }
+    if (!create(env, std::distance(first, last)))
+        return false;
+    const auto a = static_cast<jobjectArray>(this->id());
+    for (jsize i = 0; first != last; ++first, ++i) {
+        env->SetObjectArrayElement(a, i, jobject(*first));
+        if (env->ExceptionCheck()) { // ArrayStoreException
+            this->setError(detail::handle_exception("Failed to set object array element " + std::to_string(i) + ".", env));
+            return false;
+        }
+    }
+    return true;
+}
+
+template<class CTag>
+size_t ObjectArray<CTag>::size() const {
+    if (!this->id())
+        return 0;
+    return getEnv()->GetArrayLength(static_cast<jarray>(this->id()));
+}
+
+template<class CTag>
+LocalObject<CTag> ObjectArray<CTag>::get(size_t i) const {
+    if (!this->id()) {
+        this->setError("Invalid object instance");
+        return {};
+    }
+    JNIEnv* env = getEnv();
+    const auto checker = detail::call_on_exit([this, env]{ this->setError(detail::handle_exception({}, env)); });
+    return LocalRef(env->GetObjectArrayElement(static_cast<jobjectArray>(this->id()), (jsize)i), env);
+}
+
+template<class CTag>
+bool ObjectArray<CTag>::set(size_t i, jobject obj) {
+    JNIEnv* env = getEnv();
+    env->SetObjectArrayElement(static_cast<jobjectArray>(this->id()), (jsize)i, obj);
+    auto err = detail::handle_exception({}, env);
+    this->setError(err);
+    return err.empty();
+}
+
+template<class CTag>
+template<class C>
+bool ObjectArray<CTag>::load(C& structs) const {
+    using S = remove_cvref_t<decltype(structs[0])>;
+    JNIEnv* env = getEnv();
+    if (!env) {
+        this->setError("Invalid JNIEnv");
+        return false;
+    }
+    const auto a = static_cast<jobjectArray>(this->id());
+    if (!a) {
+        this->setError("Invalid object instance");
+        return false;
+    }
+    const jfieldID* ids = JObject<CTag>::template structFieldIds<S>(env);
+    if (ids) {
+        const size_t n = env->GetArrayLength(a);
+        detail::fit_size(structs, n, detail::is_resizable<C>());
+        const size_t m = std::min<size_t>(n, structs.size());
+        for (size_t i = 0; i < m && !env->ExceptionCheck(); ++i) {
+            const jobject obj = env->GetObjectArrayElement(a, (jsize)i);
+            if (obj)
+                detail::load_struct(env, obj, ids, structs[i]);
+            env->DeleteLocalRef(obj);
+        }
+    }
+    return this->structError(env, ids, "load");
+}
+
+template<class CTag>
+template<class C>
+bool ObjectArray<CTag>::store(const C& structs) {
+    using S = remove_cvref_t<decltype(structs[0])>;
+    JNIEnv* env = getEnv();
+    if (!env) {
+        this->setError("Invalid JNIEnv");
+        return false;
+    }
+    const auto a = static_cast<jobjectArray>(this->id());
+    if (!a) {
+        this->setError("Invalid object instance");
+        return false;
+    }
+    const jfieldID* ids = JObject<CTag>::template structFieldIds<S>(env);
+    if (ids) {
+        const size_t m = std::min<size_t>(env->GetArrayLength(a), structs.size());
+        for (size_t i = 0; i < m && !env->ExceptionCheck(); ++i) {
+            const jobject obj = env->GetObjectArrayElement(a, (jsize)i);
+            if (obj)
+                detail::store_struct(env, obj, ids, structs[i]);
+            env->DeleteLocalRef(obj);
+        }
+    }
+    return this->structError(env, ids, "store");
+}
+
 namespace detail {
     template<typename T>
     jarray to_jarray(JNIEnv* env, const T &c0, size_t N, bool is_ref) {
@@ -1244,14 +2811,20 @@ namespace detail {
         jarray arr = nullptr;
         if (N == 0)
             arr = make_jarray(env, T(), 0);
+        else if (is_ref && is_arithmetic<T>::value) // out parameter, no need to initialize
+            arr = pooled_jarray(env, [](JNIEnv* e, size_t n) { return make_jarray(e, T(), n); }, N, sizeof(T));
         else
             arr = make_jarray(env, c0, N);
         if (!is_ref) {
-            if (is_arithmetic<T>::value) {
+            if (is_arithmetic<T>::value || is_same<T, string>::value) { // string arrays may be packed
                 set_jarray(env, arr, 0, N, c0);
             } else { // string etc. must convert to jobject
-                for (size_t i = 0; i < N; ++i)
-                    set_jarray(env, arr, i, 1, *((&c0)+i));
+                const auto set = [&c0](JNIEnv* e, jarray a, size_t begin, size_t end) {
+                    for (size_t i = begin; i < end; ++i)
+                        set_jarray(e, a, i, 1, *((&c0)+i));
+                };
+                if (!parallel_jarray(env, arr, N, set))
+                    set(env, arr, 0, N);
             }
         }
         return arr;
@@ -1260,5 +2833,739 @@ namespace detail {
     jvalue to_jvalue(const JObject<CTag> &obj, JNIEnv* env) {
         return to_jvalue(jobject(obj), env);
     }
+
+#if (JMI_CXX17+0)
+    template<typename Char, bool Critical> struct string_chars;
+    template<> struct string_chars<char, false> {
+        static const char* get(JNIEnv* env, jstring s, size_t& n) {
+            const auto c = env->GetStringUTFChars(s, nullptr);
+            n = c ? char_traits<char>::length(c) : 0; // modified utf8 has no '\0' inside
+            return c;
+        }
+        static void release(JNIEnv* env, jstring s, const char* c) { env->ReleaseStringUTFChars(s, c); }
+    };
+    template<> struct string_chars<char16_t, false> {
+        static const char16_t* get(JNIEnv* env, jstring s, size_t& n) {
+            n = env->GetStringLength(s);
+            return reinterpret_cast<const char16_t*>(env->GetStringChars(s, nullptr));
+        }
+        static void release(JNIEnv* env, jstring s, const char16_t* c) { env->ReleaseStringChars(s, reinterpret_cast<const jchar*>(c)); }
+    };
+    template<> struct string_chars<char16_t, true> {
+        static const char16_t* get(JNIEnv* env, jstring s, size_t& n) {
+            n = env->GetStringLength(s); // before entering critical region
+            return reinterpret_cast<const char16_t*>(env->GetStringCritical(s, nullptr));
+        }
+        static void release(JNIEnv* env, jstring s, const char16_t* c) { env->ReleaseStringCritical(s, reinterpret_cast<const jchar*>(c)); }
+    };
+#endif // (JMI_CXX17+0)
+} // namespace detail
+
+#if (JMI_CXX17+0)
+template<typename Char, bool Critical>
+const Char* BasicJStringView<Char, Critical>::data() const {
+    if (chars_ || !s_)
+        return chars_;
+    if (!env_)
+        const_cast<BasicJStringView*>(this)->env_ = getEnv();
+    chars_ = detail::string_chars<Char, Critical>::get(env_, s_, size_);
+    return chars_;
+}
+
+template<typename Char, bool Critical>
+void BasicJStringView<Char, Critical>::reset() {
+    if (!s_)
+        return;
+    if (!env_)
+        env_ = getEnv();
+    if (chars_)
+        detail::string_chars<Char, Critical>::release(env_, s_, chars_);
+    env_->DeleteLocalRef(s_);
+    s_ = nullptr;
+    chars_ = nullptr;
+    size_ = 0;
+}
+#endif // (JMI_CXX17+0)
+
+namespace detail {
+    template<typename T> struct array_elements {
+        static const T* get(JNIEnv* env, jarray a, size_t& n);
+        static void release(JNIEnv* env, jarray a, const T* elems);
+    };
+} // namespace detail
+
+template<typename T>
+const T* JArrayView<T>::data() const {
+    if (elems_ || !a_)
+        return elems_;
+    if (!env_)
+        const_cast<JArrayView*>(this)->env_ = getEnv();
+    elems_ = detail::array_elements<T>::get(env_, a_, size_);
+    return elems_;
+}
+
+template<typename T>
+void JArrayView<T>::reset() {
+    if (!a_)
+        return;
+    if (!env_)
+        env_ = getEnv();
+    if (elems_)
+        detail::array_elements<T>::release(env_, a_, elems_);
+    env_->DeleteLocalRef(a_);
+    a_ = nullptr;
+    elems_ = nullptr;
+    size_ = 0;
+}
+
+namespace detail {
+    template<typename T>
+    struct is_native_plain : integral_constant<bool, is_arithmetic<T>::value || is_enum<T>::value || is_jobject<T>::value> {};
+    // jni type of native method parameter and return type
+    template<typename T, typename = void> struct native_jni { using type = jobject; };
+    template<> struct native_jni<void> { using type = void; };
+    template<> struct native_jni<bool> { using type = jboolean; };
+    template<typename T> struct native_jni<T, typename enable_if<is_native_plain<T>::value && !is_enum<T>::value && !is_same<T, bool>::value>::type> { using type = T; };
+    template<typename T> struct native_jni<T, typename enable_if<is_enum<T>::value>::type> { using type = jint; };
+    template<typename T> struct native_jni<T, typename enable_if<has_converter<T>::value>::type> { using type = typename Converter<T>::jni_type; };
+    template<typename T>
+    using native_jni_t = typename native_jni<remove_cvref_t<T>>::type;
+
+    // native method argument converted to T, which lives until the c++ function returns
+    template<typename T, typename = void> struct native_arg;
+    template<typename T> struct native_arg<T, typename enable_if<is_native_plain<T>::value>::type> {
+        T value;
+        native_arg(JNIEnv*, native_jni_t<T> j) : value(static_cast<T>(j)) {}
+        T get() const { return value; }
+    };
+    template<typename T> struct native_arg<T, typename enable_if<has_converter<T>::value>::type> {
+        T value;
+        native_arg(JNIEnv* env, native_jni_t<T> j) : value(Converter<T>::from_java(j, env)) {}
+        T&& get() { return std::move(value); }
+    };
+    template<typename T> struct native_arg<T, typename enable_if<is_JObject<T>::value>::type> {
+        T value;
+        native_arg(JNIEnv* env, jobject j) { value.reset(j, env); }
+        T&& get() { return std::move(value); }
+    };
+    template<typename T> struct native_arg<T, typename enable_if<is_jarray_cpp<T>::value>::type> {
+        T value{};
+        native_arg(JNIEnv* env, jobject j) { from_jarray_into(env, j, value); }
+        T&& get() { return std::move(value); }
+    };
+    template<> struct native_arg<string> {
+        string value;
+        native_arg(JNIEnv* env, jobject j) : value(to_string(static_cast<jstring>(j), env)) {}
+        string&& get() { return std::move(value); }
+    };
+    template<> struct native_arg<u16string> {
+        u16string value;
+        native_arg(JNIEnv* env, jobject j) : value(to_u16string(static_cast<jstring>(j), env)) {}
+        u16string&& get() { return std::move(value); }
+    };
+#if (JMI_CXX17+0)
+    template<typename Char, bool Critical> struct native_arg<BasicJStringView<Char, Critical>> {
+        BasicJStringView<Char, Critical> value;
+        native_arg(JNIEnv* env, jobject j) : value(static_cast<jstring>(j), env) {}
+        BasicJStringView<Char, Critical>&& get() { return std::move(value); }
+    };
+    template<typename Char> struct native_arg<basic_string_view<Char>> {
+        BasicJStringView<Char> value;
+        native_arg(JNIEnv* env, jobject j) : value(static_cast<jstring>(j), env) {}
+        basic_string_view<Char> get() const { return value.view(); }
+    };
+#endif
+    template<typename T> struct native_arg<JArrayView<T>> {
+        JArrayView<T> value;
+        native_arg(JNIEnv* env, jobject j) : value(static_cast<jarray>(j), env) {}
+        JArrayView<T>&& get() { return std::move(value); }
+    };
+
+    // return value to jni type. object is returned as a new local ref
+    template<typename T, typename enable_if<is_native_plain<T>::value, bool>::type = true>
+    native_jni_t<T> to_native(JNIEnv*, const T& t) { return static_cast<native_jni_t<T>>(t); }
+    template<typename T, if_converter<T> = true>
+    native_jni_t<T> to_native(JNIEnv* env, const T& t) { return Converter<T>::to_java(t, env); }
+    template<typename T, if_JObject<T> = true>
+    jobject to_native(JNIEnv* env, const T& t) { return t.id() ? env->NewLocalRef(t.id()) : nullptr; }
+    template<typename T, typename enable_if<!is_native_plain<T>::value && !has_converter<T>::value && !is_JObject<T>::value, bool>::type = true>
+    jobject to_native(JNIEnv* env, const T& t) { return to_jvalue(t, env).l; } // strings, arrays
+
+    void throw_java(JNIEnv* env, const char* className, const char* msg); // keeps the pending exception if any
+#if (JMI_EXCEPTIONS + 0)
+    void throw_java_current(JNIEnv* env, const char* className); // in a catch block, the c++ exception being handled as java className
+#endif
+    template<typename F, F f> struct native_method;
+    template<typename R, typename Self, typename... Args, R(*f)(JNIEnv*, Self, Args...)>
+    struct native_method<R(*)(JNIEnv*, Self, Args...), f> {
+        static native_jni_t<R> JNICALL call(JNIEnv* env, Self self, native_jni_t<Args>... args) {
+#if (JMI_EXCEPTIONS + 0) // c++ exceptions must not cross jni boundary
+            try {
+                return to_native(env, f(env, self, native_arg<remove_cvref_t<Args>>(env, args).get()...));
+            } catch (...) {
+                throw_java_current(env, "java/lang/RuntimeException");
+            }
+            return native_jni_t<R>{};
+#else
+            return to_native(env, f(env, self, native_arg<remove_cvref_t<Args>>(env, args).get()...));
+#endif
+        }
+        static JNINativeMethod get(const char* name) {
+            static CONSTEXPR17 auto s = zconcat(args_signature<Args...>(), signature_of_no_ptr<typename add_pointer<R>::type>());
+            return {const_cast<char*>(name), const_cast<char*>(s.data()), reinterpret_cast<void*>(&call)};
+        }
+    };
+    template<typename Self, typename... Args, void(*f)(JNIEnv*, Self, Args...)>
+    struct native_method<void(*)(JNIEnv*, Self, Args...), f> {
+        static void JNICALL call(JNIEnv* env, Self self, native_jni_t<Args>... args) {
+#if (JMI_EXCEPTIONS + 0)
+            try {
+                f(env, self, native_arg<remove_cvref_t<Args>>(env, args).get()...);
+            } catch (...) {
+                throw_java_current(env, "java/lang/RuntimeException");
+            }
+#else
+            f(env, self, native_arg<remove_cvref_t<Args>>(env, args).get()...);
+#endif
+        }
+        static JNINativeMethod get(const char* name) {
+            static CONSTEXPR17 auto s = zconcat(args_signature<Args...>(), signature_of());
+            return {const_cast<char*>(name), const_cast<char*>(s.data()), reinterpret_cast<void*>(&call)};
+        }
+    };
+
+    struct native_callback_tag : ClassTag { static constexpr auto name() { return JMISTR("jmi/NativeCallback"); } };
+    // lock-free callback handle table. returns 0 if the table is full
+    jlong add_callback(callback_t&& f);
+    bool remove_callback(jlong handle);
+    template<typename T>
+    using boxed_jni_t = typename conditional<is_same<T, bool>::value, jboolean, typename conditional<is_enum<T>::value, jint, T>::type>::type;
+
+    template<typename F> struct callable_traits : callable_traits<decltype(&F::operator())> {};
+    template<typename R, typename... Args> struct callable_traits<R(*)(Args...)> {
+        using result = R;
+        using args = tuple<Args...>;
+    };
+    template<typename R, typename... Args> struct callable_traits<R(Args...)> : callable_traits<R(*)(Args...)> {};
+    template<typename C, typename R, typename... Args> struct callable_traits<R(C::*)(Args...)> : callable_traits<R(*)(Args...)> {};
+    template<typename C, typename R, typename... Args> struct callable_traits<R(C::*)(Args...) const> : callable_traits<R(*)(Args...)> {};
+
+    // boxed java argument o(a local ref) to T
+    template<typename T, typename enable_if<is_arithmetic<T>::value || is_enum<T>::value, bool>::type = true>
+    T callback_arg(JNIEnv* env, jobject o) {
+        const LocalRef r(o, env);
+        if (!unboxable<boxed_jni_t<T>>(env, o)) {
+            throw_java(env, "java/lang/IllegalArgumentException", "NativeCallback argument is null or not a boxed primitive of the parameter type");
+            return T();
+        }
+        return static_cast<T>(unbox<boxed_jni_t<T>>(env, o));
+    }
+    template<typename T, if_jobject<T> = true>
+    T callback_arg(JNIEnv*, jobject o) { return static_cast<T>(o); }
+    template<typename T, if_JObject<T> = true>
+    T callback_arg(JNIEnv* env, jobject o) {
+        const LocalRef r(o, env);
+        T t;
+        t.reset(o, env);
+        return t;
+    }
+    template<typename T, if_converter<T> = true>
+    T callback_arg(JNIEnv* env, jobject o) { return Converter<T>::from_java(callback_arg<typename Converter<T>::jni_type>(env, o), env); }
+    // true if o is null or a java.lang.String, otherwise deletes o and throws IllegalArgumentException
+    bool string_arg(JNIEnv* env, jobject o);
+    template<typename T, if_same<T, string> = true>
+    T callback_arg(JNIEnv* env, jobject o) { return string_arg(env, o) ? to_string(static_cast<jstring>(o), env) : T(); }
+    template<typename T, if_same<T, u16string> = true>
+    T callback_arg(JNIEnv* env, jobject o) { return string_arg(env, o) ? to_u16string(static_cast<jstring>(o), env) : T(); }
+
+    // return value of callable to a java object(a local ref)
+    template<typename T, typename enable_if<is_arithmetic<T>::value || is_enum<T>::value, bool>::type = true>
+    jobject callback_result(JNIEnv* env, T v) { return box<boxed_jni_t<T>>(env, static_cast<boxed_jni_t<T>>(v)); }
+    template<typename T, if_jobject<T> = true>
+    jobject callback_result(JNIEnv*, T o) { return o; }
+    template<typename T, if_JObject<T> = true>
+    jobject callback_result(JNIEnv* env, const T& t) { return t.id() ? env->NewLocalRef(t.id()) : nullptr; }
+    template<typename T, if_converter<T> = true>
+    jobject callback_result(JNIEnv* env, const T& t) { return callback_result(env, Converter<T>::to_java(t, env)); }
+    static inline jobject callback_result(JNIEnv* env, const string& s) { return from_string(s, env); }
+    static inline jobject callback_result(JNIEnv* env, const u16string& s) { return from_string(s, env); }
+
+    // argument i of a callback. no jni call after an exception is thrown for an invalid argument
+    template<typename T>
+    T callback_arg(JNIEnv* env, jobjectArray args, jsize i) {
+        if (env->ExceptionCheck())
+            return T();
+        return callback_arg<T>(env, env->GetObjectArrayElement(args, i));
+    }
+    template<typename F, typename... Args, size_t... I>
+    jobject invoke_callback(JNIEnv* env, jobjectArray args, F& f, tuple<Args...>*, index_sequence<I...>, false_type) {
+        (void)args;
+        tuple<remove_cvref_t<Args>...> a{callback_arg<remove_cvref_t<Args>>(env, args, (jsize)I)...}; // evaluated in order
+        if (env->ExceptionCheck())
+            return nullptr;
+        return callback_result(env, f(std::get<I>(std::move(a))...));
+    }
+    template<typename F, typename... Args, size_t... I>
+    jobject invoke_callback(JNIEnv* env, jobjectArray args, F& f, tuple<Args...>*, index_sequence<I...>, true_type) {
+        (void)args;
+        tuple<remove_cvref_t<Args>...> a{callback_arg<remove_cvref_t<Args>>(env, args, (jsize)I)...};
+        if (env->ExceptionCheck())
+            return nullptr;
+        f(std::get<I>(std::move(a))...);
+        return nullptr;
+    }
+    template<typename F>
+    callback_t make_callback(F&& f) {
+        using Traits = callable_traits<typename decay<F>::type>;
+        using Args = typename Traits::args;
+        using R = typename Traits::result;
+        return [f = std::forward<F>(f)](JNIEnv* env, jobjectArray args) mutable -> jobject {
+            constexpr size_t N = tuple_size<Args>::value;
+            if ((args ? (size_t)env->GetArrayLength(args) : 0) != N) {
+                throw_java(env, "java/lang/IllegalArgumentException", ("NativeCallback requires " + std::to_string(N) + " arguments").data());
+                return nullptr;
+            }
+            return invoke_callback(env, args, f, static_cast<Args*>(nullptr), make_index_sequence<N>(), is_void<R>());
+        };
+    }
+} // namespace detail
+
+template<typename F, typename enable_if<!is_same<typename decay<F>::type, Callback>::value, bool>::type>
+Callback::Callback(F&& f) : handle_(detail::add_callback(detail::make_callback(std::forward<F>(f)))) {}
+
+namespace detail {
+    struct command_buffer_tag : ClassTag { static constexpr auto name() { return JMISTR("jmi/CommandBuffer"); } };
+    // a command in CommandBuffer, followed by argc jvalues. the same layout as java jmi.CommandBuffer
+    struct command_header {
+        jint method; // index of java MethodHandle
+        jint target; // ref index of the object, -1 for static methods
+        jint status; // written by java, 0: succeeded, 1: exception
+        jint argc;
+        jvalue result; // primitive result written by java
+    };
+    static_assert(sizeof(command_header) == 3 * sizeof(jvalue), "bad command_header size");
+
+    // whether java type of a command argument is an object. a ref index is stored in the argument jvalue
+    template<typename T, typename = void>
+    struct is_object_arg : integral_constant<bool, !is_arithmetic<T>::value && !is_enum<T>::value && (!is_pointer<T>::value || is_jobject<T>::value)> {};
+    template<typename T> struct is_object_arg<T, typename enable_if<has_converter<T>::value>::type> : is_jobject<typename Converter<T>::jni_type> {};
+    template<> struct is_object_arg<const char*> : true_type {};
+    template<> struct is_object_arg<char*> : true_type {};
+
+    template<typename T, typename enable_if<is_arithmetic<T>::value || is_enum<T>::value, bool>::type = true>
+    T command_result(JNIEnv*, const jvalue& v, jobjectArray, jsize) {
+        boxed_jni_t<T> j;
+        memcpy(&j, &v, sizeof(j)); // all jvalue members start at address 0
+        return static_cast<T>(j);
+    }
+    template<typename T, if_converter<T> = true>
+    T command_result(JNIEnv* env, const jvalue& v, jobjectArray out, jsize i) {
+        return from_java<T>(env, command_result<converter_jni_t<T>>(env, v, out, i));
+    }
+    template<typename T, typename enable_if<!is_arithmetic<T>::value && !is_enum<T>::value && !has_converter<T>::value, bool>::type = true>
+    T command_result(JNIEnv* env, const jvalue&, jobjectArray out, jsize i) {
+        return callback_arg<T>(env, env->GetObjectArrayElement(out, i));
+    }
 } // namespace detail
+
+template<typename T, class CTag, typename... Args>
+size_t CommandBuffer::call(const JObject<CTag>& obj, const string_view& methodName, Args&&... args) {
+    using namespace detail;
+    static CONSTEXPR17 auto s = zconcat(args_signature<Args...>(), signature_of_no_ptr<typename add_pointer<T>::type>());
+    JNIEnv* env = getEnv();
+    return add(env, method(env, JObject<CTag>::classId(env), methodName.data(), s.data(), false), obj.id(), false, std::forward<Args>(args)...);
+}
+template<typename T, class MTag, class CTag, typename... Args, detail::if_MethodTag<MTag>>
+size_t CommandBuffer::call(const JObject<CTag>& obj, Args&&... args) {
+    using namespace detail;
+    static CONSTEXPR17 auto s = zconcat(args_signature<Args...>(), signature_of_no_ptr<typename add_pointer<T>::type>());
+    static jint mid = -1;
+    JNIEnv* env = getEnv();
+    if (mid < 0)
+        mid = method(env, JObject<CTag>::classId(env), MTag::name(), s.data(), false);
+    return add(env, mid, obj.id(), false, std::forward<Args>(args)...);
+}
+template<class CTag, typename T, typename... Args>
+size_t CommandBuffer::callStatic(const string_view& methodName, Args&&... args) {
+    using namespace detail;
+    static CONSTEXPR17 auto s = zconcat(args_signature<Args...>(), signature_of_no_ptr<typename add_pointer<T>::type>());
+    JNIEnv* env = getEnv();
+    return add(env, method(env, JObject<CTag>::classId(env), methodName.data(), s.data(), true), nullptr, true, std::forward<Args>(args)...);
+}
+template<class CTag, typename T, class MTag, typename... Args, detail::if_MethodTag<MTag>>
+size_t CommandBuffer::callStatic(Args&&... args) {
+    using namespace detail;
+    static CONSTEXPR17 auto s = zconcat(args_signature<Args...>(), signature_of_no_ptr<typename add_pointer<T>::type>());
+    static jint mid = -1;
+    JNIEnv* env = getEnv();
+    if (mid < 0)
+        mid = method(env, JObject<CTag>::classId(env), MTag::name(), s.data(), true);
+    return add(env, mid, nullptr, true, std::forward<Args>(args)...);
+}
+
+template<typename... Args>
+size_t CommandBuffer::add(JNIEnv* env, jint method, jobject target, bool isStatic, Args&&... args) {
+    if (method < 0)
+        return npos;
+    if (!isStatic && !target) {
+        error_ = "Invalid object instance";
+        return npos;
+    }
+    error_.clear();
+    const detail::command_header h{method, isStatic ? -1 : ref(env, target, false), 0, jint(sizeof...(Args)), jvalue()};
+    const initializer_list<jvalue> a = {arg(env, std::forward<Args>(args))...};
+    const size_t pos = buf_.size();
+    buf_.resize(pos + kHeaderSlots + a.size());
+    memcpy(&buf_[pos], &h, sizeof(h));
+    copy(a.begin(), a.end(), buf_.begin() + pos + kHeaderSlots);
+    offsets_.push_back(pos);
+    return offsets_.size() - 1;
+}
+
+template<typename T>
+jvalue CommandBuffer::arg(JNIEnv* env, T&& t) {
+    using D = typename decay<T>::type;
+    static_assert(!detail::is_ref_wrap<D>::value, "out parameters are not supported by CommandBuffer");
+    jvalue v = detail::to_jvalue(std::forward<T>(t), env);
+    if (detail::is_object_arg<D>::value) { // c strings and raw jobjects are pointers here. caller owns raw jobjects
+        const jint i = ref(env, v.l, (is_pointer<D>::value && !detail::is_jobject<D>::value) || detail::is_local_arg(env, t, v.l));
+        v.j = 0;
+        v.i = i;
+    }
+    return v;
+}
+
+template<typename T>
+T CommandBuffer::result(size_t i) const {
+    if (!ok(i))
+        return T();
+    return detail::command_result<T>(getEnv(), slot(i), static_cast<jobjectArray>(out_), jsize(i));
+}
+
+namespace detail {
+    struct ring_buffer_tag : ClassTag { static constexpr auto name() { return JMISTR("jmi/RingBuffer"); } };
+    struct byte_buffer_tag : ClassTag { static constexpr auto name() { return JMISTR("java/nio/ByteBuffer"); } };
+    struct direct_buffers_tag : ClassTag { static constexpr auto name() { return JMISTR("jmi/DirectBuffers"); } };
+    struct native_input_stream_tag : ClassTag { static constexpr auto name() { return JMISTR("jmi/NativeInputStream"); } };
+    JNativeInputStream make_input_stream(stream_source_t&& read, size_t chunk);
+} // namespace detail
+
+template<typename F, typename enable_if<!is_convertible<F, std::streambuf*>::value, bool>::type>
+JNativeInputStream makeInputStream(F&& read, size_t chunk) {
+    return detail::make_input_stream(detail::stream_source_t(std::forward<F>(read)), chunk);
+}
+
+namespace detail {
+    struct object_tag : ClassTag { static constexpr auto name() { return JMISTR("java/lang/Object"); } };
+    struct iterator_tag : ClassTag { static constexpr auto name() { return JMISTR("java/util/Iterator"); } };
+    struct containers_tag : ClassTag { static constexpr auto name() { return JMISTR("jmi/Containers"); } };
+    struct strings_tag : ClassTag { static constexpr auto name() { return JMISTR("jmi/Strings"); } };
+    template<typename T>
+    CONSTEXPR17 char element_type() { return signature_of<T>()[0]; } // jmi.Containers unboxes to a primitive array if not 'L'
+} // namespace detail
+
+template<typename T>
+JavaRange<T>::JavaRange(jobject source, size_t chunk)
+    : chunk_(std::min<size_t>(std::max<size_t>(chunk, 1), 0x7fffffff))
+{
+    struct Iterator : MethodTag { static const char* name() { return "iterator"; } };
+    if (source)
+        it_ = JObject<detail::containers_tag>::callStatic<JObject<detail::iterator_tag>, Iterator>(JObject<detail::object_tag>(source, false));
+    if (!it_)
+        error_ = "Failed to get java Iterator."; // exception is logged
+}
+
+namespace detail {
+    template<typename T>
+    JObject<object_tag> to_java_array(JNIEnv* env, const T* data, size_t n) {
+        const T empty{};
+        return JObject<object_tag>(to_jarray(env, n ? data[0] : empty, n)); // local ref is deleted
+    }
+    template<typename T>
+    jobject to_java_collection(JNIEnv* env, const T* data, size_t n, bool set) {
+        struct NewList : MethodTag { static const char* name() { return "newList"; } };
+        struct NewSet : MethodTag { static const char* name() { return "newSet"; } };
+        const auto a = to_java_array(env, data, n);
+        const auto c = set ? JObject<containers_tag>::callStatic<JObject<object_tag>, NewSet>(a)
+                            : JObject<containers_tag>::callStatic<JObject<object_tag>, NewList>(a);
+        return c ? env->NewLocalRef(c.id()) : nullptr;
+    }
+    template<typename T>
+    void from_java_collection(JNIEnv* env, jobject c, vector<T>& v) {
+        struct ToArray : MethodTag { static const char* name() { return "toArray"; } };
+        if (!c)
+            return;
+        const auto a = JObject<containers_tag>::callStatic<JObject<object_tag>, ToArray>(JObject<object_tag>(c, false), jchar(element_type<T>()));
+        if (a)
+            from_jarray_into(env, a.id(), v);
+    }
+    template<typename M>
+    jobject to_java_map(JNIEnv* env, const M& m) {
+        struct NewMap : MethodTag { static const char* name() { return "newMap"; } };
+        vector<array_element_t<typename M::key_type>> keys;
+        vector<array_element_t<typename M::mapped_type>> values;
+        keys.reserve(m.size());
+        values.reserve(m.size());
+        for (const auto& kv : m) {
+            keys.push_back(kv.first);
+            values.push_back(kv.second);
+        }
+        const auto c = JObject<containers_tag>::callStatic<JObject<object_tag>, NewMap>(to_java_array(env, keys.data(), keys.size()), to_java_array(env, values.data(), values.size()));
+        return c ? env->NewLocalRef(c.id()) : nullptr;
+    }
+    template<typename M>
+    M from_java_map(JNIEnv* env, jobject m) {
+        struct Entries : MethodTag { static const char* name() { return "entries"; } };
+        using K = typename M::key_type;
+        using V = typename M::mapped_type;
+        M r;
+        if (!m)
+            return r;
+        const auto kv = JObject<containers_tag>::callStatic<JObject<object_tag>, Entries>(JObject<object_tag>(m, false), jchar(element_type<K>()), jchar(element_type<V>()));
+        if (!kv)
+            return r;
+        vector<array_element_t<K>> keys;
+        vector<array_element_t<V>> values;
+        const LocalRef ka(env->GetObjectArrayElement(static_cast<jobjectArray>(kv.id()), 0), env);
+        const LocalRef va(env->GetObjectArrayElement(static_cast<jobjectArray>(kv.id()), 1), env);
+        from_jarray_into(env, ka, keys);
+        from_jarray_into(env, va, values);
+        for (size_t i = 0; i < std::min(keys.size(), values.size()); ++i)
+            r.emplace(std::move(keys[i]), std::move(values[i]));
+        return r;
+    }
+
+    template<typename S>
+    struct set_converter {
+        using jni_type = jobject;
+        static constexpr bool owns_local_ref = true;
+        static constexpr auto signature() { return JMISTR("Ljava/util/Set;"); }
+        static jobject to_java(const S& s, JNIEnv* env) {
+            const vector<array_element_t<typename S::value_type>> v(s.begin(), s.end());
+            return to_java_collection(env, v.data(), v.size(), true);
+        }
+        static S from_java(jobject c, JNIEnv* env) {
+            vector<array_element_t<typename S::value_type>> v;
+            from_java_collection(env, c, v);
+            return S(v.begin(), v.end());
+        }
+    };
+
+    template<typename M>
+    struct map_converter {
+        using jni_type = jobject;
+        static constexpr bool owns_local_ref = true;
+        static constexpr auto signature() { return JMISTR("Ljava/util/Map;"); }
+        static jobject to_java(const M& m, JNIEnv* env) { return to_java_map(env, m); }
+        static M from_java(jobject m, JNIEnv* env) { return from_java_map<M>(env, m); }
+    };
+} // namespace detail
+
+template<typename T>
+struct Converter<JList<T>> {
+    using jni_type = jobject;
+    static constexpr bool owns_local_ref = true;
+    static constexpr auto signature() { return JMISTR("Ljava/util/List;"); }
+    static jobject to_java(const JList<T>& v, JNIEnv* env) { return detail::to_java_collection(env, v.data(), v.size(), false); }
+    static JList<T> from_java(jobject c, JNIEnv* env) {
+        JList<T> v;
+        detail::from_java_collection(env, c, v);
+        return v;
+    }
+};
+
+namespace detail {
+    template<typename T> struct matrix_signature;
+    template<> struct matrix_signature<jboolean> { static constexpr auto value = JMISTR("[[Z"); };
+    template<> struct matrix_signature<jbyte> { static constexpr auto value = JMISTR("[[B"); };
+    template<> struct matrix_signature<jchar> { static constexpr auto value = JMISTR("[[C"); };
+    template<> struct matrix_signature<jshort> { static constexpr auto value = JMISTR("[[S"); };
+    template<> struct matrix_signature<jint> { static constexpr auto value = JMISTR("[[I"); };
+    template<> struct matrix_signature<jlong> { static constexpr auto value = JMISTR("[[J"); };
+    template<> struct matrix_signature<jfloat> { static constexpr auto value = JMISTR("[[F"); };
+    template<> struct matrix_signature<jdouble> { static constexpr auto value = JMISTR("[[D"); };
+
+    template<typename T>
+    jobject to_java_matrix(JNIEnv* env, const T* data, size_t rows, size_t cols) {
+        const jclass rowClass = array_class<vector<T>>(env); // FindClass exception is pending if null
+        if (!rowClass)
+            return nullptr;
+        jobjectArray a = env->NewObjectArray(jsize(rows), rowClass, nullptr);
+        for (size_t i = 0; a && i < rows; ++i) {
+            const LocalRef r(make_jarray(env, T(), cols), env);
+            if (!r) {
+                env->DeleteLocalRef(a);
+                return nullptr;
+            }
+            if (cols > 0)
+                set_jarray(env, static_cast<jarray>(jobject(r)), 0, cols, data[i * cols]);
+            env->SetObjectArrayElement(a, jsize(i), r);
+            if (env->ExceptionCheck()) {
+                env->DeleteLocalRef(a);
+                return nullptr;
+            }
+        }
+        return a;
+    }
+    template<typename T>
+    JMatrix<T> from_java_matrix(JNIEnv* env, jobject a) {
+        JMatrix<T> m;
+        if (!a)
+            return m;
+        m.rows = env->GetArrayLength(static_cast<jarray>(a));
+        for (size_t i = 0; i < m.rows; ++i) {
+            const LocalRef r(env->GetObjectArrayElement(static_cast<jobjectArray>(a), jsize(i)), env);
+            const size_t n = r ? env->GetArrayLength(static_cast<jarray>(jobject(r))) : 0;
+            if (i == 0) {
+                m.cols = n;
+                m.data.resize(m.rows * n);
+            }
+            const size_t k = std::min(n, m.cols);
+            if (k > 0) {
+                jvalue v;
+                v.l = r;
+                from_jarray(env, v, m[i], k);
+            }
+        }
+        return m;
+    }
+} // namespace detail
+
+template<typename T>
+struct Converter<JMatrix<T>> {
+    using jni_type = jobject;
+    static constexpr bool owns_local_ref = true;
+    static constexpr auto signature() { return detail::matrix_signature<T>::value; }
+    static jobject to_java(const JMatrix<T>& m, JNIEnv* env) {
+        if (m.data.size() < m.rows * m.cols) { // reported as the error of the call
+            detail::throw_java(env, "java/lang/IllegalArgumentException", "JMatrix data is smaller than rows * cols");
+            return nullptr;
+        }
+        return detail::to_java_matrix(env, m.data.data(), m.rows, m.cols);
+    }
+    static JMatrix<T> from_java(jobject a, JNIEnv* env) { return detail::from_java_matrix<T>(env, a); }
+};
+template<typename T>
+struct Converter<JMatrixView<T>> {
+    using jni_type = jobject;
+    static constexpr bool owns_local_ref = true;
+    static constexpr auto signature() { return detail::matrix_signature<T>::value; }
+    static jobject to_java(const JMatrixView<T>& m, JNIEnv* env) { return detail::to_java_matrix(env, m.data, m.rows, m.cols); }
+};
+
+namespace detail {
+    // global refs indexed by ordinal, never deleted. null if failed, and the exception is kept pending to be reported as the error of the current call
+    const vector<jobject>* java_enum_constants(const char* className);
+    jint java_enum_ordinal(JNIEnv* env, jobject e, const vector<jobject>& constants); // -1 if null or not a constant
+    template<class CTag>
+    const vector<jobject>& java_enum_table() {
+        static const vector<jobject>* t = nullptr; // resolved again by the next use if failed, e.g. the class is not loaded yet
+        if (!t)
+            t = java_enum_constants(JObject<CTag>::className().data());
+        static const vector<jobject> none;
+        return t ? *t : none;
+    }
+} // namespace detail
+
+template<typename E, class CTag>
+struct Converter<JEnum<E, CTag>> {
+    using jni_type = jobject;
+    static constexpr bool owns_local_ref = false; // global refs in the table
+    static constexpr auto signature() { return JObject<CTag>::signature(); }
+    static jobject to_java(const JEnum<E, CTag>& e, JNIEnv*) {
+        const auto& t = detail::java_enum_table<CTag>();
+        const auto i = size_t(e.value);
+        return i < t.size() ? t[i] : nullptr;
+    }
+    static JEnum<E, CTag> from_java(jobject j, JNIEnv* env) {
+        return JEnum<E, CTag>(static_cast<E>(detail::java_enum_ordinal(env, j, detail::java_enum_table<CTag>())));
+    }
+};
+
+namespace detail {
+    template<typename T, bool AsObject> struct box_signature;
+    template<typename T> struct box_signature<T, true> { static constexpr auto value = JMISTR("Ljava/lang/Object;"); };
+    template<> struct box_signature<jboolean, false> { static constexpr auto value = JMISTR("Ljava/lang/Boolean;"); };
+    template<> struct box_signature<jbyte, false> { static constexpr auto value = JMISTR("Ljava/lang/Byte;"); };
+    template<> struct box_signature<jchar, false> { static constexpr auto value = JMISTR("Ljava/lang/Character;"); };
+    template<> struct box_signature<jshort, false> { static constexpr auto value = JMISTR("Ljava/lang/Short;"); };
+    template<> struct box_signature<jint, false> { static constexpr auto value = JMISTR("Ljava/lang/Integer;"); };
+    template<> struct box_signature<jlong, false> { static constexpr auto value = JMISTR("Ljava/lang/Long;"); };
+    template<> struct box_signature<jfloat, false> { static constexpr auto value = JMISTR("Ljava/lang/Float;"); };
+    template<> struct box_signature<jdouble, false> { static constexpr auto value = JMISTR("Ljava/lang/Double;"); };
+} // namespace detail
+
+template<typename T, bool AsObject>
+struct Converter<Boxed<T, AsObject>> {
+    using jni_type = jobject;
+    static constexpr bool owns_local_ref = true; // call() arguments may be cached global refs, see detail::is_local_arg()
+    static constexpr auto signature() { return detail::box_signature<T, AsObject>::value; }
+    static jobject to_java(const Boxed<T, AsObject>& b, JNIEnv* env) {
+        if (b.null)
+            return nullptr;
+        const jobject c = detail::cached_box(env, b.value);
+        return c ? env->NewLocalRef(c) : detail::box(env, b.value);
+    }
+    static Boxed<T, AsObject> from_java(jobject j, JNIEnv* env) {
+        return j ? Boxed<T, AsObject>(detail::unbox<T>(env, j)) : Boxed<T, AsObject>();
+    }
+};
+
+template<typename T, class... A> struct Converter<set<T, A...>> : detail::set_converter<set<T, A...>> {};
+template<typename T, class... A> struct Converter<unordered_set<T, A...>> : detail::set_converter<unordered_set<T, A...>> {};
+
+template<typename K, typename V, class... A> struct Converter<map<K, V, A...>> : detail::map_converter<map<K, V, A...>> {};
+template<typename K, typename V, class... A> struct Converter<unordered_map<K, V, A...>> : detail::map_converter<unordered_map<K, V, A...>> {};
+
+template<typename T>
+bool JavaRange<T>::fetch() {
+    buf_.clear();
+    if (!it_)
+        return false;
+    struct Next : MethodTag { static const char* name() { return "next"; } };
+    auto a = JObject<detail::containers_tag>::callStatic<JObject<detail::object_tag>, Next>(it_, jint(chunk_), jchar(detail::element_type<T>()));
+    if (!a) {
+        error_ = "Failed to get next elements from java Iterator.";
+        it_.reset();
+        return false;
+    }
+    detail::from_jarray_into(getEnv(), a.id(), buf_);
+    if (buf_.size() < chunk_) // the last chunk
+        it_.reset();
+    return !buf_.empty();
+}
+
+namespace detail {
+    template<typename T> void get_jarray_region(JNIEnv* env, jarray a, size_t start, size_t n, T* t);
+    using region_copy_t = void(*)(JNIEnv* env, jarray a, size_t start, size_t n, void* data);
+    using region_func_t = function<bool(void* data, size_t offset, size_t n)>;
+    size_t stream_jarray(jobject array, size_t element_size, region_copy_t copy, bool write, size_t chunk, bool background, const region_func_t& f);
+} // namespace detail
+
+template<typename T, typename F>
+size_t readArrayChunks(jobject array, F&& f, size_t chunk, bool prefetch) {
+    static_assert(is_arithmetic<T>::value, "T must be a java primitive type");
+    return detail::stream_jarray(array, sizeof(T), [](JNIEnv* env, jarray a, size_t start, size_t n, void* data) {
+        detail::get_jarray_region(env, a, start, n, static_cast<T*>(data));
+    }, false, chunk, prefetch, [&f](void* data, size_t offset, size_t n) { return f(static_cast<const T*>(data), offset, n); });
+}
+
+template<typename T, typename F>
+size_t writeArrayChunks(jobject array, F&& f, size_t chunk, bool prefetch) {
+    static_assert(is_arithmetic<T>::value, "T must be a java primitive type");
+    return detail::stream_jarray(array, sizeof(T), [](JNIEnv* env, jarray a, size_t start, size_t n, void* data) {
+        detail::set_jarray(env, a, start, n, *static_cast<const T*>(data));
+    }, true, chunk, prefetch, [&f](void* data, size_t offset, size_t n) { return f(static_cast<T*>(data), offset, n); });
+}
+
+template<typename F>
+size_t RingBuffer::consume(F&& f, size_t max) {
+    size_t n = 0;
+    size_t size = 0;
+    for (const char* p = nullptr; n < max && (p = front(&size)); ++n) {
+        f(static_cast<const void*>(p), size);
+        pop(size);
+    }
+    return n;
+}
 } //namespace jmi
\ No newline at end of file
@@ -0,0 +1,341 @@
+#include <jni.h>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include "jmi.h"
+
+using namespace std;
+using namespace jmi;
+
+struct JMIBenchTag : ClassTag { static constexpr auto name() { return JMISTR("JMIBench");} };
+
+template<typename F>
+static void bench(const char* name, size_t n, F&& f)
+{
+    const auto t0 = chrono::steady_clock::now();
+    f();
+    const chrono::duration<double> dt = chrono::steady_clock::now() - t0;
+    cout << name << ": " << n << " ops in " << dt.count() * 1000.0 << "ms, " << size_t(n / dt.count()) << " ops/s" << endl;
+}
+
+static void benchCreate(size_t n)
+{
+    bench("JObject::create", n, [=]{
+        vector<JObject<JMIBenchTag>> v(n);
+        for (size_t i = 0; i < n; ++i)
+            v[i].create(jint(i), jint(i));
+    });
+    bench("JObject::createMany", n, [=]{
+        auto a = JObject<JMIBenchTag>::createMany(n, [](size_t i) { return make_tuple(jint(i), jint(i)); });
+        if (a.size() != n)
+            cerr << "createMany error: " << a.error() << endl;
+    });
+}
+
+static void nativeNop(JNIEnv*, jclass, jint) {}
+
+static void benchCallback(size_t n)
+{
+    registerNatives<JMIBenchTag>(JMI_NATIVE(nativeNop));
+    bench("native method round trip", n, [=]{
+        JObject<JMIBenchTag>::callStatic("callNative", jint(n));
+    });
+    jint sum = 0;
+    Callback cb([&sum](jint i) { sum += i; });
+    bench("NativeCallback round trip", n, [&]{
+        JObject<JMIBenchTag>::callStatic("callCallback", cb.object(), jint(n));
+    });
+}
+
+struct SetX : MethodTag { static const char* name() { return "setX"; } };
+
+static void benchCommandBuffer(size_t n)
+{
+    JObject<JMIBenchTag> obj;
+    obj.create();
+    bench("call() one by one", n, [&]{
+        for (size_t i = 0; i < n; ++i)
+            obj.call<SetX>(jint(i));
+    });
+    CommandBuffer cmds;
+    bench("CommandBuffer record + execute", n, [&]{
+        for (size_t i = 0; i < n; ++i)
+            cmds.call<void, SetX>(obj, jint(i));
+        if (!cmds.execute())
+            cerr << "CommandBuffer error: " << cmds.error() << endl;
+    });
+    bench("CommandBuffer replay", n, [&]{
+        cmds.execute();
+    });
+}
+
+static void benchRingBuffer(size_t n)
+{
+    bench("event by jni call", n, [=]{
+        for (size_t i = 0; i < n; ++i)
+            JObject<JMIBenchTag>::callStatic("onEvent", jint(i));
+    });
+    RingBuffer events(n * 8); // 8 bytes per jint record
+    const auto& obj = events.object();
+    bench("event by RingBuffer", n, [&]{
+        for (size_t i = 0; i < n; ++i)
+            events.write(jint(i));
+        const auto drained = JObject<JMIBenchTag>::callStatic<jint>("drain", obj);
+        if (drained != jint(n))
+            cerr << "RingBuffer drained " << drained << " events" << endl;
+    });
+}
+
+struct InputStreamTag : ClassTag { static constexpr auto name() { return JMISTR("java/io/InputStream");} };
+
+static void benchInputStream(size_t n)
+{
+    using JInputStream = JObject<InputStreamTag>;
+    vector<jbyte> chunk(64 << 10);
+    bench("InputStream.read(byte[]) by 64KB", n, [&]{
+        auto s = JObject<JMIBenchTag>::callStatic<JInputStream>("newStream", jint(n));
+        while (s.call<jint>("read", std::ref(chunk)) > 0) {}
+    });
+    for (bool prefetch : {false, true}) {
+        bench(prefetch ? "JInputStreamBuf 64KB prefetch" : "JInputStreamBuf 64KB", n, [&]{
+            auto s = JObject<JMIBenchTag>::callStatic<JInputStream>("newStream", jint(n));
+            JInputStreamBuf sb(s.id(), chunk.size(), prefetch);
+            while (sb.sgetn(reinterpret_cast<char*>(chunk.data()), streamsize(chunk.size())) > 0) {}
+        });
+    }
+}
+
+struct ListTag : ClassTag { static constexpr auto name() { return JMISTR("java/util/List");} };
+struct IntegerTag : ClassTag { static constexpr auto name() { return JMISTR("java/lang/Integer");} };
+struct ObjectTag : ClassTag { static constexpr auto name() { return JMISTR("java/lang/Object");} };
+
+static void benchIterate(size_t n)
+{
+    const auto list = JObject<JMIBenchTag>::callStatic<JObject<ListTag>>("newList", jint(n));
+    struct Get : MethodTag { static const char* name() { return "get"; } };
+    struct IntValue : MethodTag { static const char* name() { return "intValue"; } };
+    jlong sum = 0;
+    bench("List.get(i).intValue()", n, [&]{
+        for (size_t i = 0; i < n; ++i)
+            sum += JObject<IntegerTag>(list.call<JObject<ObjectTag>, Get>(jint(i)).id(), false).call<jint, IntValue>();
+    });
+    bench("iterate<jint>() by 1024", n, [&]{
+        for (auto v : iterate<jint>(list))
+            sum += v;
+    });
+    if (sum != jlong(n) * jlong(n - 1))
+        cerr << "iterate sum " << sum << endl;
+}
+
+struct ArrayListTag : ClassTag { static constexpr auto name() { return JMISTR("java/util/ArrayList");} };
+
+static void benchCollections(size_t n)
+{
+    struct Add : MethodTag { static const char* name() { return "add"; } };
+    struct ValueOf : MethodTag { static const char* name() { return "valueOf"; } };
+    bench("ArrayList.add(Integer.valueOf(i))", n, [=]{
+        JObject<ArrayListTag> list;
+        list.create(jint(n));
+        for (size_t i = 0; i < n; ++i)
+            list.call<jboolean, Add>(JObject<ObjectTag>(JObject<IntegerTag>::callStatic<JObject<IntegerTag>, ValueOf>(jint(i)).id(), false));
+    });
+    JList<jint> v(n);
+    for (size_t i = 0; i < n; ++i)
+        v[i] = jint(i);
+    bench("JList<jint> to java and back", n, [&]{
+        const auto r = JObject<JMIBenchTag>::callStatic<JList<jint>>("sameList", v);
+        if (r.size() != n)
+            cerr << "JList size " << r.size() << endl;
+    });
+}
+
+static void benchStringArray(size_t total)
+{
+    for (size_t n : {1, 4, 16, 64, 256, 1024, 100000}) {
+        vector<string> v(n);
+        for (size_t i = 0; i < n; ++i)
+            v[i] = "tag" + to_string(i);
+        for (size_t packing : {0, 1}) {
+            setStringArrayPacking(packing);
+            const string name = "String[" + to_string(n) + "] round trip" + (packing ? " packed" : "");
+            bench(name.data(), total, [&]{ // total strings
+                for (size_t i = 0; i < total / n; ++i) {
+                    if (JObject<JMIBenchTag>::callStatic<vector<string>>("sameStrings", v).size() != n)
+                        cerr << "bad string array" << endl;
+                }
+            });
+        }
+    }
+    setStringArrayPacking(0);
+}
+
+static void benchArrayCast(size_t total)
+{
+    const size_t n = 1 << 20;
+    vector<jint> v(n, 1);
+    bench("vector<jint> as long[] loop", total, [&]{ // total elements
+        for (size_t i = 0; i < total / n; ++i) {
+            vector<jlong> tmp(v.begin(), v.end());
+            if (JObject<JMIBenchTag>::callStatic<jint>("longCount", tmp) != jint(n))
+                cerr << "bad long array" << endl;
+        }
+    });
+    bench("vector<jint> as long[] jarray_cast", total, [&]{
+        for (size_t i = 0; i < total / n; ++i) {
+            if (JObject<JMIBenchTag>::callStatic<jint>("longCount", jarray_cast<jlong>(v)) != jint(n))
+                cerr << "bad long array" << endl;
+        }
+    });
+}
+
+static void benchMatrix(size_t total)
+{
+    const size_t rows = 4096, cols = 64;
+    vector<vector<jfloat>> nested(rows, vector<jfloat>(cols, 1.0f));
+    bench("float[4096][64] round trip vector<vector<jfloat>>", total, [&]{ // total matrices
+        for (size_t i = 0; i < total; ++i) {
+            if (JObject<JMIBenchTag>::callStatic<vector<vector<jfloat>>>("sameMatrix", nested).size() != rows)
+                cerr << "bad matrix" << endl;
+        }
+    });
+    JMatrix<jfloat> m(rows, cols);
+    bench("float[4096][64] round trip JMatrix", total, [&]{
+        for (size_t i = 0; i < total; ++i) {
+            if (JObject<JMIBenchTag>::callStatic<JMatrix<jfloat>>("sameMatrix", m).rows != rows)
+                cerr << "bad matrix" << endl;
+        }
+    });
+}
+
+struct FloatArrayTag : ClassTag { static constexpr auto name() { return JMISTR("[F");} };
+
+static void benchArrayChunks(size_t n)
+{
+    const auto a = JObject<JMIBenchTag>::callStatic<JObject<FloatArrayTag>>("newFloats", jint(n));
+    const auto work = [](const jfloat* data, size_t size) {
+        double sum = 0;
+        for (int k = 0; k < 8; ++k) // some compute to overlap with copy
+            for (size_t i = 0; i < size; ++i)
+                sum += data[i] * k;
+        return sum;
+    };
+    for (size_t chunk : {n, size_t(1) << 20}) {
+        for (bool prefetch : {false, true}) {
+            if (chunk == n && prefetch)
+                continue;
+            const string name = string("float[] ") + (chunk == n ? "whole copy" : "1M chunks") + (prefetch ? " prefetch" : "");
+            bench(name.data(), n, [&]{
+                double sum = 0;
+                readArrayChunks<jfloat>(a.id(), [&](const jfloat* data, size_t, size_t size) {
+                    sum += work(data, size);
+                    return true;
+                }, chunk, prefetch);
+                if (sum < 0)
+                    cerr << "bad sum" << endl;
+            });
+        }
+    }
+}
+
+static void benchParallelArray(size_t n)
+{
+    vector<string> v(n);
+    for (size_t i = 0; i < n; ++i)
+        v[i] = "tag" + to_string(i);
+    const size_t cores = std::max<unsigned>(thread::hardware_concurrency(), 1);
+    for (size_t threads = 0; threads < cores; threads = threads ? threads * 2 : 1) { // caller + worker threads
+        setParallelArrayConversion(threads, 1 << 14);
+        const string name = "String[" + to_string(n) + "] round trip " + to_string(threads + 1) + " threads";
+        bench(name.data(), n, [&]{
+            if (JObject<JMIBenchTag>::callStatic<vector<string>>("sameStrings", v).size() != n)
+                cerr << "bad string array" << endl;
+        });
+    }
+    setParallelArrayConversion(0);
+}
+
+#if (JMI_CXX17+0)
+enum class Unit { Nanos, Micros, Millis, Seconds };
+struct TimeUnitTag : ClassTag { static constexpr auto name() { return JMISTR("java/util/concurrent/TimeUnit");} };
+
+static void benchEnum(size_t n)
+{
+    using TimeUnit = JObject<TimeUnitTag>;
+    bench("enum argument by valueOf", n, [&]{
+        for (size_t i = 0; i < n; ++i) {
+            const auto u = TimeUnit::callStatic<TimeUnit>("valueOf", "SECONDS");
+            if (JObject<JMIBenchTag>::callStatic<jint>("unitOrdinal", u) != 3)
+                cerr << "bad ordinal" << endl;
+        }
+    });
+    const JEnum<Unit, TimeUnitTag> seconds(Unit::Seconds);
+    bench("enum argument by JEnum", n, [&]{
+        for (size_t i = 0; i < n; ++i) {
+            if (JObject<JMIBenchTag>::callStatic<jint>("unitOrdinal", seconds) != 3)
+                cerr << "bad ordinal" << endl;
+        }
+    });
+}
+#endif
+
+static void benchBoxed(size_t n)
+{
+#if (JMI_CXX17+0)
+    using Integer = JObject<IntegerTag>;
+    bench("Integer argument by valueOf", n, [&]{
+        for (size_t i = 0; i < n; ++i) {
+            const auto v = Integer::callStatic<Integer>("valueOf", jint(i & 127));
+            if (JObject<JMIBenchTag>::callStatic<jint>("intOf", v) != jint(i & 127))
+                cerr << "bad Integer" << endl;
+        }
+    });
+#endif
+    bench("Integer argument by cached Boxed", n, [&]{
+        for (size_t i = 0; i < n; ++i) {
+            const Boxed<jint> v(jint(i & 127));
+            if (JObject<JMIBenchTag>::callStatic<jint>("intOf", v) != v)
+                cerr << "bad Integer" << endl;
+        }
+    });
+    bench("Integer argument by uncached Boxed", n, [&]{
+        for (size_t i = 0; i < n; ++i) {
+            const Boxed<jint> v(jint(i | 128));
+            if (JObject<JMIBenchTag>::callStatic<jint>("intOf", v) != v)
+                cerr << "bad Integer" << endl;
+        }
+    });
+}
+
+extern "C" {
+jint JNICALL JNI_OnLoad(JavaVM* vm, void*)
+{
+    JNIEnv* env = nullptr;
+    if (vm->GetEnv((void**) &env, JNI_VERSION_1_4) != JNI_OK || !env) {
+        std::cerr << "GetEnv for JNI_VERSION_1_4 failed" << std::endl;
+        return -1;
+    }
+    jmi::javaVM(vm);
+    return JNI_VERSION_1_4;
+}
+
+JNIEXPORT void JNICALL Java_JMIBench_nativeBench(JNIEnv*, jobject)
+{
+    benchCreate(100000);
+    benchCallback(100000);
+    benchCommandBuffer(100000);
+    benchRingBuffer(100000);
+    benchInputStream(256 << 20); // bytes
+    benchIterate(1000000);
+    benchCollections(1000000);
+    benchStringArray(1000000);
+    benchArrayCast(256 << 20); // elements
+    benchMatrix(100);
+    benchArrayChunks(64 << 20); // elements
+    benchParallelArray(1000000);
+#if (JMI_CXX17+0)
+    benchEnum(1000000);
+#endif
+    benchBoxed(1000000);
+}
+} // extern "C"
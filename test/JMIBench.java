@@ -0,0 +1,69 @@
+import jmi.NativeCallback;
+import jmi.RingBuffer;
+
+public class JMIBench {
+    static {
+        System.loadLibrary("JMIBench");
+    }
+
+    private native void nativeBench();
+    public static void main(String[] args) {
+        new JMIBench().nativeBench();
+    }
+
+    public JMIBench() {}
+    public JMIBench(int x, int y) {
+        this.x = x;
+        this.y = y;
+    }
+
+    public void setX(int v) { x = v; }
+
+    public static void callNative(int n) {
+        for (int i = 0; i < n; ++i)
+            nativeNop(i);
+    }
+    public static void callCallback(NativeCallback cb, int n) {
+        for (int i = 0; i < n; ++i)
+            cb.call(i);
+    }
+    private static native void nativeNop(int i);
+
+    private static long events;
+    public static void onEvent(int v) { events += v; }
+    public static int drain(RingBuffer rb) {
+        byte[] b = new byte[4];
+        int n = 0;
+        while (rb.read(b) > 0) {
+            events += b[0];
+            ++n;
+        }
+        return n;
+    }
+
+    public static java.io.InputStream newStream(int size) {
+        return new java.io.ByteArrayInputStream(new byte[size]);
+    }
+
+    public static java.util.List<Integer> newList(int n) {
+        java.util.List<Integer> v = new java.util.ArrayList<>(n);
+        for (int i = 0; i < n; ++i)
+            v.add(i);
+        return v;
+    }
+
+    public static java.util.List<Integer> sameList(java.util.List<Integer> v) { return v; }
+    public static String[] sameStrings(String[] v) { return v; }
+    public static int longCount(long[] v) { return v.length; }
+    public static float[][] sameMatrix(float[][] m) { return m; }
+    public static int unitOrdinal(java.util.concurrent.TimeUnit u) { return u.ordinal(); }
+    public static int intOf(Integer v) { return v; }
+    public static float[] newFloats(int n) {
+        final float[] v = new float[n];
+        java.util.Arrays.fill(v, 1.0f);
+        return v;
+    }
+
+    public int x;
+    public int y;
+}
@@ -1,7 +1,9 @@
 //#include <valarray>
 #include <jni.h>
 #include <iostream>
+#include <fstream>
 #include <future>
+#include <stdexcept>
 #include <thread>
 #include "jmi.h"
 #include "JMITest.h"
@@ -16,6 +18,54 @@
 using namespace std;
 using namespace jmi;
 
+struct XStr {
+	jint x;
+	std::string str;
+};
+JMI_STRUCT(XStr, x, str)
+
+struct Meter { jint value; };
+struct Label { std::string text; };
+namespace jmi {
+template<> struct Converter<Meter> {
+	using jni_type = jint;
+	static constexpr bool owns_local_ref = false;
+	static constexpr auto signature() { return JMISTR("I"); }
+	static jint to_java(const Meter& m, JNIEnv*) { return m.value; }
+	static Meter from_java(jint v, JNIEnv*) { return {v}; }
+};
+template<> struct Converter<Label> {
+	using jni_type = jstring;
+	static constexpr bool owns_local_ref = true;
+	static constexpr auto signature() { return JMISTR("Ljava/lang/String;"); }
+	static jstring to_java(const Label& s, JNIEnv* env) { return env->NewStringUTF(s.text.data()); }
+	static Label from_java(jstring s, JNIEnv* env) {
+		if (!s)
+			return {};
+		const char* cs = env->GetStringUTFChars(s, nullptr);
+		Label l{cs};
+		env->ReleaseStringUTFChars(s, cs);
+		return l;
+	}
+};
+} // namespace jmi
+
+static jint nativeAdd(JNIEnv*, jobject, jint a, jint b) { return a + b; }
+static std::string nativeJoin(JNIEnv*, jclass, string_view prefix, JArrayView<jint> values)
+{
+	std::string s(prefix);
+	for (auto v : values)
+		s += std::to_string(v);
+	return s;
+}
+static JMITestCached nativeSelf(JNIEnv*, jclass, JMITestCached obj) { return obj; }
+static jint nativeFail(JNIEnv*, jclass, jint a)
+{
+    if (a)
+        throw std::runtime_error("native failed");
+    return a;
+}
+
 void JMITestCached::resetStatic()
 {
 	static constexpr auto MethodName = __func__; //MUST use __func__. msvc __FUNCTION__ contains class name
@@ -253,6 +303,25 @@ void test()
 	ic = jstr.call<jint,IndexOf>(std::string("c"), (jint)1);
 	TEST(ic == 2);
 	TEST(jstr.error().empty());
+	ic = jstr.call<jint>("indexOf", string_view("bcd").substr(1, 1), (jint)0); // not null terminated
+	TEST(ic == 2);
+	for (int i = 0; i < 2; ++i) {
+		TEST(jstr.call<jint>("indexOf", JMI_INTERNED("c"), (jint)0) == 2);
+		TEST(jstr.call<jint>("indexOf", jmi::interned("d"), (jint)0) == 3);
+	}
+	TEST(jmi::interned("d").id() == jmi::interned("d").id());
+	TEST(jstr.call<std::u16string>("toUpperCase") == u"ABCD");
+	TEST((jstr.call<std::u16string, std::u16string>("concat", u"\u4e2d") == u"abcd\u4e2d"));
+#if (JMI_CXX17+0)
+	TEST(jstr.call<JStringView>("toUpperCase").view() == "ABCD");
+	TEST(jstr.call<JU16StringView>("toString").view() == u"abcd");
+	{
+		auto sv = jstr.call<JStringView>("toString");
+		TEST(sv.size() == 4);
+		TEST(sv.view().substr(1, 2) == "bc");
+	}
+#endif
+	TEST((jstr.call<std::string, string_view>("concat", string_view("\xE4\xB8\xAD...", 3)) == "abcd\xE4\xB8\xAD"));
     //jbyte ca[] = {'a', 'b', 'c', 'd'}; // why crash? why const crash?
 	jbyte *ca = (jbyte*)"abcd";
     jstr.reset();
@@ -309,6 +378,13 @@ void test()
 	TEST(str == "text");
 	TEST(test.set("str", std::string(":D setting string...")));
 	TEST(test.get<std::string>("str") == ":D setting string...");
+	TEST(test.set("str", std::u16string(u"\u4e2d")));
+	TEST(test.get<std::u16string>("str") == u"\u4e2d");
+	TEST(test.set("str", string_view(":D setting string...")));
+	TEST(test.get<std::string>("str") == ":D setting string...");
+#if (JMI_CXX17+0)
+	TEST(test.get<JStringView>("str").view() == ":D setting string...");
+#endif
 
 	cout << ">>>>>>>>>>>>testing Cacheable Field APIs..." << endl;
 	struct Str : public jmi::FieldTag { static const char* name() { return "str";}};
@@ -357,9 +433,38 @@ void test()
 	jtc.getIntArrayAsParam(a1);
 	TEST(a1[0] == 1);
 	TEST(a1[1] == 2017);
+	for (size_t cap : {0, 64}) { // pool disabled, enabled
+		jmi::setArrayPoolCapacity(cap);
+		for (int i = 0; i < 3; ++i) {
+			a1 = {};
+			jtc.getIntArrayAsParam(a1);
+			TEST(a1[1] == 2017);
+		}
+		a1 = {5, 5};
+		JMITestCached::callStatic<void>("setFirstInt", std::ref(a1)); // the pooled array was filled by the last call
+		TEST(a1[0] == 1 && a1[1] == 0);
+	}
+	jmi::setArrayPoolCapacity(0);
+	jmi::flushArrayPool();
+	jtc.getIntArrayAsParam(a1);
+	TEST(a1[1] == 2017);
 	std::valarray<jint> av0 = jtc.getIntArray();
 	TEST(av0[0] == 1);
 	TEST(av0[1] == 2017);
+	std::vector<jint> av2;
+	TEST(jtc.callInto("getIntArray", av2) == 2);
+	TEST(av2.size() == 2 && av2[1] == 2017);
+	const auto av2_data = av2.data();
+	struct GetIntArray : MethodTag { static const char* name() {return "getIntArray";}};
+	TEST(jtc.callInto<GetIntArray>(av2) == 2);
+	TEST(av2.data() == av2_data); // size not changed, no reallocation
+	std::array<jint, 1> av3;
+	TEST(jtc.callInto<GetIntArray>(av3) == 2 && av3[0] == 1); // at most av3.size() elements
+	struct IntArray : FieldTag { static const char* name() {return "intArray";}};
+	jint ia[3]{};
+	TEST(jtc.getInto<IntArray>(ia) == 3 && ia[2] == 3);
+	std::valarray<jint> iva;
+	TEST(jtc.getInto("intArray", iva) == 3 && iva[0] == 1);
 	auto sa = jtc.getStrArray();
 	TEST(sa[0] == jtc.getStr());
 	TEST(sa[1] == fsstr.get());
@@ -382,10 +487,324 @@ void test()
 	TEST(selfs[0].getX() == 1231);
 	TEST(selfs[1].getX() == 0);
 
+	ObjectArray<JMITestCached> oa;
+	TEST(oa.create(2));
+	TEST(oa.size() == 2 && !oa[0]);
+	jtc.call("getSelfArray", oa); // elements are set by java
+	TEST(oa[0].call<jint>("getX") == 1231);
+	struct GetX : MethodTag { static const char* name() {return "getX";}};
+	TEST((oa[1].call<jint, GetX>() == 0));
+	JMITestCached oa0;
+	oa0.reset(oa[0]);
+	TEST(oa0.getX() == 1231);
+	ObjectArray<JMITestCached> oa2;
+	TEST(oa2.create(selfs.begin(), selfs.end()));
+	int nx = 0;
+	for (auto&& o : oa2)
+		nx += o.get<jint>("x");
+	TEST(nx == 1231);
+	oa2 = jtc.call<ObjectArray<JMITestCached>>("getSelves", (jint)3);
+	TEST((oa2.size() == 3 && oa2[2].call<jint, GetX>() == 1231));
+	oa2 = JMITestCached::createMany(3, [](size_t i) { return std::make_tuple(jint(i + 1)); });
+	TEST(oa2.error().empty() && oa2.size() == 3);
+	TEST((oa2[0].call<jint, GetX>() == 1 && oa2[2].call<jint, GetX>() == 3));
+	ObjectArray<JMITestCached> oa3;
+	TEST(!oa3.get(0) && !oa3.error().empty());
+	JNIEnv* oaEnv = getEnv();
+	const std::vector<jobject> notSelves{jtc.id(), from_string("x", oaEnv)};
+	TEST(!oa3.create(notSelves.begin(), notSelves.end()) && !oa3.error().empty()); // ArrayStoreException
+	oaEnv->DeleteLocalRef(notSelves[1]);
+
 	auto ufself2 = test.field<JMITestCached>("self");
 	JMITestCached ufselfv2 = ufself2;
 	TEST(ufselfv2.getX() == 3141);
 
+	XStr xs = jtc.load<XStr>();
+	TEST(jtc.error().empty() && xs.x == jtc.getX() && xs.str == jtc.getStr());
+	xs.x = 2718;
+	xs.str = "stored";
+	TEST(jtc.store(xs));
+	TEST(jtc.getX() == 2718 && jtc.getStr() == "stored");
+	vector<XStr> xsv;
+	TEST(oa2.load(xsv) && xsv.size() == 3 && xsv[2].x == 3 && xsv[2].str == "text");
+	xsv[1].x = 5;
+	TEST((oa2.store(xsv) && oa2[1].call<jint, GetX>() == 5));
+	JMITestCached noObj;
+	TEST(!noObj.load(xs) && !noObj.store(xs) && !noObj.error().empty());
+	ObjectArray<JMITestCached> noArr;
+	TEST(!noArr.load(xsv) && !noArr.store(xsv) && !noArr.error().empty());
+
+	jtc.call("setX", Meter{7});
+	TEST(jtc.call<Meter>("getX").value == 7);
+	TEST(jtc.get<Meter>("x").value == 7);
+	TEST(jtc.set("str", Label{"converted"}) && jtc.get<Label>("str").text == "converted");
+	TEST(JMITestCached::callStatic<Label>("getSub", 0, 3, Label{"converter"}).text == "con");
+
+	TEST(registerNatives<JMITestCached>(JMI_NATIVE(nativeAdd), JMI_NATIVE(nativeJoin), JMI_NATIVE(nativeSelf), JMI_NATIVE(nativeFail)));
+	TEST((jtc.call<jint, jint, jint>("nativeAdd", 1, 2) == 3));
+	TEST(JMITestCached::callStatic<std::string>("nativeJoin", "n", vector<jint>{1, 2, 3}) == "n123");
+	TEST((JMITestCached::callStatic<JMITestCached, JMITestCached&>("nativeSelf", jtc).getX() == jtc.getX()));
+	TEST(JMITestCached::callStatic<std::string>("nativeFailMessage", 0) == "0");
+	TEST(JMITestCached::callStatic<std::string>("nativeFailMessage", 1) == "native failed"); // RuntimeException in java
+
+	Callback cb([](jint a, std::string s) { return s + std::to_string(a); });
+	TEST(cb && JMITestCached::callStatic<std::string>("invokeCallback", cb.object(), 1, "s") == "s1");
+	TEST(JMITestCached::callStatic<std::string>("invokeCallbackBadString", cb.object()) == "IllegalArgumentException");
+	Callback add([](jint a, jint b) { return a + b; });
+	TEST(JMITestCached::callStatic<jint>("invokeListener", add.object(), 3, 4) == 7);
+	Callback thrower([](jint a) { if (a) throw std::runtime_error("boom"); return a; });
+	TEST(JMITestCached::callStatic<std::string>("callbackErrors", thrower.object()) == "IllegalArgumentException,IllegalArgumentException,0,RuntimeException,");
+	int ticks = 0;
+	Callback tick([&ticks] { ++ticks; });
+	JMITestCached::callStatic<void>("invokeTick", tick.object());
+	TEST(ticks == 1);
+	const NativeCallback released = cb.object();
+	cb.reset();
+	TEST(JMITestCached::callStatic<std::string>("invokeCallback", released, 1, "s").empty());
+
+	CommandBuffer cmds;
+	const auto setX = cmds.call(jtc, "setX", (jint)11);
+	const auto getX = cmds.call<jint>(jtc, "getX");
+	const auto getX2 = cmds.call<jint, GetX>(jtc);
+	const auto sub = cmds.callStatic<JMITestCached, std::string>("getSub", 0, 3, "command");
+	const auto self = cmds.call<JMITestCached>(jtc, "getSelf");
+	const auto bad = cmds.call<std::string>(jtc, "sub", 5, 1); // StringIndexOutOfBoundsException
+	TEST(cmds.call(jtc, "noSuchMethod") == CommandBuffer::npos && !cmds.error().empty());
+	TEST(cmds.size() == 6 && !cmds.execute());
+	TEST((cmds.ok(setX) && cmds.result<jint>(getX) == 11 && cmds.result<jint>(getX2) == 11));
+	TEST(cmds.result<std::string>(sub) == "com" && cmds.result<JMITestCached>(self).getX() == 11);
+	TEST(!cmds.ok(bad) && !cmds.error(bad).empty() && cmds.error(getX).empty());
+	jtc.setX(12);
+	TEST(!cmds.execute() && jtc.getX() == 11); // replay
+	cmds.clear();
+	TEST(cmds.empty() && cmds.execute());
+	JNIEnv* cmdEnv = getEnv();
+	jstring rawStr = from_string("raw", cmdEnv);
+	const auto raw = cmds.callStatic<JMITestCached, std::string>("concatRaw", rawStr, jobject(rawStr));
+	TEST(cmds.execute() && cmds.result<std::string>(raw) == "rawraw");
+	TEST(cmdEnv->GetStringUTFLength(rawStr) == 3); // not deleted by CommandBuffer
+	cmdEnv->DeleteLocalRef(rawStr);
+	cmds.clear();
+
+	RingBuffer ring(64);
+	TEST(ring.capacity() == 64 && ring.write(jint(1)) && ring.write(jint(2)) && ring.write(jint(3)));
+	TEST(JMITestCached::callStatic<jint>("sumRing", ring.object()) == 6);
+	jint rv = 0;
+	TEST(!ring.read(rv) && !ring.wait(0));
+	auto ringWaiter = async(launch::async, [&ring]{ return ring.wait(5000); });
+	this_thread::sleep_for(chrono::milliseconds(50));
+	TEST(JMITestCached::callStatic<jint>("fillRing", ring.object(), 5) == 5); // wakes up c++ consumer by NativeCallback
+	TEST(ringWaiter.get());
+	size_t ringBytes = 0;
+	TEST(ring.consume([&](const void*, size_t size) { ringBytes += size; }) == 5 && ringBytes == 15);
+	for (int i = 0; i < 10; ++i) { // 24 bytes per record, wrap around with padding
+		array<char, 20> w{}, r{};
+		w[0] = char(i);
+		TEST(ring.write(w) && ring.read(r.data(), r.size()) == 20 && r[0] == char(i));
+	}
+	JRingBuffer orphan;
+	{
+		RingBuffer shortLived(64);
+		orphan = shortLived.object();
+		TEST(shortLived.write(jint(7)));
+	}
+	TEST(JMITestCached::callStatic<jint>("fillRing", orphan, 2) == 2 && JMITestCached::callStatic<jint>("sumRing", orphan) == 7); // memory is held by java
+
+	{
+		ofstream f("jmi_mapped.bin", ios::binary);
+		for (int i = 0; i < 10000; ++i)
+			f.put(char(i % 251));
+	}
+	MappedBuffer mapped("jmi_mapped.bin", 5000, 4000); // not page aligned
+	TEST(mapped && mapped.size() == 4000 && mapped.data()[0] == char(5000 % 251) && mapped.advise(MappedBuffer::Sequential));
+	TEST(!MappedBuffer("jmi_mapped.bin", 9000, 2000) && !MappedBuffer("jmi_no_such_file").error().empty());
+	JByteBuffer window = mapped.window(100, 10);
+	mapped.reset(); // unmapped after window is garbage collected
+	TEST(window.call<jint>("capacity") == 10 && window.call<jboolean>("isReadOnly"));
+	TEST(JMITestCached::callStatic<jint>("sumBytes", window) == (5100 % 251) * 10 + 45);
+	TEST(!mapped.window());
+
+	struct JInputStream : ClassTag { static constexpr auto name() { return JMISTR("java/io/InputStream"); } };
+	struct JByteArrayOutputStream : ClassTag { static constexpr auto name() { return JMISTR("java/io/ByteArrayOutputStream"); } };
+	JObject<JByteArrayOutputStream> bytesOut;
+	TEST(bytesOut.create());
+	for (bool prefetch : {false, true}) {
+		JInputStreamBuf inBuf(JMITestCached::callStatic<JObject<JInputStream>>("bytesStream", 100000).id(), 4096, prefetch);
+		istream in(&inBuf);
+		JOutputStreamBuf outBuf(bytesOut.id(), 1000);
+		ostream out(&outBuf);
+		size_t nin = 0;
+		for (char c; in.get(c); ++nin)
+			TEST(c == char(nin % 251));
+		TEST(nin == 100000 && inBuf.error().empty());
+		out << "jmi" << 2026;
+		TEST(out.flush() && bytesOut.call<jint>("size") == (prefetch ? 14 : 7));
+	}
+	TEST(bytesOut.call<std::string>("toString") == "jmi2026jmi2026");
+
+	auto produced = make_shared<size_t>(0);
+	auto nativeIn = makeInputStream([produced](char* data, size_t size) {
+		size = std::min<size_t>(size, 100000 - *produced);
+		for (size_t i = 0; i < size; ++i, ++*produced)
+			data[i] = char(*produced % 251);
+		return size;
+	}, 1000);
+	TEST(JMITestCached::callStatic<jint>("sumStream", nativeIn) == 12492401 && produced.use_count() == 1); // source is destroyed by close()
+	auto failedIn = makeInputStream([](char*, size_t) -> size_t { throw std::runtime_error("source failed"); });
+	TEST(JMITestCached::callStatic<std::string>("readFailure", failedIn) == "IOException: source failed");
+
+	struct ListTag : ClassTag { static constexpr auto name() { return JMISTR("java/util/List"); } };
+	const auto list = JMITestCached::callStatic<JObject<ListTag>>("intList", 2500);
+	jlong listSum = 0;
+	size_t listSize = 0;
+	for (auto v : iterate<jint>(list, 1000)) { // 3 chunks
+		listSum += v;
+		++listSize;
+	}
+	TEST(listSize == 2500 && listSum == 2500 * 2499 / 2);
+	vector<std::string> strs;
+	for (const auto& v : iterate<std::string>(JMITestCached::callStatic<JObject<ListTag>>("strList", 4), 2))
+		strs.push_back(v);
+	TEST((strs == vector<std::string>{"0", "1", "2", "3"}));
+	auto emptyRange = iterate<jint>(JMITestCached::callStatic<JObject<ListTag>>("intList", 0));
+	TEST(emptyRange.begin() == emptyRange.end() && emptyRange.error().empty());
+	auto badRange = iterate<jint>(jtc); // not Iterable
+	TEST(badRange.begin() == badRange.end() && !badRange.error().empty());
+
+	const JList<jint> jlist{1, 2, 3};
+	TEST((JMITestCached::callStatic<JList<jint>>("reverseList", jlist) == JList<jint>{3, 2, 1}));
+	const std::set<std::string> strSet{"a", "b"};
+	TEST((JMITestCached::callStatic<std::set<std::string>>("upperSet", strSet) == std::set<std::string>{"A", "B"}));
+	const std::unordered_map<std::string, jlong> counts{{"x", 1}, {"y", 1LL << 40}};
+	const auto incCounts = JMITestCached::callStatic<std::unordered_map<std::string, jlong>>("incValues", counts);
+	TEST(incCounts.size() == 2 && incCounts.at("x") == 2 && incCounts.at("y") == (1LL << 40) + 1);
+	const std::set<bool> boolSet{true};
+	TEST((JMITestCached::callStatic<std::set<bool>>("copySet", boolSet) == boolSet));
+	const std::map<bool, jlong> boolKeys{{false, 1}, {true, 2}};
+	TEST((JMITestCached::callStatic<std::map<bool, jlong>>("incValues", boolKeys) == std::map<bool, jlong>{{false, 2}, {true, 3}}));
+	const std::map<jint, jdouble> emptyMap;
+	TEST((JMITestCached::callStatic<std::map<jint, jdouble>>("incValues", emptyMap).empty()));
+
+	const std::vector<std::string> packedStrs{"jmi", "", "\xe4\xb8\xad\xe6\x96\x87", "\xf0\x9f\x98\x80", std::string(1000, 'x')}; // packed strings are standard utf-8
+	setStringArrayPacking(2);
+	TEST(JMITestCached::callStatic<std::vector<std::string>>("sameStrings", packedStrs) == packedStrs);
+	TEST((JMITestCached::callStatic<std::vector<std::string>>("nullStrings") == std::vector<std::string>{"a", "", "b"}));
+	setStringArrayPacking(0);
+
+	std::vector<int32_t> ms(1001);
+	for (size_t i = 0; i < ms.size(); ++i)
+		ms[i] = int32_t(i) - 500;
+	ms.front() = ms.back() = INT32_MAX; // overflows if summed as int
+	TEST(JMITestCached::callStatic<jlong>("sumLongs", jarray_cast<jlong>(ms)) == 2LL * INT32_MAX);
+	std::vector<double> samples{1.0, -3.0, 0.5, 1e10, 7.0};
+	JMITestCached::callStatic("halveFloats", jarray_cast<jfloat>(samples)); // converted back
+	TEST((samples == std::vector<double>{0.5, -1.5, 0.25, double(1e10f / 2), 3.5}));
+	const std::vector<uint8_t> pixels{0, 128, 255};
+	TEST(JMITestCached::callStatic<jint>("byteAt", jarray_cast<jbyte>(pixels), 2) == -1);
+	std::vector<jint> squares;
+	auto squaresCast = jarray_cast<jlong>(squares);
+	TEST(JMITestCached::callStaticInto("squares", squaresCast, 4) == 4 && squares == std::vector<jint>({0, 1, 4, 9}));
+	std::vector<float> ratios;
+	auto ratiosCast = jarray_cast<jdouble>(ratios);
+	TEST(JMITestCached::getStaticInto("ratios", ratiosCast) == 3 && ratios[1] == 1.5f);
+
+	const std::vector<std::vector<float>> rows{{1, 2, 3}, {4, 5, 6}};
+	TEST((JMITestCached::callStatic<std::vector<std::vector<float>>>("transpose", rows) == std::vector<std::vector<float>>{{1, 4}, {2, 5}, {3, 6}}));
+	const auto cube = JMITestCached::callStatic<std::vector<std::vector<std::vector<jint>>>>("cube", 3);
+	TEST(cube.size() == 3 && cube[2].size() == 3 && cube[2][1].size() == 3 && cube[2][1][0] == 210);
+	TEST(JMITestCached::callStatic<jint>("sumCube", cube) == 9 * (111 * 3));
+	JMatrix<jfloat> mat(2, 3);
+	for (size_t i = 0; i < mat.data.size(); ++i)
+		mat.data[i] = float(i);
+	const auto matT = JMITestCached::callStatic<JMatrix<jfloat>>("transpose", mat);
+	TEST(matT.rows == 3 && matT.cols == 2 && (matT.data == std::vector<jfloat>{0, 3, 1, 4, 2, 5}));
+	const jfloat buf[] = {1, 2, 3, 4};
+	TEST((JMITestCached::callStatic<JMatrix<jfloat>>("transpose", JMatrixView<jfloat>{buf, 1, 4}).data == std::vector<jfloat>{1, 2, 3, 4}));
+	JMatrix<jfloat> badMat(2, 2);
+	badMat.data.pop_back();
+	TEST(JMITestCached::callStatic<JMatrix<jfloat>>("transpose", badMat).rows == 0); // IllegalArgumentException, transpose is not called
+
+	struct IntArrayTag : ClassTag { static constexpr auto name() { return JMISTR("[I"); } };
+	const auto ints = JMITestCached::callStatic<JObject<IntArrayTag>>("newInts", 10000);
+	const auto fillInts = [](jint* data, size_t offset, size_t n) {
+		for (size_t i = 0; i < n; ++i)
+			data[i] = jint(offset + i);
+		return true;
+	};
+	TEST(writeArrayChunks<jint>(ints.id(), fillInts, 1000) == 10000);
+	TEST(JMITestCached::callStatic<jlong>("sumInts", ints) == 10000LL * 9999 / 2);
+	for (bool prefetch : {false, true}) {
+		jlong chunkSum = 0;
+		size_t next = 0;
+		const auto sumInts = [&](const jint* data, size_t offset, size_t n) {
+			TEST(offset == next);
+			next = offset + n;
+			for (size_t i = 0; i < n; ++i)
+				chunkSum += data[i];
+			return true;
+		};
+		TEST(readArrayChunks<jint>(ints.id(), sumInts, 999, prefetch) == 10000);
+		TEST(chunkSum == 10000LL * 9999 / 2);
+	}
+	TEST(readArrayChunks<jint>(ints.id(), [](const jint*, size_t offset, size_t) { return offset < 2000; }, 1000) == 3000); // stopped after the 3rd chunk
+	for (bool write : {false, true}) {
+		bool thrown = false;
+		try { // background thread is stopped and joined
+			const auto fail = [](const jint*, size_t offset, size_t) { if (offset >= 2000) throw std::runtime_error("chunk"); return true; };
+			if (write)
+				writeArrayChunks<jint>(ints.id(), [&](jint* data, size_t offset, size_t n) { return fail(data, offset, n); }, 1000, true);
+			else
+				readArrayChunks<jint>(ints.id(), fail, 1000, true);
+		} catch (const std::runtime_error&) {
+			thrown = true;
+		}
+		TEST(thrown);
+	}
+	TEST(writeArrayChunks<jint>(ints.id(), fillInts, 1000, true) == 10000); // restored
+	TEST(JMITestCached::callStatic<jlong>("sumInts", ints) == 10000LL * 9999 / 2);
+
+	setParallelArrayConversion(3, 8);
+	std::vector<std::string> manyStrs(1000);
+	for (size_t i = 0; i < manyStrs.size(); ++i)
+		manyStrs[i] = "s" + std::to_string(i);
+	TEST(JMITestCached::callStatic<std::vector<std::string>>("sameStrings", manyStrs) == manyStrs);
+	const auto bigCube = JMITestCached::callStatic<std::vector<std::vector<std::vector<jint>>>>("cube", 10); // nested rows are converted in workers
+	TEST(bigCube.size() == 10 && bigCube[9][8][7] == 987);
+	TEST(JMITestCached::callStatic<jint>("sumCube", bigCube) == 111 * 4500);
+	setParallelArrayConversion(0);
+
+#if (JMI_CXX17+0)
+	enum class Unit { Nanos, Micros, Millis, Seconds, Minutes, Hours, Days };
+	struct TimeUnitTag : ClassTag { static constexpr auto name() { return JMISTR("java/util/concurrent/TimeUnit"); } };
+	using TimeUnit = JEnum<Unit, TimeUnitTag>;
+	TEST(JMITestCached::callStatic<jlong>("toMillis", TimeUnit(Unit::Seconds), jlong(3)) == 3000);
+	const TimeUnit hours(Unit::Hours), days(Unit::Days);
+	TEST(JMITestCached::callStatic<TimeUnit>("coarser", hours) == Unit::Days);
+	TEST(JMITestCached::callStatic<TimeUnit>("coarser", days) == Unit(-1)); // null
+#endif
+
+	const Boxed<jint> smallInt(3), bigInt(100000), nullInt;
+	TEST(JMITestCached::callStatic<Boxed<jint>>("boxedInc", smallInt) == 4);
+	TEST(JMITestCached::callStatic<Boxed<jint>>("boxedInc", bigInt) == 100001);
+	TEST(JMITestCached::callStatic<Boxed<jint>>("boxedInc", nullInt).null);
+	TEST(JMITestCached::callStatic<jboolean>("isCachedInteger", smallInt)); // the same object as Integer.valueOf(3)
+	const Boxed<jboolean> yes(JNI_TRUE);
+	TEST(JMITestCached::callStatic<Boxed<jboolean>>("boxedNot", yes) == JNI_FALSE);
+	struct HashMapTag : ClassTag { static constexpr auto name() { return JMISTR("java/util/HashMap"); } };
+	JObject<HashMapTag> boxedMap;
+	TEST(boxedMap.create());
+	const Boxed<jlong, true> boxedKey(7);
+	const Boxed<jdouble, true> boxedValue(1.5);
+	TEST((boxedMap.call<Boxed<jdouble, true>>("put", boxedKey, boxedValue).null));
+	TEST((boxedMap.call<Boxed<jdouble, true>>("get", boxedKey) == 1.5));
+#if (JMI_CXX17+0)
+	struct NotEnumTag : ClassTag { static constexpr auto name() { return JMISTR("java/lang/Object"); } };
+	using NotEnum = JEnum<Unit, NotEnumTag>;
+	const NotEnum notEnum(Unit::Days);
+	for (int i = 0; i < 2; ++i) // not cached, every call reports the error
+		TEST(boxedMap.call<NotEnum>("put", notEnum, notEnum) == Unit(-1) && boxedMap.error().find("Not a java enum") != std::string::npos);
+#endif
+
 	cout << ">>>>>>>>>>>>testing JMITestUncached APIs..." << endl;
 	JMITestUncached jtuc;
 	JMITestUncached::setY(604);
@@ -1,11 +1,28 @@
 import java.lang.StringBuffer;
+import jmi.NativeCallback;
+import jmi.RingBuffer;
 
 public class JMITest {
     static {
         System.loadLibrary("JMITest");
     }
 
+    public JMITest() {}
+    public JMITest(int x) { this.x = x; }
+
     private native void nativeTest();
+    // registered by jmi::registerNatives()
+    public native int nativeAdd(int a, int b);
+    public static native String nativeJoin(String prefix, int[] values);
+    public static native JMITest nativeSelf(JMITest obj);
+    public static native int nativeFail(int a);
+    public static String nativeFailMessage(int a) {
+        try {
+            return String.valueOf(nativeFail(a));
+        } catch (RuntimeException e) {
+            return e.getMessage();
+        }
+    }
     public static void main(String[] args) {
         new JMITest().nativeTest();  // invoke the native method
     }
@@ -61,10 +78,185 @@ public class JMITest {
         v[0] = this;
         v[1] = new JMITest();
     }
+    public static String invokeCallback(NativeCallback cb, int a, String s) {
+        return (String)cb.call(a, s);
+    }
+    // null, String, valid int, and an int for which c++ throws
+    public static String callbackErrors(NativeCallback cb) {
+        final StringBuilder sb = new StringBuilder();
+        for (Object a : new Object[]{null, "x", 0, 1}) {
+            try {
+                sb.append(cb.call(a));
+            } catch (RuntimeException e) {
+                sb.append(e.getClass().getSimpleName());
+            }
+            sb.append(',');
+        }
+        return sb.toString();
+    }
+    public static void invokeTick(NativeCallback cb) { cb.call(); }
+    public static String concatRaw(String s, Object o) { return s + o; }
+    public static String invokeCallbackBadString(NativeCallback cb) {
+        try {
+            return (String)cb.call(1, 2); // Integer for a std::string parameter
+        } catch (IllegalArgumentException e) {
+            return e.getClass().getSimpleName();
+        }
+    }
+    public static int invokeListener(NativeCallback cb, int a, int b) {
+        return cb.as(java.util.function.IntBinaryOperator.class).applyAsInt(a, b);
+    }
+    public static int sumRing(RingBuffer rb) {
+        byte[] b = new byte[4];
+        int sum = 0;
+        while (rb.read(b) == 4)
+            sum += java.nio.ByteBuffer.wrap(b).order(java.nio.ByteOrder.nativeOrder()).getInt();
+        return sum;
+    }
+    public static int fillRing(RingBuffer rb, int n) {
+        int written = 0;
+        for (int i = 0; i < n; ++i) {
+            if (rb.write(new byte[]{(byte)i, 1, 2}))
+                ++written;
+        }
+        return written;
+    }
+    public static java.io.InputStream bytesStream(int n) {
+        byte[] b = new byte[n];
+        for (int i = 0; i < n; ++i)
+            b[i] = (byte)(i % 251);
+        return new java.io.ByteArrayInputStream(b);
+    }
+    public static java.util.List<Integer> intList(int n) {
+        java.util.List<Integer> v = new java.util.ArrayList<>();
+        for (int i = 0; i < n; ++i)
+            v.add(i);
+        return v;
+    }
+    public static java.util.List<String> strList(int n) {
+        java.util.List<String> v = new java.util.LinkedList<>();
+        for (int i = 0; i < n; ++i)
+            v.add(String.valueOf(i));
+        return v;
+    }
+    public static String[] sameStrings(String[] v) { return v; }
+    public static String[] nullStrings() { return new String[]{"a", null, "b"}; }
+    public static long sumLongs(long[] v) {
+        long sum = 0;
+        for (long x : v)
+            sum += x;
+        return sum;
+    }
+    public static void halveFloats(float[] v) {
+        for (int i = 0; i < v.length; ++i)
+            v[i] /= 2;
+    }
+    public static int byteAt(byte[] v, int i) { return v[i]; }
+    public static long[] squares(int n) {
+        final long[] v = new long[n];
+        for (int i = 0; i < n; ++i)
+            v[i] = (long)i * i;
+        return v;
+    }
+    public static double[] ratios = {0.5, 1.5, 2.5};
+    public static float[][] transpose(float[][] m) {
+        final float[][] t = new float[m.length == 0 ? 0 : m[0].length][m.length];
+        for (int i = 0; i < m.length; ++i)
+            for (int j = 0; j < m[i].length; ++j)
+                t[j][i] = m[i][j];
+        return t;
+    }
+    public static long toMillis(java.util.concurrent.TimeUnit u, long d) { return u.toMillis(d); }
+    public static java.util.concurrent.TimeUnit coarser(java.util.concurrent.TimeUnit u) {
+        final java.util.concurrent.TimeUnit[] units = java.util.concurrent.TimeUnit.values();
+        return u.ordinal() + 1 < units.length ? units[u.ordinal() + 1] : null;
+    }
+    public static Integer boxedInc(Integer v) { return v == null ? null : v + 1; }
+    public static boolean isCachedInteger(Integer v) { return v == Integer.valueOf(v); }
+    public static Boolean boxedNot(Boolean b) { return b == null ? null : !b; }
+    public static int[] newInts(int n) { return new int[n]; }
+    public static long sumInts(int[] v) {
+        long sum = 0;
+        for (int x : v)
+            sum += x;
+        return sum;
+    }
+    public static int[][][] cube(int n) {
+        final int[][][] c = new int[n][n][n];
+        for (int i = 0; i < n; ++i)
+            for (int j = 0; j < n; ++j)
+                for (int k = 0; k < n; ++k)
+                    c[i][j][k] = i * 100 + j * 10 + k;
+        return c;
+    }
+    public static int sumCube(int[][][] c) {
+        int sum = 0;
+        for (int[][] p : c)
+            for (int[] r : p)
+                for (int x : r)
+                    sum += x;
+        return sum;
+    }
+    public static java.util.List<Integer> reverseList(java.util.List<Integer> v) {
+        java.util.Collections.reverse(v);
+        return v;
+    }
+    public static java.util.Set<String> upperSet(java.util.Set<String> s) {
+        java.util.Set<String> r = new java.util.TreeSet<>();
+        for (String e : s)
+            r.add(e.toUpperCase());
+        return r;
+    }
+    public static java.util.Set<Object> copySet(java.util.Set<Object> s) {
+        return new java.util.HashSet<>(s);
+    }
+    public static java.util.Map<Object, Long> incValues(java.util.Map<Object, Long> m) {
+        java.util.Map<Object, Long> r = new java.util.HashMap<>();
+        for (java.util.Map.Entry<Object, Long> e : m.entrySet())
+            r.put(e.getKey(), e.getValue() + 1);
+        return r;
+    }
+    public static int sumStream(jmi.NativeInputStream in) throws java.io.IOException {
+        int sum = 0;
+        final byte[] b = new byte[50000];
+        final int n = in.readNBytes(b, 0, b.length);
+        for (int i = 0; i < n; ++i)
+            sum += b[i] & 0xff;
+        final java.nio.ByteBuffer d = java.nio.ByteBuffer.allocateDirect(4096);
+        while (in.read(d) > 0) {
+            d.flip();
+            while (d.hasRemaining())
+                sum += d.get() & 0xff;
+            d.clear();
+        }
+        in.close();
+        return sum;
+    }
+    public static String readFailure(jmi.NativeInputStream in) {
+        try (jmi.NativeInputStream s = in) {
+            s.read(java.nio.ByteBuffer.allocateDirect(16));
+            return "";
+        } catch (java.io.IOException e) {
+            return e.getClass().getSimpleName() + ": " + e.getMessage();
+        }
+    }
+    public static void setFirstInt(int[] a) { a[0] = 1; }
+    public static int sumBytes(java.nio.ByteBuffer b) {
+        int sum = 0;
+        for (int i = 0; i < b.capacity(); ++i)
+            sum += b.get(i) & 0xff;
+        return sum;
+    }
+    public JMITest[] getSelves(int n) {
+        JMITest[] v = new JMITest[n];
+        java.util.Arrays.fill(v, this);
+        return v;
+    }
 
     private int x;
     private static float y = 168;
     private String str = "text";
     private static String sstr = "static text";
     public JMITest self = this;
+    public int[] intArray = {1, 2, 3};
 }